@@ -4,6 +4,6 @@ set -e
 set -x
 rm -f compiler
 #time clang++ src/all.cpp -o compiler
-time clang++ -nodefaultlibs -g -O0 src/main.cpp -o compiler -lc -ldl -pthread -lpthread
-time ./compiler
+time clang++ -nodefaultlibs -fno-exceptions -g -O0 src/main.cpp -o compiler -lc -ldl -pthread -lpthread
+#time ./compiler entry.c6
 #time valgrind ./compiler
@@ -1,15 +1,32 @@
 #include "utils/allocator.cpp"
 #include "utils/clock.cpp"
+#include "utils/fiber.cpp"
 #include "utils/fs.cpp"
+#include "utils/hash.cpp"
+#include "utils/iouring.cpp"
+#include "utils/json.cpp"
+#include "utils/numa.cpp"
 #include "utils/string.cpp"
 #include "utils/testsystem.cpp"
+#include "utils/trace.cpp"
 #include "utils/utf8.cpp"
 
 #include "parsing/tokenization.cpp"
 #include "parsing/parser.cpp"
 
 #include "ast.cpp"
+#include "ast_compaction.cpp"
+#include "ast_walker.cpp"
+#include "ast_hash.cpp"
+#include "ast_cache.cpp"
+#include "ast_index.cpp"
 #include "core_types.cpp"
 #include "reporting.cpp"
 
+#include "file_loader.cpp"
 #include "compiler.cpp"
+#include "snapshot.cpp"
+#include "server.cpp"
+#include "watch.cpp"
+#include "query.cpp"
+#include "lsp.cpp"
@@ -3,9 +3,16 @@
 #include "utils/allocator.h"
 #include "utils/array.h"
 #include "utils/clock.h"
+#include "utils/fiber.h"
 #include "utils/fs.h"
+#include "utils/hash.h"
+#include "utils/heap.h"
+#include "utils/iouring.h"
+#include "utils/json.h"
+#include "utils/numa.h"
 #include "utils/string.h"
 #include "utils/testsystem.h"
+#include "utils/trace.h"
 #include "utils/utf8.h"
 
 #include "core_types.h"
@@ -13,6 +20,17 @@
 #include "parsing/parser.h"
 
 #include "ast.h"
+#include "ast_compaction.h"
+#include "ast_walker.h"
+#include "ast_hash.h"
+#include "ast_cache.h"
+#include "ast_index.h"
 #include "reporting.h"
 
+#include "file_loader.h"
 #include "compiler.h"
+#include "snapshot.h"
+#include "server.h"
+#include "watch.h"
+#include "query.h"
+#include "lsp.h"
@@ -1,4 +1,13 @@
 #include "tests/lexer.cpp"
 #include "tests/ast.cpp"
+#include "tests/allocator.cpp"
+#include "tests/fiber.cpp"
+#include "tests/heap.cpp"
+#include "tests/core_types.cpp"
 #include "tests/parser.cpp"
 #include "tests/compiler.cpp"
+#include "tests/server.cpp"
+#include "tests/watch.cpp"
+#include "tests/lsp.cpp"
+#include "tests/query.cpp"
+#include "tests/trace.cpp"
@@ -8,13 +8,31 @@ AST* setupASTNode(AST *node, ASTNodeType type, size_t size) {
 
 const char *toString(ASTNodeType type) {
   switch (type) {
-  #define XX(NAME, STRUCT) case NAME ## _: return #NAME;
+  #define XX(NAME, FIELDS) case NAME ## _: return #NAME;
   AST_NODES_LIST
   #undef XX
   default: return "unknown";
   } 
 }
 
+size_t astNodeSize(ASTNodeType type) {
+  switch (type) {
+  #define XX(NAME, FIELDS) case NAME ## _: return sizeof(NAME);
+  AST_NODES_LIST
+  #undef XX
+  default: abort();
+  }
+}
+
+size_t astNodeAlignment(ASTNodeType type) {
+  switch (type) {
+  #define XX(NAME, FIELDS) case NAME ## _: return alignof(NAME);
+  AST_NODES_LIST
+  #undef XX
+  default: abort();
+  }
+}
+
 AST *astSafeCastImpl(AST *node, ASTNodeType wantedType) {
   if (node->type == wantedType) {
     return node;
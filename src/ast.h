@@ -4,6 +4,8 @@
 
 enum ASTFlags {
   AST_FLAGS_EXPR_IN_PAREN = 1 << 0,
+  // Node was moved by compaction, new address is stored in the old node
+  AST_FLAGS_FORWARDED = 1 << 1,
 };
 
 enum UnaryOp {
@@ -51,77 +53,73 @@ struct ASTStruct;
 struct ASTVar;
 struct ASTBlock;
 
+// Every node lists its fields as:
+//   AST_VALUE(TYPE, NAME)    - plain data
+//   AST_CHILD(TYPE, NAME)    - owned subtree, TYPE *NAME
+//   AST_CHILDREN(TYPE, NAME) - owned subtrees, Array<TYPE *> NAME
+//   AST_REF(TYPE, NAME)      - non-owning pointer to another node, TYPE *NAME
+// so struct definitions, traversal and relocation are generated from it.
+// ASTTypeUse is where a type expression shared by hash-consing is used (see
+// hashAST), parser never produces it.
 #define AST_NODES_LIST                                                         \
-  XX(ASTIdentifier, { Str name; })                                             \
-  XX(ASTUnaryOp, {                                                             \
-    UnaryOp op;                                                                \
-    AST *operand;                                                              \
-  })                                                                           \
-  XX(ASTBinaryOp, {                                                            \
-    BinaryOp op;                                                               \
-    AST *left;                                                                 \
-    AST *right;                                                                \
-  })                                                                           \
-  XX(ASTCall, {                                                                \
-    AST *callee;                                                               \
-    Array<AST *> args;                                                         \
-  })                                                                           \
-  XX(ASTSubscript, {                                                           \
-    AST *indexable;                                                            \
-    AST *index;                                                                \
-  })                                                                           \
-  XX(ASTCast, {                                                                \
-    AST *operand;                                                              \
-    AST *toTypeExpr;                                                           \
-  })                                                                           \
-  XX(ASTMemberAccess, {                                                        \
-    AST *structLike;                                                           \
-    ASTIdentifier *field;                                                      \
-  })                                                                           \
-  XX(ASTNumberLiteral, { Str value; })                                         \
-  XX(ASTStringLiteral, { Str value; })                                         \
-  XX(ASTFile, { Array<AST *> topLevelDecls; })                                 \
-  XX(ASTLoadDirective, { ASTStringLiteral *path; })                            \
-  XX(ASTStruct, {                                                              \
-    ASTIdentifier *name;                                                       \
-    Array<ASTVar *> members;                                                   \
-  })                                                                           \
-  XX(ASTConst, {                                                               \
-    ASTIdentifier *name;                                                       \
-    AST *initExpr;                                                             \
-    AST *parentScope;                                                          \
-  })                                                                           \
-  XX(ASTVar, {                                                                 \
-    ASTIdentifier *name;                                                       \
-    AST *typeExpr;                                                             \
-    AST *initExpr;                                                             \
-    AST *parentScope;                                                          \
-  })                                                                           \
-  XX(ASTFunction, {                                                            \
-    ASTIdentifier *name;                                                       \
-    Array<ASTVar *> args;                                                      \
-    Array<ASTVar *> returns;                                                   \
-    ASTBlock *body;                                                            \
-  })                                                                           \
-  XX(ASTBlock, { Array<AST *> statements; })                                   \
-  XX(ASTVariableDefinition, {                                                  \
-    Array<ASTIdentifier *> names;                                              \
-    AST *typeExpr;                                                             \
-    Array<AST *> initilizationValues;                                          \
-  })                                                                           \
-  XX(ASTIfStatement, {                                                         \
-    AST *conditionExpr;                                                        \
-    AST *thenStatement;                                                        \
-    AST *elseStatement;                                                        \
-  })                                                                           \
-  XX(ASTWhileLoop, {                                                           \
-    AST *condition;                                                            \
-    AST *body;                                                                 \
-  })                                                                           \
-  XX(ASTDeferStatement, { AST *statement; })
+  XX(ASTIdentifier, AST_VALUE(Str, name))                                      \
+  XX(ASTUnaryOp,                                                               \
+     AST_VALUE(UnaryOp, op)                                                    \
+     AST_CHILD(AST, operand))                                                  \
+  XX(ASTBinaryOp,                                                              \
+     AST_VALUE(BinaryOp, op)                                                   \
+     AST_CHILD(AST, left)                                                      \
+     AST_CHILD(AST, right))                                                    \
+  XX(ASTCall,                                                                  \
+     AST_CHILD(AST, callee)                                                    \
+     AST_CHILDREN(AST, args))                                                  \
+  XX(ASTSubscript,                                                             \
+     AST_CHILD(AST, indexable)                                                 \
+     AST_CHILD(AST, index))                                                    \
+  XX(ASTCast,                                                                  \
+     AST_CHILD(AST, operand)                                                   \
+     AST_CHILD(AST, toTypeExpr))                                               \
+  XX(ASTMemberAccess,                                                          \
+     AST_CHILD(AST, structLike)                                                \
+     AST_CHILD(ASTIdentifier, field))                                          \
+  XX(ASTNumberLiteral, AST_VALUE(Str, value))                                  \
+  XX(ASTStringLiteral, AST_VALUE(Str, value))                                  \
+  XX(ASTFile, AST_CHILDREN(AST, topLevelDecls))                                \
+  XX(ASTLoadDirective, AST_CHILD(ASTStringLiteral, path))                      \
+  XX(ASTStruct,                                                                \
+     AST_CHILD(ASTIdentifier, name)                                            \
+     AST_CHILDREN(ASTVar, members))                                            \
+  XX(ASTConst,                                                                 \
+     AST_CHILD(ASTIdentifier, name)                                            \
+     AST_CHILD(AST, initExpr)                                                  \
+     AST_REF(AST, parentScope))                                                \
+  XX(ASTVar,                                                                   \
+     AST_CHILD(ASTIdentifier, name)                                            \
+     AST_CHILD(AST, typeExpr)                                                  \
+     AST_CHILD(AST, initExpr)                                                  \
+     AST_REF(AST, parentScope))                                                \
+  XX(ASTFunction,                                                              \
+     AST_CHILD(ASTIdentifier, name)                                            \
+     AST_CHILDREN(ASTVar, args)                                                \
+     AST_CHILDREN(ASTVar, returns)                                             \
+     AST_CHILD(ASTBlock, body))                                                \
+  XX(ASTBlock, AST_CHILDREN(AST, statements))                                  \
+  XX(ASTVariableDefinition,                                                    \
+     AST_CHILDREN(ASTIdentifier, names)                                        \
+     AST_CHILD(AST, typeExpr)                                                  \
+     AST_CHILDREN(AST, initilizationValues))                                   \
+  XX(ASTIfStatement,                                                           \
+     AST_CHILD(AST, conditionExpr)                                             \
+     AST_CHILD(AST, thenStatement)                                             \
+     AST_CHILD(AST, elseStatement))                                            \
+  XX(ASTWhileLoop,                                                             \
+     AST_CHILD(AST, condition)                                                 \
+     AST_CHILD(AST, body))                                                     \
+  XX(ASTDeferStatement, AST_CHILD(AST, statement))                             \
+  XX(ASTTypeUse, AST_CHILD(AST, type))
 
 enum ASTNodeType {
-#define XX(NAME, STRUCT) NAME##_,
+#define XX(NAME, FIELDS) NAME##_,
   AST_NODES_LIST
 #undef XX
 };
@@ -132,11 +130,24 @@ struct AST {
   ASTNodeType type;
   uint32_t fileIndex, offset0, offset1;
   uint32_t flags;
+  // Structural hash of the subtree, 0 until computed by hashAST
+  uint64_t hash;
 };
 
-#define XX(NAME, STRUCT) struct NAME : public AST STRUCT;
+#define AST_VALUE(TYPE, NAME) TYPE NAME;
+#define AST_CHILD(TYPE, NAME) TYPE *NAME;
+#define AST_CHILDREN(TYPE, NAME) Array<TYPE *> NAME;
+#define AST_REF(TYPE, NAME) TYPE *NAME;
+#define XX(NAME, FIELDS) struct NAME : public AST { FIELDS };
 AST_NODES_LIST
 #undef XX
+#undef AST_VALUE
+#undef AST_CHILD
+#undef AST_CHILDREN
+#undef AST_REF
+
+size_t astNodeSize(ASTNodeType type);
+size_t astNodeAlignment(ASTNodeType type);
 
 AST *setupASTNode(AST *node, ASTNodeType type, size_t size);
 #define AST_ALLOC(NODE_TYPE, ALLOCATOR)                                        \
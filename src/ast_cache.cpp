@@ -0,0 +1,232 @@
+#include "ast_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define XX(NAME, FIELDS) +1
+const uint32_t AST_NODE_TYPES_COUNT = 0 AST_NODES_LIST;
+#undef XX
+
+uint64_t astCacheKey(Str content, uint32_t flags) {
+  return hashMemory(content.data, content.len, ((uint64_t)AST_IMAGE_VERSION << 32) | flags);
+}
+
+struct ASTImageWriter {
+  char *base;
+  char *end;
+  char *copy; // pointers are replaced with offsets here
+  uint64_t *visited; // bit per 8 bytes of image, set for node starts
+
+  Array<AST *> stack;
+  Array<uint32_t> relocations;
+  Array<uint32_t> nodes;
+  Allocator *scratch;
+  bool failed;
+};
+
+bool inImage(ASTImageWriter *w, const void *data, size_t size) {
+  return (char *)data >= w->base && (char *)data + size <= w->end;
+}
+
+// Slot is address of pointer in the original tree, its copy gets offset
+void writePointer(ASTImageWriter *w, void *slot, size_t pointee) {
+  char *pointer = NULL;
+  memcpy(&pointer, slot, sizeof(pointer));
+  if (!pointer) return;
+  if (!inImage(w, pointer, pointee)) {
+    w->failed = true;
+    return;
+  }
+
+  uint64_t slotOffset = (char *)slot - w->base;
+  uint64_t offset = pointer - w->base;
+  memcpy(w->copy + slotOffset, &offset, sizeof(offset));
+  append(&w->relocations, (uint32_t)slotOffset, w->scratch);
+}
+
+template<typename T>
+void writeValue(ASTImageWriter *, T *) {
+}
+
+void writeValue(ASTImageWriter *w, Str *s) {
+  writePointer(w, &s->data, s->len);
+}
+
+template<typename T>
+void writeChild(ASTImageWriter *w, T **child) {
+  writePointer(w, child, sizeof(AST));
+  if (*child && !w->failed) append(&w->stack, (AST *)*child, w->scratch);
+}
+
+template<typename T>
+void writeChildren(ASTImageWriter *w, Array<T *> *arr) {
+  writePointer(w, &arr->data, arr->len * sizeof(T *));
+  for (uint32_t i = 0; i < arr->len && !w->failed; ++i) writeChild(w, arr->data + i);
+}
+
+void writeNode(ASTImageWriter *w, AST *node) {
+  if (!inImage(w, node, astNodeSize(node->type)) || (uint64_t)node % alignof(AST)) {
+    w->failed = true;
+    return;
+  }
+  uint64_t offset = (char *)node - w->base;
+  auto bit = 1ull << (offset / 8 % 64);
+  if (w->visited[offset / 8 / 64] & bit) return; // shared subtree
+  w->visited[offset / 8 / 64] |= bit;
+  append(&w->nodes, (uint32_t)offset, w->scratch);
+
+  switch (node->type) {
+#define AST_VALUE(TYPE, NAME) writeValue(w, &n->NAME);
+#define AST_CHILD(TYPE, NAME) writeChild(w, &n->NAME);
+#define AST_CHILDREN(TYPE, NAME) writeChildren(w, &n->NAME);
+#define AST_REF(TYPE, NAME) writePointer(w, &n->NAME, sizeof(AST));
+#define XX(NAME, FIELDS)                                                       \
+  case NAME##_: {                                                              \
+    auto n = static_cast<NAME *>(node);                                        \
+    (void)n;                                                                   \
+    FIELDS                                                                     \
+  } break;
+  AST_NODES_LIST
+  default: abort();
+#undef XX
+#undef AST_VALUE
+#undef AST_CHILD
+#undef AST_CHILDREN
+#undef AST_REF
+  }
+}
+
+bool writeAll(int fd, const void *data, size_t size) {
+  auto p = (const char *)data;
+  while (size) {
+    auto written = write(fd, p, size);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return false;
+    p += written;
+    size -= written;
+  }
+  return true;
+}
+
+bool writeASTImage(const char *path, uint64_t key, ASTFile *file, Str content,
+                   char *end, Allocator *scratch) {
+  auto base = content.data;
+  uint64_t imageSize = end - base;
+  if (end <= base + content.len || imageSize > UINT32_MAX) return false;
+
+  AllocatorCheckpoint checkpoint(scratch);
+  ASTImageWriter w = {};
+  w.base = base;
+  w.end = end;
+  w.scratch = scratch;
+  w.copy = ALLOC_ARRAY(char, imageSize, scratch);
+  memcpy(w.copy, base, imageSize);
+  auto visitedWords = imageSize / 8 / 64 + 1;
+  w.visited = ALLOC_ARRAY(uint64_t, visitedWords, scratch);
+  memset(w.visited, 0, visitedWords * sizeof(uint64_t));
+
+  append(&w.stack, (AST *)file, scratch);
+  while (w.stack.len && !w.failed) writeNode(&w, w.stack.data[--w.stack.len]);
+  if (w.failed || !inImage(&w, file, sizeof(ASTFile))) return false;
+
+  ASTImageHeader header = {};
+  header.magic = AST_IMAGE_MAGIC;
+  header.version = AST_IMAGE_VERSION;
+  header.relocationsCount = w.relocations.len;
+  header.key = key;
+  header.contentLen = content.len;
+  header.imageSize = imageSize;
+  header.rootOffset = (char *)file - base;
+  header.nodesCount = w.nodes.len;
+
+  char padding[AST_IMAGE_OFFSET - sizeof(ASTImageHeader)] = {};
+  auto tmpPath = SPrintf(scratch, "%s.%d.%lx.tmp", path, getpid(), (unsigned long)pthread_self());
+  int fd = open(tmpPath.data, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return false;
+  bool ok = writeAll(fd, &header, sizeof(header)) &&
+            writeAll(fd, padding, sizeof(padding)) &&
+            writeAll(fd, w.copy, imageSize) &&
+            writeAll(fd, w.relocations.data, w.relocations.len * sizeof(uint32_t)) &&
+            writeAll(fd, w.nodes.data, w.nodes.len * sizeof(uint32_t));
+  ok = close(fd) == 0 && ok;
+  if (ok) ok = rename(tmpPath.data, path) == 0;
+  if (!ok) unlink(tmpPath.data);
+  return ok;
+}
+
+// Header and tables are checked, so damaged or foreign file is a cache miss
+// rather than a crash
+ASTFile *relocateASTImage(char *mapping, size_t size, uint64_t key, Str content,
+                          uint32_t fileIndex) {
+  if (size < AST_IMAGE_OFFSET) return NULL;
+  auto header = (ASTImageHeader *)mapping;
+  if (header->magic != AST_IMAGE_MAGIC || header->version != AST_IMAGE_VERSION ||
+      header->key != key || header->contentLen != content.len) {
+    return NULL;
+  }
+  auto imageSize = header->imageSize;
+  auto tablesSize = ((uint64_t)header->relocationsCount + header->nodesCount) * sizeof(uint32_t);
+  if (imageSize <= content.len || AST_IMAGE_OFFSET + imageSize + tablesSize != size ||
+      header->rootOffset + sizeof(ASTFile) > imageSize) {
+    return NULL;
+  }
+
+  auto image = mapping + AST_IMAGE_OFFSET;
+  if (memcmp(image, content.data, content.len) != 0) return NULL;
+
+  auto relocations = (uint32_t *)(image + imageSize);
+  for (uint32_t i = 0; i < header->relocationsCount; ++i) {
+    auto offset = relocations[i];
+    uint64_t value = 0;
+    if (offset % 8 || offset + sizeof(value) > imageSize) return NULL;
+    memcpy(&value, image + offset, sizeof(value));
+    if (value > imageSize) return NULL;
+    value += (uint64_t)image;
+    memcpy(image + offset, &value, sizeof(value));
+  }
+
+  auto nodes = relocations + header->relocationsCount;
+  for (uint32_t i = 0; i < header->nodesCount; ++i) {
+    auto offset = nodes[i];
+    if (offset % alignof(AST) || offset + sizeof(AST) > imageSize) return NULL;
+    auto node = (AST *)(image + offset);
+    if ((uint32_t)node->type >= AST_NODE_TYPES_COUNT ||
+        offset + astNodeSize(node->type) > imageSize) {
+      return NULL;
+    }
+    node->fileIndex = fileIndex;
+  }
+
+  return AST_CAST(ASTFile, (AST *)(image + header->rootOffset));
+}
+
+ASTFile *mapASTImage(const char *path, uint64_t key, Str content, uint32_t fileIndex,
+                     void **mappingOut, size_t *mappingSizeOut) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return NULL;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < AST_IMAGE_OFFSET) {
+    close(fd);
+    return NULL;
+  }
+
+  // Private mapping, pages touched by relocation are copied on write and
+  // the file itself stays position independent
+  size_t size = st.st_size;
+  auto mapping = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) return NULL;
+
+  auto result = relocateASTImage(mapping, size, key, content, fileIndex);
+  if (!result) {
+    munmap(mapping, size);
+    return NULL;
+  }
+  *mappingOut = mapping;
+  *mappingSizeOut = size;
+  return result;
+}
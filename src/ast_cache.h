@@ -0,0 +1,43 @@
+#pragma once
+
+#include "ast.h"
+
+// Parsed files are cached on disk under a key derived from their content.
+// Image is position independent: copy of the source followed by compacted
+// nodes, arrays and strings, with every pointer stored as offset from the
+// image start. Offsets of pointers and nodes are listed after the image, so
+// loading is mmap plus one linear pass, without lexing or parsing.
+//
+// File layout: header, image (at AST_IMAGE_OFFSET), relocations and node
+// offsets (uint32_t each).
+const uint64_t AST_IMAGE_MAGIC = 0x474D495453413643ull; // "C6ASTIMG"
+const uint32_t AST_IMAGE_VERSION = 1;
+const size_t AST_IMAGE_OFFSET = 64;
+
+struct ASTImageHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t relocationsCount;
+  uint64_t key;
+  uint64_t contentLen;
+  uint64_t imageSize;
+  uint64_t rootOffset;
+  uint32_t nodesCount;
+  uint32_t reserved;
+};
+
+// Flags are options which change resulting AST (e.g. hash-consing)
+uint64_t astCacheKey(Str content, uint32_t flags);
+
+// Everything reachable from file should be in [content.data, end), source
+// first, e.g. right after compaction into a single block. Returns false if
+// it is not or file could not be written. File is written under
+// temporary name and renamed, so concurrent readers never see partial image.
+bool writeASTImage(const char *path, uint64_t key, ASTFile *file, Str content,
+                   char *end, Allocator *scratch);
+
+// Returns NULL if there is no valid image for this content. Nodes get
+// fileIndex, source copy in the image is NUL terminated and should be used
+// instead of content. Mapping should be released with munmap.
+ASTFile *mapASTImage(const char *path, uint64_t key, Str content, uint32_t fileIndex,
+                     void **mappingOut, size_t *mappingSizeOut);
@@ -0,0 +1,121 @@
+#include "ast_compaction.h"
+
+#include <string.h>
+
+struct ASTCompaction {
+  Allocator *to;
+  Str oldContent;
+  Str newContent;
+};
+
+AST *relocateNode(ASTCompaction *c, AST *node);
+
+// Forwarding address is kept in place of offsets, they are already copied
+AST *forwardedAddress(AST *node) {
+  AST *result = NULL;
+  memcpy(&result, &node->offset0, sizeof(result));
+  return result;
+}
+
+void setForwardedAddress(AST *node, AST *newNode) {
+  node->flags |= AST_FLAGS_FORWARDED;
+  memcpy(&node->offset0, &newNode, sizeof(newNode));
+}
+
+void relocateStr(ASTCompaction *c, Str *s) {
+  auto oldStart = c->oldContent.data;
+  if (s->data >= oldStart && s->data + s->len <= oldStart + c->oldContent.len) {
+    s->data = c->newContent.data + (s->data - oldStart);
+  } else if (s->len) {
+    *s = StrDup(*s, c->to);
+  }
+}
+
+template<typename T>
+void relocateValue(ASTCompaction *, T *) {
+}
+
+void relocateValue(ASTCompaction *c, Str *s) {
+  relocateStr(c, s);
+}
+
+template<typename T>
+void relocateArrayData(ASTCompaction *c, Array<T> *arr) {
+  *arr = copyArray(*arr, c->to);
+}
+
+template<typename T>
+void relocateArrayItems(ASTCompaction *c, Array<T *> *arr) {
+  for (uint32_t i = 0; i < arr->len; ++i) {
+    arr->data[i] = static_cast<T *>(relocateNode(c, arr->data[i]));
+  }
+}
+
+template<typename T>
+void relocate(ASTCompaction *c, T **field) {
+  *field = static_cast<T *>(relocateNode(c, *field));
+}
+
+AST *relocateNode(ASTCompaction *c, AST *node) {
+  if (!node) return NULL;
+  if (node->flags & AST_FLAGS_FORWARDED) return forwardedAddress(node);
+
+  auto size = astNodeSize(node->type);
+  auto newNode = (AST *)alloc(size, astNodeAlignment(node->type), 1, c->to);
+  memcpy(newNode, node, size);
+  setForwardedAddress(node, newNode);
+
+  // Fields of the copy still point to old memory. Arrays are moved first,
+  // so they end up right after the node, then fields in declaration order.
+  // References point to ancestors, which are already forwarded.
+  switch (newNode->type) {
+#define AST_VALUE(TYPE, NAME)
+#define AST_CHILD(TYPE, NAME)
+#define AST_REF(TYPE, NAME)
+#define AST_CHILDREN(TYPE, NAME) relocateArrayData(c, &n->NAME);
+#define XX(NAME, FIELDS)                                                       \
+  case NAME##_: {                                                              \
+    auto n = static_cast<NAME *>(newNode);                                     \
+    (void)n;                                                                   \
+    FIELDS                                                                     \
+  } break;
+  AST_NODES_LIST
+  default: abort();
+#undef AST_VALUE
+#undef AST_CHILD
+#undef AST_REF
+#undef AST_CHILDREN
+  }
+
+  switch (newNode->type) {
+#define AST_VALUE(TYPE, NAME) relocateValue(c, &n->NAME);
+#define AST_CHILD(TYPE, NAME) relocate(c, &n->NAME);
+#define AST_REF(TYPE, NAME) relocate(c, &n->NAME);
+#define AST_CHILDREN(TYPE, NAME) relocateArrayItems(c, &n->NAME);
+  AST_NODES_LIST
+  default: abort();
+#undef XX
+#undef AST_VALUE
+#undef AST_CHILD
+#undef AST_REF
+#undef AST_CHILDREN
+  }
+
+  return newNode;
+}
+
+ASTFile *compactFileAST(ASTFile *file, Str *content, Allocator *to) {
+  ASTCompaction c = {};
+  c.to = to;
+  c.oldContent = *content;
+
+  // Source goes first, it is NUL terminated like the original
+  c.newContent.data = ALLOC_ARRAY(char, content->len + 1, to);
+  c.newContent.len = content->len;
+  memcpy(c.newContent.data, content->data, content->len);
+  c.newContent.data[content->len] = '\0';
+
+  auto result = static_cast<ASTFile *>(relocateNode(&c, file));
+  *content = c.newContent;
+  return result;
+}
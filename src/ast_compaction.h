@@ -0,0 +1,10 @@
+#pragma once
+
+#include "ast.h"
+
+// Copies source and every node reachable from file into allocator, nodes are
+// laid out in pre-order with child arrays right after their owner, so tree
+// walks read memory sequentially. Pointers into old source are rebased to
+// the copy. Old nodes are overwritten with forwarding addresses, so the old
+// memory should be released afterwards.
+ASTFile *compactFileAST(ASTFile *file, Str *content, Allocator *to);
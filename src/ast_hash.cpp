@@ -0,0 +1,233 @@
+#include "ast_hash.h"
+
+uint64_t mixHash(uint64_t h, uint64_t value) {
+  // splitmix64 finalizer over running hash and next value
+  h = (h ^ value) * 0x9E3779B97F4A7C15ull;
+  h ^= h >> 30;
+  h *= 0xBF58476D1CE4E5B9ull;
+  h ^= h >> 27;
+  h *= 0x94D049BB133111EBull;
+  h ^= h >> 31;
+  return h;
+}
+
+template<typename T>
+uint64_t hashValue(uint64_t h, T value) {
+  return mixHash(h, (uint64_t)value);
+}
+
+uint64_t hashValue(uint64_t h, Str value) {
+  return mixHash(h, hashMemory(value.data, value.len, 0));
+}
+
+template<typename T>
+bool valueEqual(T a, T b) {
+  return a == b;
+}
+
+bool valueEqual(Str a, Str b) {
+  return StrEqual(a, b);
+}
+
+uint64_t hashChild(uint64_t h, AST *child) {
+  return mixHash(h, child ? child->hash : 0);
+}
+
+// Flags which describe the node itself rather than its memory
+const uint32_t AST_HASHED_FLAGS = AST_FLAGS_EXPR_IN_PAREN;
+
+uint64_t hashASTNode(AST *node) {
+  if (auto use = AST_CAST(ASTTypeUse, node)) return use->type ? use->type->hash : 0;
+
+  uint64_t h = mixHash(node->type, node->flags & AST_HASHED_FLAGS);
+  switch (node->type) {
+#define AST_VALUE(TYPE, NAME) h = hashValue(h, n->NAME);
+#define AST_CHILD(TYPE, NAME) h = hashChild(h, n->NAME);
+#define AST_CHILDREN(TYPE, NAME)                                               \
+  h = mixHash(h, n->NAME.len);                                                 \
+  for (uint32_t i = 0; i < n->NAME.len; ++i) h = hashChild(h, n->NAME.data[i]);
+#define AST_REF(TYPE, NAME)
+#define XX(NAME, FIELDS)                                                       \
+  case NAME##_: {                                                              \
+    auto n = static_cast<NAME *>(node);                                        \
+    (void)n;                                                                   \
+    FIELDS                                                                     \
+  } break;
+  AST_NODES_LIST
+  default: abort();
+#undef XX
+#undef AST_VALUE
+#undef AST_CHILD
+#undef AST_CHILDREN
+#undef AST_REF
+  }
+  // 0 means "not computed"
+  return h ? h : 1;
+}
+
+bool astHasRefs(ASTNodeType type) {
+  switch (type) {
+#define AST_VALUE(TYPE, NAME)
+#define AST_CHILD(TYPE, NAME)
+#define AST_CHILDREN(TYPE, NAME)
+#define AST_REF(TYPE, NAME) return true;
+#define XX(NAME, FIELDS) case NAME##_: { FIELDS } return false;
+  AST_NODES_LIST
+  default: abort();
+#undef XX
+#undef AST_VALUE
+#undef AST_CHILD
+#undef AST_CHILDREN
+#undef AST_REF
+  }
+}
+
+bool astShallowEqual(AST *a, AST *b) {
+  if (a->type != b->type || a->hash != b->hash) return false;
+  if ((a->flags & AST_HASHED_FLAGS) != (b->flags & AST_HASHED_FLAGS)) return false;
+
+  switch (a->type) {
+#define AST_VALUE(TYPE, NAME) if (!valueEqual(x->NAME, y->NAME)) return false;
+#define AST_CHILD(TYPE, NAME) if (x->NAME != y->NAME) return false;
+#define AST_CHILDREN(TYPE, NAME)                                               \
+  if (x->NAME.len != y->NAME.len) return false;                                \
+  for (uint32_t i = 0; i < x->NAME.len; ++i) {                                 \
+    if (x->NAME.data[i] != y->NAME.data[i]) return false;                      \
+  }
+#define AST_REF(TYPE, NAME) return false;
+#define XX(NAME, FIELDS)                                                       \
+  case NAME##_: {                                                              \
+    auto x = static_cast<NAME *>(a);                                           \
+    auto y = static_cast<NAME *>(b);                                           \
+    (void)x;                                                                   \
+    (void)y;                                                                   \
+    FIELDS                                                                     \
+  } break;
+  AST_NODES_LIST
+  default: abort();
+#undef XX
+#undef AST_VALUE
+#undef AST_CHILD
+#undef AST_CHILDREN
+#undef AST_REF
+  }
+  return true;
+}
+
+void initASTHashConsTable(ASTHashConsTable *table, Allocator *allocator, Allocator *nodeAllocator) {
+  *table = {};
+  table->allocator = allocator;
+  table->nodeAllocator = nodeAllocator;
+}
+
+void insertASTIntoSlots(AST **slots, uint32_t cap, AST *node) {
+  for (uint32_t i = node->hash & (cap - 1);; i = (i + 1) & (cap - 1)) {
+    if (!slots[i]) {
+      slots[i] = node;
+      return;
+    }
+  }
+}
+
+AST *internAST(ASTHashConsTable *table, AST *node) {
+  if (!node || astHasRefs(node->type) || node->type == ASTTypeUse_) return node;
+
+  if (table->cap) {
+    for (uint32_t i = node->hash & (table->cap - 1);; i = (i + 1) & (table->cap - 1)) {
+      auto existing = table->slots[i];
+      if (!existing) break;
+      if (existing == node) return node;
+      if (astShallowEqual(existing, node)) {
+        table->interned++;
+        return existing;
+      }
+    }
+  }
+
+  // Keep load factor under 1/2
+  if ((table->len + 1) * 2 > table->cap) {
+    uint32_t newCap = table->cap ? table->cap * 2 : 64;
+    auto newSlots = ALLOC_ARRAY(AST *, newCap, table->allocator);
+    memset(newSlots, 0, newCap * sizeof(AST *));
+    for (uint32_t i = 0; i < table->cap; ++i) {
+      if (table->slots[i]) insertASTIntoSlots(newSlots, newCap, table->slots[i]);
+    }
+    table->slots = newSlots;
+    table->cap = newCap;
+  }
+  insertASTIntoSlots(table->slots, table->cap, node);
+  table->len++;
+  return node;
+}
+
+// Interns children of node first, so equal subtrees end up pointing to the
+// same children and compare shallowly. Type expressions are shallow, so
+// recursion depth is bounded by nesting in the source like in the parser.
+AST *internSubtree(ASTHashConsTable *table, AST *node) {
+  if (!node) return NULL;
+  switch (node->type) {
+#define AST_VALUE(TYPE, NAME)
+#define AST_REF(TYPE, NAME)
+#define AST_CHILD(TYPE, NAME)                                                  \
+  n->NAME = static_cast<TYPE *>(internSubtree(table, n->NAME));
+#define AST_CHILDREN(TYPE, NAME)                                               \
+  for (uint32_t i = 0; i < n->NAME.len; ++i) {                                 \
+    n->NAME.data[i] = static_cast<TYPE *>(internSubtree(table, n->NAME.data[i])); \
+  }
+#define XX(NAME, FIELDS)                                                       \
+  case NAME##_: {                                                              \
+    auto n = static_cast<NAME *>(node);                                        \
+    (void)n;                                                                   \
+    FIELDS                                                                     \
+  } break;
+  AST_NODES_LIST
+  default: abort();
+#undef XX
+#undef AST_VALUE
+#undef AST_CHILD
+#undef AST_CHILDREN
+#undef AST_REF
+  }
+  return internAST(table, node);
+}
+
+// Interned type is shared, so position of this use of it is kept aside
+AST *internTypeExpr(ASTHashConsTable *table, AST *typeExpr) {
+  if (!typeExpr) return NULL;
+  if (auto use = AST_CAST(ASTTypeUse, typeExpr)) {
+    use->type = internSubtree(table, use->type);
+    return use;
+  }
+
+  auto use = AST_ALLOC(ASTTypeUse, table->nodeAllocator);
+  use->fileIndex = typeExpr->fileIndex;
+  use->offset0 = typeExpr->offset0;
+  use->offset1 = typeExpr->offset1;
+  use->hash = typeExpr->hash;
+  use->type = internSubtree(table, typeExpr);
+  return use;
+}
+
+ASTWalkResult hashASTPost(ASTWalker *walker, AST *node) {
+  auto table = static_cast<ASTHashConsTable *>(walker->userData);
+  node->hash = hashASTNode(node);
+
+  if (table) {
+    // Type expressions are hashed already, as children are visited first
+    if (auto var = AST_CAST(ASTVar, node)) {
+      var->typeExpr = internTypeExpr(table, var->typeExpr);
+    } else if (auto def = AST_CAST(ASTVariableDefinition, node)) {
+      def->typeExpr = internTypeExpr(table, def->typeExpr);
+    } else if (auto cast = AST_CAST(ASTCast, node)) {
+      cast->toTypeExpr = internTypeExpr(table, cast->toTypeExpr);
+    }
+  }
+  return AST_WALK_CONTINUE;
+}
+
+void hashAST(AST *root, ASTHashConsTable *table, Allocator *scratch) {
+  ASTWalker walker = {};
+  walker.post = hashASTPost;
+  walker.userData = table;
+  walkAST(&walker, root, scratch);
+}
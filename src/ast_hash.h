@@ -0,0 +1,35 @@
+#pragma once
+
+#include "ast.h"
+
+// Structural hash covers node types, flags, values and children in order.
+// Positions and AST_REF fields are not part of it, so the same code at
+// different places of a file (or in different files) hashes the same.
+// ASTTypeUse hashes as its type, hash-consing doesn't change hashes.
+uint64_t hashASTNode(AST *node); // children should be hashed already
+
+// Open addressing table of unique subtrees. Two nodes are equal when they
+// have same type, flags and values, and point to the very same children, so
+// subtrees are interned bottom-up and never compared deeply. Nodes with
+// AST_REF fields and ASTTypeUse are never interned.
+struct ASTHashConsTable {
+  AST **slots;
+  uint32_t len;
+  uint32_t cap;
+  Allocator *allocator;
+  // ASTTypeUse nodes are part of the tree, they should live as long as it
+  Allocator *nodeAllocator;
+
+  uint32_t interned; // nodes replaced by an existing equal node
+};
+
+void initASTHashConsTable(ASTHashConsTable *table, Allocator *allocator, Allocator *nodeAllocator);
+// Returns equal node which is already in the table or inserts this one
+AST *internAST(ASTHashConsTable *table, AST *node);
+
+// Computes hash of every node reachable from root. If table is not NULL,
+// type expressions (of variables, definitions and casts) are replaced with
+// ASTTypeUse nodes, which keep position of the expression and point to its
+// shared interned copy. Positions of shared nodes are meaningless.
+// Table should not allocate from scratch, walk rewinds it on return.
+void hashAST(AST *root, ASTHashConsTable *table, Allocator *scratch);
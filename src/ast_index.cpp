@@ -0,0 +1,103 @@
+#include "ast_index.h"
+
+#include "ast_walker.h"
+
+struct ASTIndexBuilder {
+  ASTIndex *index;
+  Allocator *a;
+  uint32_t current; // node whose children are being visited
+};
+
+ASTWalkResult indexASTNodePre(ASTWalker *walker, AST *node) {
+  auto builder = static_cast<ASTIndexBuilder *>(walker->userData);
+  auto nodes = &builder->index->nodes;
+  append(nodes, ASTIndexNode{node, builder->current, node->offset1}, builder->a);
+  builder->current = nodes->len - 1;
+  return AST_WALK_CONTINUE;
+}
+
+ASTWalkResult indexASTNodePost(ASTWalker *walker, AST *) {
+  auto builder = static_cast<ASTIndexBuilder *>(walker->userData);
+  builder->current = builder->index->nodes.data[builder->current].parent;
+  return AST_WALK_CONTINUE;
+}
+
+// Zero length segments are replaced, neighbours with the same node merged
+void addASTIndexSegment(ASTIndex *index, uint32_t offset0, uint32_t node, Allocator *a) {
+  auto segments = &index->segments;
+  if (segments->len) {
+    auto last = segments->data + segments->len - 1;
+    if (offset0 < last->offset0) offset0 = last->offset0;
+    if (last->offset0 == offset0) {
+      segments->len--;
+    } else if (last->node == node) {
+      return;
+    }
+  }
+  if (segments->len && segments->data[segments->len - 1].node == node) return;
+  append(segments, ASTIndexSegment{offset0, node}, a);
+}
+
+// Pops nodes which end before offset, the one below covers the rest
+void closeASTIndexNodes(ASTIndex *index, Array<uint32_t> *open, uint32_t offset, Allocator *a) {
+  auto nodes = index->nodes.data;
+  while (open->len && nodes[open->data[open->len - 1]].end <= offset) {
+    auto end = nodes[open->data[--open->len]].end;
+    addASTIndexSegment(index, end, open->len ? open->data[open->len - 1] : AST_INDEX_NONE, a);
+  }
+}
+
+void buildASTIndex(ASTIndex *index, AST *root, Allocator *a, Allocator *scratch) {
+  *index = {};
+  ASTIndexBuilder builder = {index, a, AST_INDEX_NONE};
+  ASTWalker walker = {};
+  walker.pre = indexASTNodePre;
+  walker.post = indexASTNodePost;
+  walker.userData = &builder;
+  walkAST(&walker, root, scratch);
+
+  // Sweep in order of offset0 keeping nodes which cover current position on
+  // a stack, the last started on top. Pre-order is already sorted except
+  // where ranges of siblings overlap (`a, b : T`), so insertion sort is
+  // close to linear.
+  AllocatorCheckpoint checkpoint(scratch);
+  auto nodes = index->nodes.data;
+  Array<uint32_t> order = {};
+  for (uint32_t i = 0; i < index->nodes.len; ++i) {
+    // Nodes without position (the file itself) don't cover anything
+    if (nodes[i].node->offset1 <= nodes[i].node->offset0) continue;
+    append(&order, i, scratch);
+    for (uint32_t j = order.len - 1;
+         j > 0 && nodes[order.data[j - 1]].node->offset0 > nodes[i].node->offset0; --j) {
+      order.data[j] = order.data[j - 1];
+      order.data[j - 1] = i;
+    }
+  }
+
+  Array<uint32_t> open = {};
+  for (uint32_t k = 0; k < order.len; ++k) {
+    auto i = order.data[k];
+    auto node = nodes[i].node;
+    closeASTIndexNodes(index, &open, node->offset0, a);
+    addASTIndexSegment(index, node->offset0, i, a);
+    append(&open, i, scratch);
+    for (uint32_t j = open.len - 1; j > 0 && nodes[open.data[j - 1]].end < nodes[i].end; --j) {
+      nodes[open.data[j - 1]].end = nodes[i].end;
+    }
+  }
+  closeASTIndexNodes(index, &open, UINT32_MAX, a);
+}
+
+uint32_t innermostASTNodeAt(ASTIndex *index, uint32_t offset) {
+  auto segments = index->segments.data;
+  uint32_t lo = 0, hi = index->segments.len;
+  while (lo < hi) {
+    auto mid = lo + (hi - lo) / 2;
+    if (segments[mid].offset0 <= offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo ? segments[lo - 1].node : AST_INDEX_NONE;
+}
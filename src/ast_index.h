@@ -0,0 +1,32 @@
+#pragma once
+
+#include "ast.h"
+
+const uint32_t AST_INDEX_NONE = UINT32_MAX;
+
+struct ASTIndexNode {
+  AST *node;
+  uint32_t parent; // AST_INDEX_NONE for root
+  // End of the node and its descendants, some nodes are narrower than
+  // their children
+  uint32_t end;
+};
+
+// Source from offset0 up to offset0 of the next segment has the same
+// innermost node
+struct ASTIndexSegment {
+  uint32_t offset0;
+  uint32_t node; // AST_INDEX_NONE if no node covers it
+};
+
+// Maps byte offset to the innermost node covering it (from AST::offset0/
+// offset1) with a binary search. Nodes are kept in pre-order with their
+// parents, so scopes around a position are found without walking the tree.
+struct ASTIndex {
+  Array<ASTIndexNode> nodes;
+  Array<ASTIndexSegment> segments;
+};
+
+void buildASTIndex(ASTIndex *index, AST *root, Allocator *a, Allocator *scratch);
+// Returns index of the node in index->nodes or AST_INDEX_NONE
+uint32_t innermostASTNodeAt(ASTIndex *index, uint32_t offset);
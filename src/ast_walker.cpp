@@ -0,0 +1,84 @@
+#include "ast_walker.h"
+
+struct ASTWalkFrame {
+  AST *node;
+  bool childrenVisited;
+};
+
+// Expands to code visiting children of `n` (node cast to its type) in
+// declaration order with VISIT(child)
+#define AST_VALUE(TYPE, NAME)
+#define AST_REF(TYPE, NAME)
+#define AST_CHILD(TYPE, NAME) if (n->NAME) VISIT(n->NAME);
+#define AST_CHILDREN(TYPE, NAME)                                               \
+  for (uint32_t i = 0; i < n->NAME.len; ++i) {                                 \
+    if (n->NAME.data[i]) VISIT(n->NAME.data[i]);                               \
+  }
+#define XX(NAME, FIELDS)                                                       \
+  case NAME##_: {                                                              \
+    auto n = static_cast<NAME *>(node);                                        \
+    (void)n;                                                                   \
+    FIELDS                                                                     \
+  } break;
+
+void pushASTChildren(Array<ASTWalkFrame> *stack, AST *node, Allocator *scratch) {
+  auto first = stack->len;
+
+#define VISIT(CHILD)                                                           \
+  do {                                                                         \
+    __builtin_prefetch(CHILD);                                                 \
+    append(stack, ASTWalkFrame{(CHILD), false}, scratch);                     \
+  } while (0)
+  switch (node->type) {
+  AST_NODES_LIST
+  default: abort();
+  }
+#undef VISIT
+
+  // Stack pops last pushed first, reverse so children come in field order
+  for (uint32_t i = first, j = stack->len; i + 1 < j; ++i, --j) {
+    auto tmp = stack->data[i];
+    stack->data[i] = stack->data[j - 1];
+    stack->data[j - 1] = tmp;
+  }
+}
+
+void forEachASTChild(AST *node, void (*fn)(AST *child, void *arg), void *arg) {
+#define VISIT(CHILD) fn((CHILD), arg)
+  switch (node->type) {
+  AST_NODES_LIST
+  default: abort();
+  }
+#undef VISIT
+}
+
+#undef XX
+#undef AST_VALUE
+#undef AST_REF
+#undef AST_CHILD
+#undef AST_CHILDREN
+
+bool walkAST(ASTWalker *walker, AST *root, Allocator *scratch) {
+  if (!root) return true;
+
+  AllocatorCheckpoint checkpoint(scratch);
+  Array<ASTWalkFrame> stack = {};
+  append(&stack, ASTWalkFrame{root, false}, scratch);
+
+  while (stack.len) {
+    auto frame = stack.data[--stack.len];
+    auto node = frame.node;
+
+    if (frame.childrenVisited) {
+      if (walker->post && walker->post(walker, node) == AST_WALK_STOP) return false;
+      continue;
+    }
+
+    auto result = walker->pre ? walker->pre(walker, node) : AST_WALK_CONTINUE;
+    if (result == AST_WALK_STOP) return false;
+
+    append(&stack, ASTWalkFrame{node, true}, scratch);
+    if (result != AST_WALK_SKIP_CHILDREN) pushASTChildren(&stack, node, scratch);
+  }
+  return true;
+}
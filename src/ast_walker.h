@@ -0,0 +1,25 @@
+#pragma once
+
+#include "ast.h"
+
+enum ASTWalkResult {
+  AST_WALK_CONTINUE,
+  AST_WALK_SKIP_CHILDREN, // from pre hook only, post hook is still called
+  AST_WALK_STOP,
+};
+
+// Hooks may be NULL. Traversal follows AST_CHILD and AST_CHILDREN fields in
+// declaration order, AST_REF fields are not followed. Subtrees shared by
+// several parents are visited once per parent.
+struct ASTWalker {
+  ASTWalkResult (*pre)(ASTWalker *walker, AST *node);
+  ASTWalkResult (*post)(ASTWalker *walker, AST *node);
+  void *userData;
+};
+
+// Non-recursive, stack lives in scratch allocator and is freed on return.
+// Returns false if walk was stopped by a hook.
+bool walkAST(ASTWalker *walker, AST *root, Allocator *scratch);
+
+// Calls fn for each direct child of node in traversal order
+void forEachASTChild(AST *node, void (*fn)(AST *child, void *arg), void *arg);
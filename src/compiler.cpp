@@ -1,69 +1,111 @@
 #include "compiler.h"
+#include "utils/heap.h"
+#include "utils/numa.h"
 
 #include <stdio.h>
 
+#include <assert.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "parsing/parser.h"
+#include "reporting.h"
+#include "utils/trace.h"
 
 void *compilerThreadProc(void *arg);
 
-void initCompiler(Compiler *compiler, int threads, const char *entryPoint) {
+// Contended acquisitions show up in the trace
+void lockJobQueue(Compiler *compiler) {
+  if (pthread_mutex_trylock(&compiler->jobQueueMutex) == 0) return;
+  TRACE_SCOPE("wait for job queue lock");
+  pthread_mutex_lock(&compiler->jobQueueMutex);
+}
+
+void initCompiler(Compiler *compiler, CompilerOptions options) {
   *compiler = {};
+  compiler->options = options;
+  compiler->diagnostics = stderr;
   initGlobalData(&compiler->globalData);
   compiler->globalData.compiler = compiler;
-  compiler->threads = threads;
-
-  compiler->memorySize = 1ull * 1024ull * 1024ull * 1024ull;
-  size_t memoryPerThread = 100ull * 1024ull;
-
-  //NOTE: addr and length should be multiple of 4096 (page size on linux)
-  if (compiler->memorySize % 4096) {
-    fprintf(stderr, "%s:%d Memory size is not multiple of 4096\n",
-      __FILE__, __LINE__);
-    abort();
+  compiler->maxWorkers = options.threads > 0 ? options.threads : availableCpusCount();
+  if (options.pinThreads) getAllowedCpus(&compiler->allowedCpus);
+
+  // Cache is an optimization, compilation goes on without it
+  if (options.cacheDirectory && mkdir(options.cacheDirectory, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "warning Cache directory %s is not usable: %s\n",
+      options.cacheDirectory, strerror(errno));
+    compiler->options.cacheDirectory = NULL;
   }
-  compiler->memory = mmap((void *)0x12345789000, compiler->memorySize,
-      PROT_READ|PROT_WRITE,
-      MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED_NOREPLACE,
-      0, 0);
-  if (compiler->memory == MAP_FAILED) {
-    fprintf(stderr, "%s:%d Failed to mmap memory because: %s\n",
-      __FILE__, __LINE__,
-      strerror(errno));
-    abort();
+
+  // Only reserved address space, pages are committed as allocator grows.
+  // Fixed address keeps pointers stable between runs
+  compiler->memorySize = 64ull * 1024ull * 1024ull * 1024ull;
+  initVirtualAllocator(&compiler->mainAllocator, (void *)0x12345789000,
+                       compiler->memorySize,
+                       ALLOCATOR_FLAG_HUGE_PAGES|ALLOCATOR_FLAG_SHARED);
+  compiler->memory = compiler->mainAllocator.start;
+
+  if (options.restoreSnapshot && !restoreCompilerSnapshot(compiler, options.restoreSnapshot)) {
+    fprintf(stderr, "warning Snapshot %s can't be used, compiling from scratch\n",
+      options.restoreSnapshot);
   }
 
   pthread_mutex_init(&compiler->jobQueueMutex, NULL);
   pthread_cond_init(&compiler->jobQueueCond, NULL);
-
-  initAllocator(&compiler->mainAllocator, (char *)compiler->memory, compiler->memorySize);
+  pthread_cond_init(&compiler->compilerFinishedCond, NULL);
 
   compiler->jobQueueShouldContinue = true;
 
-  for (int i = 0; i < threads; ++i) {
-    auto memory = ALLOC_ARRAY(char, memoryPerThread, &compiler->mainAllocator);
-    initThreadData(compiler->threadsData + i, &compiler->globalData, memory, memoryPerThread);
+  initFileLoader(&compiler->fileLoader, compiler, true);
 
-    pthread_t t = {};
-    pthread_create(&t, NULL, compilerThreadProc, compiler->threadsData + i);
-    pthread_detach(t);
-  }
+  if (options.entryPoint) startCompilation(compiler, options.entryPoint);
+}
+
+void startCompilation(Compiler *compiler, const char *entryPoint) {
+  // No jobs are running, so plain stores are published by posting root job
+  compiler->globalData.cancelled = false;
+  compiler->globalData.loadedFiles.compilation++;
+  compiler->compilerFinished = false;
+  compiler->exitStatus = 0;
 
   auto job = allocOrReuseCompilerJob(compiler);
   job->type = COMPILER_JOB_TYPE_READ_FILE;
   job->fileNameToRead = CStringToStr(entryPoint);
+  compiler->rootJob = job;
   postCompilerJob(compiler, job);
 }
 
 void deinitCompiler(Compiler *compiler) {
-  munmap(compiler->memory, compiler->memorySize);
+  lockJobQueue(compiler);
+  compiler->jobQueueShouldContinue = false;
+  pthread_cond_broadcast(&compiler->jobQueueCond);
+  pthread_mutex_unlock(&compiler->jobQueueMutex);
+
+  // Every worker has exactly one thread which wasn't joined yet
+  for (auto worker = compiler->workers; worker; worker = worker->next) {
+    pthread_join(worker->thread, NULL);
+  }
+
+  deinitFileLoader(&compiler->fileLoader);
+
+  for (auto fiber = compiler->allFibers; fiber; fiber = fiber->nextAllocated) {
+    freeFiberStack(&fiber->stack);
+  }
+
+  deinitVirtualAllocator(&compiler->mainAllocator);
 
   pthread_mutex_destroy(&compiler->jobQueueMutex);
   pthread_cond_destroy(&compiler->jobQueueCond);
+  pthread_cond_destroy(&compiler->compilerFinishedCond);
+
+  deinitGlobalData(&compiler->globalData);
 }
 
 CompilerJob *allocOrReuseCompilerJob(Compiler *compiler) {
-  pthread_mutex_lock(&compiler->jobQueueMutex);
+  lockJobQueue(compiler);
 
   if (!compiler->jobFreelistNext) {
     size_t n = 100;
@@ -80,80 +122,748 @@ CompilerJob *allocOrReuseCompilerJob(Compiler *compiler) {
   pthread_mutex_unlock(&compiler->jobQueueMutex);
 
   *result = {};
+  result->unfinishedJobs = 1;
+  result->unfinishedDependencies = 1;
   return result;
 }
 
-void postCompilerJob(Compiler *compiler, CompilerJob *job) {
-  pthread_mutex_lock(&compiler->jobQueueMutex);
+bool compilerJobLess(CompilerJob *a, CompilerJob *b) {
+  if (a->priority != b->priority) return a->priority < b->priority;
+  return a->sequence > b->sequence;
+}
 
-  if (!compiler->jobQueueHead) {
-    compiler->jobQueueHead = job;
+// Should be called under jobQueueMutex
+void startCompilerWorker(Compiler *compiler) {
+  CompilerWorker *worker = NULL;
+  for (auto w = compiler->workers; w; w = w->next) {
+    if (w->retired) {
+      worker = w;
+      break;
+    }
+  }
+
+  if (worker) {
+    // Retired thread doesn't need the mutex to exit
+    pthread_join(worker->thread, NULL);
+    worker->retired = false;
+  } else {
+    worker = ALLOC(CompilerWorker, &compiler->mainAllocator);
+    *worker = {};
+    worker->index = compiler->allocatedWorkers++;
+    initThreadData(&worker->td, &compiler->globalData, &compiler->mainAllocator);
+    worker->next = compiler->workers;
+    compiler->workers = worker;
+  }
+
+  compiler->runningWorkers++;
+  auto error = pthread_create(&worker->thread, NULL, compilerThreadProc, worker);
+  if (error) {
+    fprintf(stderr, "%s:%d Failed to start worker thread: %s\n",
+      __FILE__, __LINE__, strerror(error));
+    abort();
   }
-  if (compiler->jobQueueTail) {
-    compiler->jobQueueTail->next = job;
+}
+
+void enqueueCompilerJob(Compiler *compiler, CompilerJob *job) {
+  lockJobQueue(compiler);
+
+  job->sequence = compiler->jobSequence++;
+  heapPush(&compiler->jobQueue, job, compilerJobLess, &compiler->mainAllocator);
+
+  // One queued job is left for a busy worker to pick up when it's done,
+  // so chains of dependent jobs (e.g. single file compile) use one thread
+  if (compiler->runningWorkers < compiler->maxWorkers &&
+      (compiler->runningWorkers == 0 ||
+       compiler->jobQueue.len > compiler->idleWorkers + 1)) {
+    startCompilerWorker(compiler);
   }
-  compiler->jobQueueTail = job;
 
   pthread_cond_signal(&compiler->jobQueueCond);
 
   pthread_mutex_unlock(&compiler->jobQueueMutex);
 }
 
+void postCompilerJob(Compiler *compiler, CompilerJob *job) {
+  if (__atomic_sub_fetch(&job->unfinishedDependencies, 1, __ATOMIC_ACQ_REL) == 0) {
+    enqueueCompilerJob(compiler, job);
+  }
+}
+
+void setJobStatus(CompilerJob *job, int status) {
+  auto current = __atomic_load_n(&job->status, __ATOMIC_RELAXED);
+  while (current < status &&
+         !__atomic_compare_exchange_n(&job->status, &current, status, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+void failJob(Compiler *compiler, CompilerJob *job, int status) {
+  setJobStatus(job, status);
+  if (!compiler->options.keepGoing) cancelCompilation(&compiler->globalData);
+}
+
+void spawnChildJob(Compiler *compiler, CompilerJob *parent, CompilerJob *child) {
+  child->parent = parent;
+  retainJob(parent);
+  postCompilerJob(compiler, child);
+}
+
+void addContinuation(CompilerJob *job, CompilerJob *continuation) {
+  assert(!job->continuation);
+  // Nothing would wait for continuation of the root job
+  assert(job->parent);
+  job->continuation = continuation;
+  // Continuation becomes a sibling of the job, so parent (and in the end
+  // the root job) isn't complete until continuation is
+  if (!continuation->parent) {
+    continuation->parent = job->parent;
+    retainJob(job->parent);
+  }
+  assert(continuation->parent == job->parent);
+  __atomic_add_fetch(&continuation->unfinishedDependencies, 1, __ATOMIC_RELAXED);
+}
+
+void retainJob(CompilerJob *job) {
+  __atomic_add_fetch(&job->unfinishedJobs, 1, __ATOMIC_RELAXED);
+}
+
+void finishJob(Compiler *compiler, CompilerJob *job) {
+  while (job) {
+    if (__atomic_sub_fetch(&job->unfinishedJobs, 1, __ATOMIC_ACQ_REL) != 0) return;
+
+    auto status = __atomic_load_n(&job->status, __ATOMIC_RELAXED);
+    auto parent = job->parent;
+    auto continuation = job->continuation;
+
+    if (continuation) {
+      setJobStatus(continuation, status);
+      postCompilerJob(compiler, continuation);
+    }
+
+    lockJobQueue(compiler);
+    // Workers stay until deinitCompiler, there may be more compilations
+    if (job == compiler->rootJob) {
+      compiler->exitStatus = status;
+      compiler->compilerFinished = true;
+      pthread_cond_broadcast(&compiler->compilerFinishedCond);
+    }
+    job->next = compiler->jobFreelistNext;
+    compiler->jobFreelistNext = job;
+    pthread_mutex_unlock(&compiler->jobQueueMutex);
+
+    // Completion of the last child completes parent
+    if (parent) setJobStatus(parent, status);
+    job = parent;
+  }
+}
+
+void jobFiberEntry(void *arg) {
+  auto fiber = static_cast<JobFiber *>(arg);
+  for (;;) {
+    executeJob(fiber->td, fiber->job);
+    fiber->state = JOB_FIBER_STATE_FINISHED;
+    switchFiberContext(&fiber->context, &fiber->td->schedulerContext);
+  }
+}
+
+// Should be called under jobQueueMutex
+JobFiber *acquireJobFiber(Compiler *compiler) {
+  auto fiber = compiler->fiberFreelistNext;
+  if (fiber) {
+    compiler->fiberFreelistNext = fiber->next;
+    return fiber;
+  }
+
+  fiber = ALLOC(JobFiber, &compiler->mainAllocator);
+  *fiber = {};
+  // Parser recursion goes as deep as MAX_PARSING_DEPTH, pages are committed
+  // only as deep as stack is actually used
+  fiber->stack = allocFiberStack(8 * 1024 * 1024);
+  initFiberContext(&fiber->context, &fiber->stack, jobFiberEntry, fiber);
+  fiber->nextAllocated = compiler->allFibers;
+  compiler->allFibers = fiber;
+  return fiber;
+}
+
+void lockJobEvent(JobEvent *event) {
+  while (__atomic_test_and_set(&event->locked, __ATOMIC_ACQUIRE)) {
+    __builtin_ia32_pause();
+  }
+}
+
+void unlockJobEvent(JobEvent *event) {
+  __atomic_clear(&event->locked, __ATOMIC_RELEASE);
+}
+
+const char *compilerJobTypeName(CompilerJobType type) {
+  switch (type) {
+  case COMPILER_JOB_TYPE_READ_FILE: return "read file";
+  case COMPILER_JOB_TYPE_PARSE: return "parse";
+  case COMPILER_JOB_TYPE_PARALLEL_FOR: return "parallel for";
+  }
+  return "job";
+}
+
+Str compilerJobDetail(CompilerJob *job) {
+  switch (job->type) {
+  case COMPILER_JOB_TYPE_READ_FILE: return job->fileNameToRead;
+  case COMPILER_JOB_TYPE_PARSE: return job->fileEntry.relativePath;
+  default: return {};
+  }
+}
+
+void runJobFiber(ThreadData *td, JobFiber *fiber) {
+  auto compiler = td->globalData->compiler;
+  auto job = fiber->job;
+
+  fiber->td = td;
+  fiber->state = JOB_FIBER_STATE_RUNNING;
+  td->currentFiber = fiber;
+  {
+    // One slice per run, job which waits continues in a new one (maybe on
+    // another worker)
+    TRACE_SCOPE(compilerJobTypeName(job->type), compilerJobDetail(job));
+    switchFiberContext(&td->schedulerContext, &fiber->context);
+  }
+  td->currentFiber = NULL;
+
+  switch (fiber->state) {
+  case JOB_FIBER_STATE_FINISHED: {
+    job->fiber = NULL;
+    fiber->job = NULL;
+    lockJobQueue(compiler);
+    fiber->next = compiler->fiberFreelistNext;
+    compiler->fiberFreelistNext = fiber;
+    pthread_mutex_unlock(&compiler->jobQueueMutex);
+
+    finishJob(compiler, job);
+  } break;
+  case JOB_FIBER_STATE_WAITING: {
+    // Registration happens here, on worker stack, because once job is in the
+    // waiters list it can be resumed by other thread at any moment
+    auto event = fiber->waitingFor;
+    fiber->waitingFor = NULL;
+
+    lockJobEvent(event);
+    bool signaled = event->signaled;
+    if (!signaled) {
+      job->next = event->waiters;
+      event->waiters = job;
+    }
+    unlockJobEvent(event);
+
+    if (signaled) enqueueCompilerJob(compiler, job);
+  } break;
+  default: abort();
+  }
+}
+
+ThreadData *waitForJobEvent(ThreadData *td, JobEvent *event) {
+  if (__atomic_load_n(&event->signaled, __ATOMIC_ACQUIRE)) return td;
+
+  auto fiber = td->currentFiber;
+  assert(fiber && "waitForJobEvent should be called from a job");
+  fiber->state = JOB_FIBER_STATE_WAITING;
+  fiber->waitingFor = event;
+  switchFiberContext(&fiber->context, &td->schedulerContext);
+
+  return fiber->td;
+}
+
+void signalJobEvent(Compiler *compiler, JobEvent *event) {
+  lockJobEvent(event);
+  __atomic_store_n(&event->signaled, true, __ATOMIC_RELEASE);
+  auto waiters = event->waiters;
+  event->waiters = NULL;
+  unlockJobEvent(event);
+
+  while (waiters) {
+    auto job = waiters;
+    waiters = job->next;
+    job->next = NULL;
+    enqueueCompilerJob(compiler, job);
+  }
+}
+
+ThreadData *parallelFor(ThreadData *td, uint32_t count, ParallelForBody *body, void *arg) {
+  if (!td->currentFiber || count <= 1) {
+    for (uint32_t i = 0; i < count; ++i) body(td, arg, i);
+    return td;
+  }
+
+  // Lives on the fiber stack, which is kept while we wait
+  ParallelFor pf = {};
+  pf.body = body;
+  pf.arg = arg;
+  pf.unfinished = count;
+
+  auto compiler = td->globalData->compiler;
+  auto parent = td->currentFiber->job;
+  for (uint32_t i = 0; i < count; ++i) {
+    auto job = allocOrReuseCompilerJob(compiler);
+    job->type = COMPILER_JOB_TYPE_PARALLEL_FOR;
+    job->priority = parent->priority;
+    job->parallelFor = &pf;
+    job->parallelForIndex = i;
+    spawnChildJob(compiler, parent, job);
+  }
+
+  td = waitForJobEvent(td, &pf.done);
+  // Wait could return before signaling thread released the event
+  lockJobEvent(&pf.done);
+  unlockJobEvent(&pf.done);
+  return td;
+}
+
+ASTFile *waitForFileParsed(ThreadData **td, uint32_t fileIndex) {
+  auto slot = fileSlotAt(&(*td)->globalData->files, fileIndex);
+  *td = waitForJobEvent(*td, &slot->parsedEvent);
+  return slot->ast;
+}
 
 void *compilerThreadProc(void *arg) {
-  auto td = static_cast<ThreadData *>(arg);
+  auto worker = static_cast<CompilerWorker *>(arg);
+  auto td = &worker->td;
   auto compiler = td->globalData->compiler;
 
-  pthread_mutex_lock(&compiler->jobQueueMutex);
+  if (compiler->options.pinThreads) {
+    pinThreadToCpu(&compiler->allowedCpus, worker->index);
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "worker %d", worker->index);
+  nameTraceThread(name);
+
+  lockJobQueue(compiler);
   for (;;) {
-    while (compiler->jobQueueHead == NULL && compiler->jobQueueShouldContinue) {
-      pthread_cond_wait(&compiler->jobQueueCond, &compiler->jobQueueMutex);
+    bool retire = false;
+    while (compiler->jobQueue.len == 0 && compiler->jobQueueShouldContinue) {
+      int error = 0;
+      compiler->idleWorkers++;
+      TRACE_SCOPE("idle");
+      if (compiler->options.idleWorkerTimeoutMs > 0) {
+        timespec deadline = {};
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        auto ns = deadline.tv_nsec + compiler->options.idleWorkerTimeoutMs * 1000000ll;
+        deadline.tv_sec += ns / 1000000000ll;
+        deadline.tv_nsec = ns % 1000000000ll;
+        error = pthread_cond_timedwait(&compiler->jobQueueCond, &compiler->jobQueueMutex, &deadline);
+      } else {
+        pthread_cond_wait(&compiler->jobQueueCond, &compiler->jobQueueMutex);
+      }
+      compiler->idleWorkers--;
+
+      // Last worker stays, so there is always someone to take new jobs quickly
+      if (error == ETIMEDOUT && compiler->jobQueue.len == 0 &&
+          compiler->runningWorkers > 1) {
+        retire = true;
+        break;
+      }
+    }
+    if (retire) {
+      compiler->runningWorkers--;
+      worker->retired = true;
+      break;
     }
     if (!compiler->jobQueueShouldContinue) break;
 
-    auto job = compiler->jobQueueHead;
-    compiler->jobQueueHead = job->next;
+    auto job = heapPop(&compiler->jobQueue, compilerJobLess);
+    if (!job->fiber) {
+      job->fiber = acquireJobFiber(compiler);
+      job->fiber->job = job;
+    }
 
     pthread_mutex_unlock(&compiler->jobQueueMutex);
-    executeJob(td, job);
-    pthread_mutex_lock(&compiler->jobQueueMutex);
-
-    job->next = compiler->jobFreelistNext;
-    compiler->jobFreelistNext = job;
+    runJobFiber(td, job->fiber);
+    lockJobQueue(compiler);
   }
   pthread_mutex_unlock(&compiler->jobQueueMutex);
 
   return NULL;
 }
 
+// Everything workers allocate outside of file regions is needed only while
+// compilation runs (resolved paths, messages), so a compiler which keeps
+// running doesn't grow with every compilation. No job runs at this point.
+void rewindWorkerAllocators(Compiler *compiler) {
+  lockJobQueue(compiler);
+  for (auto worker = compiler->workers; worker; worker = worker->next) {
+    reset(&worker->td.allocator);
+  }
+  pthread_mutex_unlock(&compiler->jobQueueMutex);
+}
+
+// Slots the finished compilation didn't visit are previous versions of
+// edited files (or replaced by rename) and files no longer loaded. Their
+// memory goes back to the reservoir, a later visit loads the file again.
+void releaseUnusedFiles(Compiler *compiler) {
+  auto files = &compiler->globalData.files;
+  auto compilation = compiler->globalData.loadedFiles.compilation;
+  for (uint32_t i = 0, count = filesCount(files); i < count; ++i) {
+    auto slot = publishedFileSlot(files, i);
+    if (slot && slot->compilation != compilation) releaseFileRegion(files, i);
+  }
+}
+
 int waitForCompilerToFinish(Compiler *compiler) {
-  pthread_mutex_lock(&compiler->jobQueueMutex);
+  lockJobQueue(compiler);
   while (!compiler->compilerFinished) {
-    pthread_cond_wait(&compiler->jobQueueCond, &compiler->jobQueueMutex);
+    pthread_cond_wait(&compiler->compilerFinishedCond, &compiler->jobQueueMutex);
   }
   auto result = compiler->exitStatus;
   pthread_mutex_unlock(&compiler->jobQueueMutex);
+
+  releaseUnusedFiles(compiler);
+  rewindWorkerAllocators(compiler);
+  return result;
+}
+
+bool waitForCompilerToFinishFor(Compiler *compiler, int timeoutMs, int *status) {
+  timespec deadline = {};
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  auto ns = deadline.tv_nsec + timeoutMs * 1000000ll;
+  deadline.tv_sec += ns / 1000000000ll;
+  deadline.tv_nsec = ns % 1000000000ll;
+
+  lockJobQueue(compiler);
+  int error = 0;
+  while (!compiler->compilerFinished && error != ETIMEDOUT) {
+    error = pthread_cond_timedwait(&compiler->compilerFinishedCond, &compiler->jobQueueMutex,
+                                   &deadline);
+  }
+  bool finished = compiler->compilerFinished;
+  pthread_mutex_unlock(&compiler->jobQueueMutex);
+
+  if (finished) *status = waitForCompilerToFinish(compiler);
+  return finished;
+}
+
+struct ResolvedFilePath {
+  Str canonicalPath;
+  int64_t size;
+  bool isNew;
+  int error;
+  FileIdentity identity;
+  uint32_t previousIndex;
+};
+
+// Resolves path relative to directory into canonical absolute path and
+// registers file identity, so every file is visited once per compilation
+ResolvedFilePath resolveFilePath(ThreadData *td, Str directory, Str path) {
+  ResolvedFilePath result = {};
+
+  char joined[PATH_MAX + 1];
+  if ((path.len && path.data[0] == '/') || !directory.len) {
+    snprintf(joined, sizeof(joined), "%.*s", (int)path.len, path.data);
+  } else {
+    snprintf(joined, sizeof(joined), "%.*s/%.*s",
+      (int)directory.len, directory.data, (int)path.len, path.data);
+  }
+
+  char canonical[PATH_MAX + 1];
+  if (!realpath(joined, canonical)) {
+    result.error = errno;
+    return result;
+  }
+
+  struct stat st = {};
+  if (stat(canonical, &st) != 0) {
+    result.error = errno;
+    return result;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    result.error = EISDIR;
+    return result;
+  }
+
+  FileIdentity identity = {};
+  identity.device = st.st_dev;
+  identity.inode = st.st_ino;
+  result.size = st.st_size;
+  result.identity = identity;
+  result.isNew = insertFileIdentity(&td->globalData->loadedFiles, identity,
+                                    &td->globalData->compiler->mainAllocator,
+                                    &result.previousIndex);
+  if (!result.isNew) return result;
+
+  // Path of loaded file is reused, so compiler which keeps running doesn't
+  // allocate on every visit
+  if (result.previousIndex != FILE_INDEX_NONE) {
+    auto previousPath = fileEntryAt(&td->globalData->files, result.previousIndex)->absolutePath;
+    if (strcmp(previousPath.data, canonical) == 0) result.canonicalPath = previousPath;
+  }
+  if (!result.canonicalPath.data) {
+    result.canonicalPath = SPrintf(&td->allocator, "%s", canonical);
+  }
+
+  return result;
+}
+
+Str directoryOf(Str path) {
+  auto result = path;
+  while (result.len && result.data[result.len - 1] != '/') result.len--;
+  if (result.len > 1) result.len--; // keep "/" for root
+  return result;
+}
+
+void postLoadDirectiveDependencies(ThreadData *td, CompilerJob *parseJob, FileEntry *fileEntry, ASTFile *ast) {
+  auto compiler = td->globalData->compiler;
+  auto directory = directoryOf(fileEntry->absolutePath);
+
+  for (int i = 0; i < ast->topLevelDecls.len; ++i) {
+    auto directive = AST_CAST(ASTLoadDirective, ast->topLevelDecls[i]);
+    if (!directive) continue;
+
+    auto resolved = resolveFilePath(td, directory, directive->path->value);
+    if (resolved.error) {
+      auto message = SPrintf(&td->allocator, "Failed to load '%.*s': %s",
+        (int)directive->path->value.len, directive->path->value.data,
+        strerror(resolved.error));
+      report(td, compiler->diagnostics, "error", fileEntry->index,
+             directive->offset0, directive->offset1, message);
+      failJob(compiler, parseJob, 1);
+      continue;
+    }
+    if (!resolved.isNew) continue;
+
+    auto job = allocOrReuseCompilerJob(compiler);
+    job->type = COMPILER_JOB_TYPE_READ_FILE;
+    job->fileNameToRead = resolved.canonicalPath;
+    job->pathIsCanonical = true;
+    job->fileIdentity = resolved.identity;
+    job->previousFileIndex = resolved.previousIndex;
+    job->priority = resolved.size;
+    spawnChildJob(compiler, parseJob, job);
+  }
+}
+
+// Same size and modification time, or same content if only the time differs
+// (e.g. touched by checkout)
+bool fileUnchangedOnDisk(ThreadData *td, FileTableSlot *slot) {
+  auto entry = &slot->entry;
+  struct stat st = {};
+  if (stat(entry->absolutePath.data, &st) != 0 || (uint64_t)st.st_size != entry->content.len) {
+    return false;
+  }
+  if (st.st_mtim.tv_sec != slot->mtimeSec || st.st_mtim.tv_nsec != slot->mtimeNsec) {
+    auto scratch = getScratch(td);
+    AllocatorCheckpoint checkpoint(scratch);
+    auto current = readFile(scratch, entry->absolutePath.data);
+    if (!current.ok || !StrEqual(current.content, entry->content)) return false;
+    slot->mtimeSec = st.st_mtim.tv_sec;
+    slot->mtimeNsec = st.st_mtim.tv_nsec;
+  }
+  return true;
+}
+
+// File loaded by earlier compilation which didn't change is not read or
+// parsed again, only its dependencies are visited
+bool reuseLoadedFile(ThreadData *td, CompilerJob *job, uint32_t index) {
+  auto globalData = td->globalData;
+  auto slot = fileSlotAt(&globalData->files, index);
+  if (!slot->ast) return false;
+
+  // Changed file keeps its previous version until the new one is parsed
+  auto entry = &slot->entry;
+  if (!slot->watched && !fileUnchangedOnDisk(td, slot)) return false;
+
+  slot->compilation = globalData->loadedFiles.compilation;
+  entry->relativePath = pathRelativeTo(globalData->currentWorkingDirectory, entry->absolutePath);
+  postLoadDirectiveDependencies(td, job, entry, slot->ast);
+  return true;
+}
+
+// Edited file is parsed reusing declarations of its previous version outside
+// of the range where they differ (between common prefix and suffix)
+ASTFile *reparseEditedFile(ThreadData *td, Lexer *lexer, ASTFile *oldFile, Str oldContent,
+                           ParsingError *error) {
+  auto newContent = lexer->source;
+  size_t prefix = 0;
+  while (prefix < oldContent.len && prefix < newContent.len &&
+         oldContent.data[prefix] == newContent.data[prefix]) {
+    prefix++;
+  }
+  size_t suffix = 0;
+  while (suffix < oldContent.len - prefix && suffix < newContent.len - prefix &&
+         oldContent.data[oldContent.len - 1 - suffix] == newContent.data[newContent.len - 1 - suffix]) {
+    suffix++;
+  }
+
+  SourceEdit edit = {};
+  edit.offset0 = prefix;
+  edit.offset1 = oldContent.len - suffix;
+  edit.text = Str{newContent.data + prefix, newContent.len - suffix - prefix};
+  return reparseFile(td, lexer, oldFile, oldContent, &edit, 1, error);
+}
+
+// Previous version of a file is released once the new one is parsed or
+// failed to load
+void releasePreviousVersion(GlobalData *globalData, uint32_t previousFileIndex) {
+  if (previousFileIndex != FILE_INDEX_NONE) {
+    releaseFileRegion(&globalData->files, previousFileIndex);
+  }
+}
+
+// Hashes every node, so later passes can use hashes as cache keys, and
+// drops duplicated type expressions before compaction copies them
+void hashFileAST(ThreadData *td, FileTableSlot *slot, ASTFile *ast) {
+  auto compiler = td->globalData->compiler;
+  if (!compiler->options.hashConsTypes) {
+    hashAST(ast, NULL, getScratch(td));
+    return;
+  }
+
+  auto tableScratch = getScratch(td);
+  AllocatorCheckpoint checkpoint(tableScratch);
+  ASTHashConsTable table;
+  initASTHashConsTable(&table, tableScratch, &slot->region);
+  hashAST(ast, &table, getScratch(td, tableScratch));
+}
+
+// Moves source and AST into a fresh region of the file and releases the one
+// used while parsing, together with backtracking leftovers
+ASTFile *compactFile(Compiler *compiler, FileTableSlot *slot, ASTFile *ast) {
+  Allocator compacted = {};
+  initGrowableAllocator(&compacted, &compiler->mainAllocator, usage(&slot->region),
+                        ALLOCATOR_FLAG_RELEASABLE);
+  auto result = compactFileAST(ast, &slot->entry.content, &compacted);
+  releaseAllocator(&slot->region);
+  slot->region = compacted;
   return result;
 }
 
+// Cached image replaces region of the file, source included
+ASTFile *loadCachedFile(FileTableSlot *slot, const char *path, uint64_t key) {
+  TRACE_SCOPE("load cached AST", slot->entry.relativePath);
+  void *image = NULL;
+  size_t imageSize = 0;
+  auto ast = mapASTImage(path, key, slot->entry.content, slot->entry.index,
+                         &image, &imageSize);
+  if (!ast) return NULL;
+
+  releaseAllocator(&slot->region);
+  slot->image = image;
+  slot->imageSize = imageSize;
+  slot->entry.content.data = (char *)image + AST_IMAGE_OFFSET;
+  return ast;
+}
+
+// Compacted file usually fits first block of its region, then it is already
+// laid out as an image. Otherwise it is just not cached.
+void storeCachedFile(ThreadData *td, FileTableSlot *slot, ASTFile *ast,
+                     const char *path, uint64_t key) {
+  auto region = &slot->region;
+  if (!region->block || region->block->prev) return;
+  TRACE_SCOPE("store cached AST", slot->entry.relativePath);
+  writeASTImage(path, key, ast, slot->entry.content, region->current, getScratch(td));
+}
+
 void executeJob(ThreadData *td, CompilerJob *job) {
+  auto compiler = td->globalData->compiler;
+  auto cancelled = compilationCancelled(td->globalData);
+
   switch (job->type) {
   case COMPILER_JOB_TYPE_READ_FILE: {
-    //TODO: continue here
+    if (cancelled) break;
+
+    auto fileName = job->fileNameToRead;
+    if (!job->pathIsCanonical) {
+      auto cwd = CStringToStr(td->globalData->currentWorkingDirectory);
+      auto resolved = resolveFilePath(td, cwd, fileName);
+      if (resolved.error) {
+        fprintf(compiler->diagnostics, "%.*s| error Failed to read file: %s\n",
+          (int)fileName.len, fileName.data, strerror(resolved.error));
+        failJob(compiler, job, 1);
+        break;
+      }
+      if (!resolved.isNew) break;
+      fileName = resolved.canonicalPath;
+      job->fileIdentity = resolved.identity;
+      job->previousFileIndex = resolved.previousIndex;
+    }
 
-    { //TODO Move exit code
-      auto newJob = allocOrReuseCompilerJob(td->globalData->compiler);
-      newJob->type = COMPILER_JOB_TYPE_EXIT;
-      postCompilerJob(td->globalData->compiler, newJob);
+    if (job->previousFileIndex != FILE_INDEX_NONE &&
+        reuseLoadedFile(td, job, job->previousFileIndex)) {
+      break;
     }
+
+    // Either queued to io_uring thread or read right here,
+    // PARSE job is posted once content is available
+    loadFile(&compiler->fileLoader, td, job, fileName);
   } break;
   case COMPILER_JOB_TYPE_PARSE: {
-    //TODO: continue here
+    auto fileEntry = job->fileEntry;
+    auto slot = fileSlotAt(&td->globalData->files, fileEntry.index);
+
+    // Waiters still have to be woken up, they will see NULL ast
+    if (cancelled) {
+      releaseFileRegion(&td->globalData->files, fileEntry.index);
+      releasePreviousVersion(td->globalData, job->previousFileIndex);
+      signalJobEvent(compiler, &slot->parsedEvent);
+      break;
+    }
+
+    auto cacheDirectory = compiler->options.cacheDirectory;
+    uint64_t cacheKey = 0;
+    char cachePath[PATH_MAX];
+    AST *ast = NULL;
+    if (cacheDirectory) {
+      cacheKey = astCacheKey(fileEntry.content, compiler->options.hashConsTypes);
+      snprintf(cachePath, sizeof(cachePath), "%s/%016" PRIx64 ".ast", cacheDirectory, cacheKey);
+      ast = loadCachedFile(slot, cachePath, cacheKey);
+    }
+
+    ParsingError error = {};
+    if (!ast) {
+      Lexer lexer = {};
+      lexer.fileIndex = fileEntry.index;
+      lexer.source = fileEntry.content;
+
+      // AST and everything else parser allocates belongs to the file
+      auto threadAllocator = td->allocator;
+      td->allocator = slot->region;
+      // Declarations reused from previous version are copied by compaction
+      auto previous = job->previousFileIndex != FILE_INDEX_NONE
+                        ? fileSlotAt(&td->globalData->files, job->previousFileIndex)
+                        : NULL;
+      if (previous && previous->ast) {
+        ast = reparseEditedFile(td, &lexer, previous->ast, previous->entry.content, &error);
+      } else {
+        ast = parseFile(td, &lexer, 0, &error);
+      }
+      slot->region = td->allocator;
+      td->allocator = threadAllocator;
+
+      if (ast) {
+        hashFileAST(td, slot, AST_ASSERT_CAST(ASTFile, ast));
+        ast = compactFile(compiler, slot, AST_ASSERT_CAST(ASTFile, ast));
+        if (cacheDirectory) {
+          storeCachedFile(td, slot, AST_ASSERT_CAST(ASTFile, ast), cachePath, cacheKey);
+        }
+      }
+    }
+
+    if (ast) {
+      fileEntry.content = slot->entry.content;
+      postLoadDirectiveDependencies(td, job, &fileEntry, AST_ASSERT_CAST(ASTFile, ast));
+    } else {
+      if (!compilationCancelled(td->globalData)) {
+        report(td, compiler->diagnostics, "error", fileEntry.index, error.offset, error.offset,
+               error.message);
+        failJob(compiler, job, 1);
+      }
+      releaseFileRegion(&td->globalData->files, fileEntry.index);
+    }
+
+    releasePreviousVersion(td->globalData, job->previousFileIndex);
+    slot->ast = static_cast<ASTFile *>(ast);
+    signalJobEvent(compiler, &slot->parsedEvent);
   } break;
-  case COMPILER_JOB_TYPE_EXIT: {
-    td->globalData->compiler->compilerFinished = true;
-    td->globalData->compiler->jobQueueShouldContinue = false;
-    pthread_cond_broadcast(&td->globalData->compiler->jobQueueCond);
+  case COMPILER_JOB_TYPE_PARALLEL_FOR: {
+    auto pf = job->parallelFor;
+    pf->body(td, pf->arg, job->parallelForIndex);
+    if (__atomic_sub_fetch(&pf->unfinished, 1, __ATOMIC_ACQ_REL) == 0) {
+      signalJobEvent(compiler, &pf->done);
+    }
   } break;
   default: abort();
   }
@@ -1,52 +1,210 @@
 #pragma once
 #include "core_types.h"
+#include "file_loader.h"
 
 enum CompilerJobType {
   COMPILER_JOB_TYPE_READ_FILE,
   COMPILER_JOB_TYPE_PARSE,
+  COMPILER_JOB_TYPE_PARALLEL_FOR,
+};
 
-  COMPILER_JOB_TYPE_EXIT,
+struct ThreadData;
+typedef void (ParallelForBody)(ThreadData *td, void *arg, uint32_t index);
+struct ParallelFor {
+  ParallelForBody *body;
+  void *arg;
+  uint32_t unfinished;
+  JobEvent done;
 };
 
+// Jobs form a graph:
+// - a job is complete when it finished executing and all of its children
+//   (spawned with spawnChildJob) are complete;
+// - continuation of a job is posted once all jobs it was attached to are
+//   complete, it's a child of their (common) parent;
+// - status is aggregated from children and dependencies (max wins).
+// Compilation is finished when root job is complete.
 struct CompilerJob {
   CompilerJobType type;
 
+  int status;
+
+  // Estimated amount of work (bytes of source) behind the job, bigger jobs
+  // are started first so they don't end up as the tail everyone waits for
+  int64_t priority;
+  uint64_t sequence; // FIFO among equal priorities
+
+  CompilerJob *parent;
+  CompilerJob *continuation;
+  // Self (until executed) + unfinished children + retains
+  int unfinishedJobs;
+  // Creation guard (released by postCompilerJob) + unfinished dependencies
+  int unfinishedDependencies;
+
   //READ_FILE
   Str fileNameToRead;
+  bool pathIsCanonical; // already resolved and deduplicated
+  // Set together with pathIsCanonical
+  FileIdentity fileIdentity;
+  // Loaded by earlier compilation: reused if unchanged, otherwise PARSE of
+  // the new version reuses its unchanged declarations and releases it
+  uint32_t previousFileIndex;
 
   //PARSE
   FileEntry fileEntry;
 
-  //EXIT
-  int status;
+  //PARALLEL_FOR
+  ParallelFor *parallelFor;
+  uint32_t parallelForIndex;
+
+  JobFiber *fiber; // set while job is started but not finished
 
   CompilerJob *next;
 };
 
+enum JobFiberState {
+  JOB_FIBER_STATE_RUNNING,
+  JOB_FIBER_STATE_FINISHED,
+  JOB_FIBER_STATE_WAITING,
+};
+
+// Every job runs on a fiber, so it can suspend in the middle of execution
+// without blocking worker thread
+struct JobFiber {
+  FiberContext context;
+  FiberStack stack;
+  JobFiberState state;
+
+  CompilerJob *job;
+  ThreadData *td; // worker currently running the fiber
+  JobEvent *waitingFor;
+
+  JobFiber *next;
+  JobFiber *nextAllocated;
+};
+
+struct CompilerOptions {
+  // Upper bound of worker pool size, 0 means number of available CPUs
+  int threads;
+  // Compilation is started by initCompiler if set, see startCompilation
+  const char *entryPoint;
+  // Report all errors instead of cancelling remaining work on the first one
+  bool keepGoing;
+  // Pin every worker to its own CPU
+  bool pinThreads;
+  // Idle workers retire after this long (daemon mode), 0 keeps them alive
+  int idleWorkerTimeoutMs;
+  // Share identical type expressions within a file (see hashAST)
+  bool hashConsTypes;
+  // Parsed files are stored here and unchanged files are not parsed again,
+  // NULL disables the cache
+  const char *cacheDirectory;
+  // Start from state saved by writeCompilerSnapshot, only changed files are
+  // loaded again
+  const char *restoreSnapshot;
+};
+
+// Thread of the worker pool, reused after it retires
+struct CompilerWorker {
+  ThreadData td;
+  pthread_t thread;
+  int index;
+  bool retired; // thread exited but wasn't joined yet
+  CompilerWorker *next;
+};
+
 struct Compiler {
+  CompilerOptions options;
   GlobalData globalData;
-  ThreadData threadsData[64];
-  int threads;
+
+  // Pool starts empty and grows while queued jobs outnumber idle workers
+  CompilerWorker *workers;
+  int allocatedWorkers;
+  int runningWorkers;
+  int idleWorkers;
+  int maxWorkers;
+  // Captured once: workers are started by other (maybe pinned) workers, whose
+  // mask they would inherit
+  cpu_set_t allowedCpus;
 
   void *memory;
   size_t memorySize;
 
   Allocator mainAllocator;
 
+  FileLoader fileLoader;
+
+  // Errors of current compilation are written here, stderr by default
+  FILE *diagnostics;
+
   CompilerJob *jobFreelistNext;
-  CompilerJob *jobQueueHead;
-  CompilerJob *jobQueueTail;
+  Array<CompilerJob *> jobQueue; // heap ordered by priority
+  uint64_t jobSequence;
   bool jobQueueShouldContinue;
   bool compilerFinished;
   int exitStatus;
+  CompilerJob *rootJob;
+
+  JobFiber *fiberFreelistNext;
+  JobFiber *allFibers;
+
   pthread_mutex_t jobQueueMutex;
   pthread_cond_t jobQueueCond;
+  pthread_cond_t compilerFinishedCond;
 };
 
-void initCompiler(Compiler *compiler, int threads, const char *entryPoint);
+void initCompiler(Compiler *compiler, CompilerOptions options);
 void deinitCompiler(Compiler *compiler);
+// Compiles entry point, files loaded by earlier compilations of this compiler
+// are reused while they don't change on disk. Previous compilation should be
+// finished, entry point should stay valid until this one is.
+void startCompilation(Compiler *compiler, const char *entryPoint);
 CompilerJob *allocOrReuseCompilerJob(Compiler *compiler);
 void postCompilerJob(Compiler *compiler, CompilerJob *job);
+// Also releases files the compilation didn't use and rewinds allocators of
+// workers, memory they handed out during compilation is not valid afterwards
 int waitForCompilerToFinish(Compiler *compiler);
+// Returns false if compilation is still running after timeoutMs, otherwise
+// finishes as waitForCompilerToFinish
+bool waitForCompilerToFinishFor(Compiler *compiler, int timeoutMs, int *status);
 void executeJob(ThreadData *td, CompilerJob *job);
 
+// Should be called while parent is not complete, i.e. from parent itself,
+// from its descendant or while parent is retained
+void spawnChildJob(Compiler *compiler, CompilerJob *parent, CompilerJob *child);
+// Continuation should not be posted yet, job should not be complete yet.
+// Job should have a parent, which is then shared by every job continuation
+// is attached to.
+void addContinuation(CompilerJob *job, CompilerJob *continuation);
+// Keeps job incomplete after it returned from executeJob,
+// used for work which finishes asynchronously (e.g. file loading)
+void retainJob(CompilerJob *job);
+void finishJob(Compiler *compiler, CompilerJob *job);
+void setJobStatus(CompilerJob *job, int status);
+// Sets status and cancels the rest of compilation unless keepGoing is set
+void failJob(Compiler *compiler, CompilerJob *job, int status);
+
+// Suspends calling job until event is signaled. Job may be resumed on another
+// worker, so returned ThreadData should be used from now on.
+ThreadData *waitForJobEvent(ThreadData *td, JobEvent *event);
+void signalJobEvent(Compiler *compiler, JobEvent *event);
+// Signaling thread may still hold the event when waiter resumes, waiter
+// which frees or reuses it should lock and unlock it first
+void lockJobEvent(JobEvent *event);
+void unlockJobEvent(JobEvent *event);
+// Runs body for every index in [0, count) as child jobs of the calling job
+// and suspends until all of them are done. Runs sequentially outside of jobs.
+ThreadData *parallelFor(ThreadData *td, uint32_t count, ParallelForBody *body, void *arg);
+
+// Parses new version of a file (source of lexer) reusing declarations of the
+// old one outside of the range where they differ
+ASTFile *reparseEditedFile(ThreadData *td, Lexer *lexer, ASTFile *oldFile, Str oldContent,
+                           ParsingError *error);
+// Path without its last component, "/" for files in root
+Str directoryOf(Str path);
+
+void releasePreviousVersion(GlobalData *globalData, uint32_t previousFileIndex);
+
+// Returns NULL if file failed to parse
+ASTFile *waitForFileParsed(ThreadData **td, uint32_t fileIndex);
+
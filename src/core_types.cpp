@@ -2,35 +2,252 @@
 
 #include <stdio.h>
 
+#include <assert.h>
+#include <errno.h>
 #include <unistd.h>
+#include <sys/mman.h>
 
 void initGlobalData(GlobalData *globalData) {
   *globalData = {};
-  auto error = pthread_mutex_init(&globalData->filesMutex, NULL);
-  if (error) {
-    fprintf(stderr, "%s:%d pthread_mutex_init failed: %s\n",
-      __FILE__, __LINE__, strerror(error));
-    abort();
-  }
+  initFileIdentitySet(&globalData->loadedFiles);
   auto cwd = getcwd(globalData->currentWorkingDirectory,
     sizeof(globalData->currentWorkingDirectory));
   if (!cwd) {
     fprintf(stderr, "%s:%d getcwd failed: %s\n",
-      __FILE__, __LINE__, strerror(error));
+      __FILE__, __LINE__, strerror(errno));
     abort();
   }
 }
 
-void initThreadData(ThreadData *td, GlobalData *globalData, void *memory, size_t size) {
+void deinitGlobalData(GlobalData *globalData) {
+  deinitFileIdentitySet(&globalData->loadedFiles);
+  deinitFileTable(&globalData->files);
+}
+
+void cancelCompilation(GlobalData *globalData) {
+  __atomic_store_n(&globalData->cancelled, true, __ATOMIC_RELAXED);
+}
+
+bool compilationCancelled(GlobalData *globalData) {
+  return __atomic_load_n(&globalData->cancelled, __ATOMIC_RELAXED);
+}
+
+void initThreadData(ThreadData *td, GlobalData *globalData, Allocator *reservoir) {
   *td = {};
   td->globalData = globalData;
-  initAllocator(&td->allocator, (char *) memory, size);
+  // Blocks are taken lazily by the thread which allocates, so they are
+  // first-touched and placed on its NUMA node
+  initGrowableAllocator(&td->allocator, reservoir, 64 * 1024, ALLOCATOR_FLAG_NUMA_LOCAL);
+  initGrowableAllocator(td->scratch + 0, reservoir, 64 * 1024, ALLOCATOR_FLAG_NUMA_LOCAL);
+  initGrowableAllocator(td->scratch + 1, reservoir, 64 * 1024, ALLOCATOR_FLAG_NUMA_LOCAL);
+}
+
+Allocator *getScratch(ThreadData *td, Allocator *conflict) {
+  return conflict == td->scratch ? td->scratch + 1 : td->scratch;
+}
+
+void initFileIdentitySet(FileIdentitySet *set) {
+  *set = {};
+  for (int i = 0; i < FILE_IDENTITY_SET_SHARDS; ++i) {
+    auto error = pthread_mutex_init(&set->shards[i].mutex, NULL);
+    if (error) {
+      fprintf(stderr, "%s:%d pthread_mutex_init failed: %s\n",
+        __FILE__, __LINE__, strerror(error));
+      abort();
+    }
+  }
+}
+
+void deinitFileIdentitySet(FileIdentitySet *set) {
+  for (int i = 0; i < FILE_IDENTITY_SET_SHARDS; ++i) {
+    pthread_mutex_destroy(&set->shards[i].mutex);
+  }
+}
+
+uint64_t hashFileIdentity(FileIdentity identity) {
+  // splitmix64 finalizer over both fields
+  uint64_t h = identity.device * 0x9E3779B97F4A7C15ull ^ identity.inode;
+  h ^= h >> 30;
+  h *= 0xBF58476D1CE4E5B9ull;
+  h ^= h >> 27;
+  h *= 0x94D049BB133111EBull;
+  h ^= h >> 31;
+  return h;
+}
+
+FileIdentitySlot *findOrInsertSlot(FileIdentitySlot *slots, uint32_t cap,
+                                   FileIdentity identity, uint64_t hash, bool *inserted) {
+  for (uint32_t i = hash & (cap - 1);; i = (i + 1) & (cap - 1)) {
+    auto slot = slots + i;
+    if (!slot->used) {
+      slot->used = true;
+      slot->identity = identity;
+      slot->fileIndex = FILE_INDEX_NONE;
+      *inserted = true;
+      return slot;
+    }
+    if (slot->identity.device == identity.device &&
+        slot->identity.inode == identity.inode) {
+      *inserted = false;
+      return slot;
+    }
+  }
+}
+
+// Should be called under mutex of the shard
+FileIdentitySlot *lookupFileIdentity(FileIdentitySetShard *shard, FileIdentity identity,
+                                     uint64_t hash, Allocator *a) {
+  // Keep load factor under 1/2
+  if ((shard->len + 1) * 2 > shard->cap) {
+    uint32_t newCap = shard->cap ? shard->cap * 2 : 16;
+    auto newSlots = ALLOC_ARRAY(FileIdentitySlot, newCap, a);
+    memset(newSlots, 0, newCap * sizeof(FileIdentitySlot));
+    for (uint32_t i = 0; i < shard->cap; ++i) {
+      auto slot = shard->slots + i;
+      if (slot->used) {
+        bool inserted = false;
+        auto moved = findOrInsertSlot(newSlots, newCap, slot->identity,
+                                      hashFileIdentity(slot->identity), &inserted);
+        *moved = *slot;
+      }
+    }
+    shard->slots = newSlots;
+    shard->cap = newCap;
+  }
+
+  bool inserted = false;
+  auto slot = findOrInsertSlot(shard->slots, shard->cap, identity, hash, &inserted);
+  if (inserted) shard->len++;
+  return slot;
+}
+
+FileIdentitySetShard *fileIdentityShard(FileIdentitySet *set, uint64_t hash) {
+  // Top bits select shard, low bits select slot inside of it
+  return set->shards + (hash >> 58) % FILE_IDENTITY_SET_SHARDS;
+}
+
+bool insertFileIdentity(FileIdentitySet *set, FileIdentity identity, Allocator *a,
+                        uint32_t *previousIndex) {
+  auto hash = hashFileIdentity(identity);
+  auto shard = fileIdentityShard(set, hash);
+  auto compilation = __atomic_load_n(&set->compilation, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&shard->mutex);
+  auto slot = lookupFileIdentity(shard, identity, hash, a);
+  // Fresh slots have compilation 0, compilations are counted from 1
+  bool isNew = slot->compilation != compilation;
+  slot->compilation = compilation;
+  if (previousIndex) *previousIndex = slot->fileIndex;
+  pthread_mutex_unlock(&shard->mutex);
+
+  return isNew;
+}
+
+void setFileIdentityIndex(FileIdentitySet *set, FileIdentity identity, uint32_t index,
+                          Allocator *a) {
+  auto hash = hashFileIdentity(identity);
+  auto shard = fileIdentityShard(set, hash);
+
+  pthread_mutex_lock(&shard->mutex);
+  lookupFileIdentity(shard, identity, hash, a)->fileIndex = index;
+  pthread_mutex_unlock(&shard->mutex);
 }
 
 FileEntry file(GlobalData *globalData, int fileIndex) {
-  pthread_mutex_lock(&globalData->filesMutex);
-  auto result = globalData->files[fileIndex];
-  pthread_mutex_unlock(&globalData->filesMutex);
+  return *fileEntryAt(&globalData->files, fileIndex);
+}
+
+size_t fileTableSegmentSize(int segment) {
+  return (size_t)(FILE_TABLE_FIRST_SEGMENT_SIZE << segment) * sizeof(FileTableSlot);
+}
+
+// Segment k covers indices [S * (2^k - 1), S * (2^(k+1) - 1)) where S is
+// first segment size, so shifting index by S gives position of the top bit
+FileTableSlot *fileTableSlot(FileTable *table, uint32_t index, int *segmentOut) {
+  uint64_t shifted = (uint64_t)index + FILE_TABLE_FIRST_SEGMENT_SIZE;
+  int topBit = 63 - __builtin_clzll(shifted);
+  int segment = topBit - FILE_TABLE_FIRST_SEGMENT_BITS;
+  uint64_t offset = shifted - (1ull << topBit);
+
+  *segmentOut = segment;
+  auto slots = __atomic_load_n(&table->segments[segment], __ATOMIC_ACQUIRE);
+  if (!slots) return NULL;
+  return slots + offset;
+}
+
+void deinitFileTable(FileTable *table) {
+  auto count = filesCount(table);
+  for (uint32_t i = 0; i < count; ++i) {
+    auto slot = publishedFileSlot(table, i);
+    if (slot && slot->image) munmap(slot->image, slot->imageSize);
+  }
+  for (int i = 0; i < FILE_TABLE_SEGMENTS; ++i) {
+    if (table->segments[i]) munmap(table->segments[i], fileTableSegmentSize(i));
+    table->segments[i] = NULL;
+  }
+  table->reserved = 0;
+}
+
+uint32_t addFileEntry(FileTable *table, FileEntry entry) {
+  auto index = __atomic_fetch_add(&table->reserved, 1, __ATOMIC_RELAXED);
+
+  int segment = 0;
+  auto slot = fileTableSlot(table, index, &segment);
+  if (!slot) {
+    // Whoever wins the race installs the segment, others unmap their copy.
+    // Fresh anonymous pages are zeroed, so no slot looks published.
+    auto size = fileTableSegmentSize(segment);
+    auto memory = (FileTableSlot *) mmap(NULL, size, PROT_READ|PROT_WRITE,
+        MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+      fprintf(stderr, "%s:%d Failed to mmap file table segment because: %s\n",
+        __FILE__, __LINE__, strerror(errno));
+      abort();
+    }
+
+    FileTableSlot *expected = NULL;
+    if (!__atomic_compare_exchange_n(&table->segments[segment], &expected, memory,
+          false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      munmap(memory, size);
+    }
+    slot = fileTableSlot(table, index, &segment);
+  }
+
+  entry.index = index;
+  slot->entry = entry;
+  __atomic_store_n(&slot->published, true, __ATOMIC_RELEASE);
+
+  return index;
+}
+
+FileTableSlot *fileSlotAt(FileTable *table, uint32_t index) {
+  int segment = 0;
+  auto slot = fileTableSlot(table, index, &segment);
+  assert(slot);
+  assert(__atomic_load_n(&slot->published, __ATOMIC_ACQUIRE));
+  return slot;
+}
+
+FileEntry *fileEntryAt(FileTable *table, uint32_t index) {
+  return &fileSlotAt(table, index)->entry;
+}
+
+FileTableSlot *publishedFileSlot(FileTable *table, uint32_t index) {
+  int segment = 0;
+  auto slot = fileTableSlot(table, index, &segment);
+  if (!slot || !__atomic_load_n(&slot->published, __ATOMIC_ACQUIRE)) return NULL;
+  return slot;
+}
+
+void releaseFileRegion(FileTable *table, uint32_t index) {
+  auto slot = fileSlotAt(table, index);
+  slot->ast = NULL;
+  slot->entry.content = {};
+  releaseAllocator(&slot->region);
+  if (slot->image) munmap(slot->image, slot->imageSize);
+  slot->image = NULL;
+}
 
-  return result;
+uint32_t filesCount(FileTable *table) {
+  return __atomic_load_n(&table->reserved, __ATOMIC_ACQUIRE);
 }
@@ -8,6 +8,7 @@
 #include "utils/allocator.h"
 #include "utils/string.h"
 #include "utils/array.h"
+#include "utils/fiber.h"
 
 struct FileEntry {
   Str absolutePath;
@@ -16,23 +17,149 @@ struct FileEntry {
   uint32_t index;
 };
 
+struct CompilerJob;
+// One-shot event jobs can suspend on (see waitForJobEvent),
+// zero initialized event is valid and not signaled
+struct JobEvent {
+  bool signaled;
+  bool locked;
+  CompilerJob *waiters;
+};
+
+// Identifies file regardless of path used to reach it (symlinks, hardlinks)
+struct FileIdentity {
+  uint64_t device;
+  uint64_t inode;
+};
+
+struct ASTFile;
+struct FileTableSlot {
+  FileEntry entry;
+  bool published;
+
+  ASTFile *ast; // NULL if file failed to parse
+  JobEvent parsedEvent;
+
+  // Source, AST and everything else which lives as long as the file
+  Allocator region;
+  // Source and AST mapped from the parse cache, used instead of region
+  void *image;
+  size_t imageSize;
+
+  // File on disk as it was read, later compilations reuse the slot while
+  // modification time matches (see startCompilation)
+  FileIdentity identity;
+  int64_t mtimeSec;
+  int64_t mtimeNsec;
+  uint64_t size; // of content, which is gone once region is released
+  // Watch mode saw no change since the file was read (see FileWatcher),
+  // reuse doesn't have to check the disk
+  bool watched;
+  // Last compilation which loaded or reused the file, older slots are
+  // previous versions or files no longer loaded
+  uint32_t compilation;
+};
+
+// Append-only table of files. Segment k holds FILE_TABLE_FIRST_SEGMENT_SIZE << k
+// entries and is never moved once allocated, so readers don't need any locks
+// and an index handed out by addFileEntry stays valid forever.
+const int FILE_TABLE_FIRST_SEGMENT_BITS = 6;
+const uint32_t FILE_TABLE_FIRST_SEGMENT_SIZE = 1u << FILE_TABLE_FIRST_SEGMENT_BITS;
+const int FILE_TABLE_SEGMENTS = 32 - FILE_TABLE_FIRST_SEGMENT_BITS;
+struct FileTable {
+  FileTableSlot *segments[FILE_TABLE_SEGMENTS];
+  uint32_t reserved;
+};
+
+void deinitFileTable(FileTable *table);
+// Sets entry.index and returns it
+uint32_t addFileEntry(FileTable *table, FileEntry entry);
+FileEntry *fileEntryAt(FileTable *table, uint32_t index);
+FileTableSlot *fileSlotAt(FileTable *table, uint32_t index);
+// NULL while addFileEntry which reserved the slot didn't publish it yet
+FileTableSlot *publishedFileSlot(FileTable *table, uint32_t index);
+// Gives memory of the file back once nothing refers to its source or AST,
+// content of the entry is cleared
+void releaseFileRegion(FileTable *table, uint32_t index);
+// Reserved slots, loops over them skip unpublished ones (publishedFileSlot)
+uint32_t filesCount(FileTable *table);
+
+const uint32_t FILE_INDEX_NONE = UINT32_MAX;
+
+struct FileIdentitySlot {
+  FileIdentity identity;
+  bool used;
+  uint32_t compilation; // last compilation which visited the file
+  uint32_t fileIndex; // slot of the file table it was loaded into
+};
+
+struct FileIdentitySetShard {
+  pthread_mutex_t mutex;
+  FileIdentitySlot *slots;
+  uint32_t len;
+  uint32_t cap;
+};
+
+// Sharded hash set, threads inserting different files rarely touch same lock
+const int FILE_IDENTITY_SET_SHARDS = 64;
+struct FileIdentitySet {
+  FileIdentitySetShard shards[FILE_IDENTITY_SET_SHARDS];
+  // Identities are kept across compilations of a long running compiler,
+  // visits are counted per compilation (see startCompilation)
+  uint32_t compilation;
+};
+
+void initFileIdentitySet(FileIdentitySet *set);
+void deinitFileIdentitySet(FileIdentitySet *set);
+// Returns true if identity was not visited in current compilation yet.
+// File loaded for it by earlier compilations (or FILE_INDEX_NONE) is stored
+// to previousIndex.
+bool insertFileIdentity(FileIdentitySet *set, FileIdentity identity, Allocator *a,
+                        uint32_t *previousIndex = NULL);
+// Remembers where file was loaded, doesn't count as a visit
+void setFileIdentityIndex(FileIdentitySet *set, FileIdentity identity, uint32_t index,
+                          Allocator *a);
+
 struct Compiler;
 struct GlobalData {
   Compiler *compiler;
 
-  Array<FileEntry> files;
-  pthread_mutex_t filesMutex;
+  FileTable files;
+
+  FileIdentitySet loadedFiles;
+
+  // Set on first error (unless compiler keeps going), polled by jobs and
+  // parser so in-flight work stops early
+  bool cancelled;
 
   char currentWorkingDirectory[PATH_MAX + 1];//4KB + 1
 };
 
 void initGlobalData(GlobalData *globalData);
+void deinitGlobalData(GlobalData *globalData);
 
 FileEntry file(GlobalData *globalData, int fileIndex);
 
-struct ThreadData {
+void cancelCompilation(GlobalData *globalData);
+bool compilationCancelled(GlobalData *globalData);
+
+struct JobFiber;
+// Aligned, so neighbouring workers in an array don't false share cache lines
+struct alignas(64) ThreadData {
   GlobalData *globalData;
   Allocator allocator;
+  // Temporary memory, use with getScratch and AllocatorCheckpoint
+  Allocator scratch[2];
+
+  FiberContext schedulerContext;
+  JobFiber *currentFiber;
 };
 
-void initThreadData(ThreadData *td, GlobalData *globalData, void *memory, size_t size);
+// Thread allocator grows by taking blocks from shared reservoir
+void initThreadData(ThreadData *td, GlobalData *globalData, Allocator *reservoir);
+
+// Returns scratch allocator which is not `conflict`, so function building
+// its result in a scratch allocator of the caller can still have temporaries.
+// Scratch memory should not be kept across waitForJobEvent, job may resume
+// on another thread.
+Allocator *getScratch(ThreadData *td, Allocator *conflict = NULL);
@@ -0,0 +1,388 @@
+#include "file_loader.h"
+#include "compiler.h"
+#include "utils/trace.h"
+
+#include <stdio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+// Operation is kept in the low bits of sqe/cqe user_data,
+// requests are at least 8 bytes aligned
+enum FileLoadOp {
+  FILE_LOAD_OP_WAKEUP,
+  FILE_LOAD_OP_OPEN,
+  FILE_LOAD_OP_STATX,
+  FILE_LOAD_OP_READ,
+  FILE_LOAD_OP_CLOSE,
+};
+const uint64_t FILE_LOAD_OP_MASK = 7;
+
+void *fileLoaderThreadProc(void *arg);
+
+void initFileLoader(FileLoader *loader, Compiler *compiler, bool allowIOUring) {
+  *loader = {};
+  loader->compiler = compiler;
+  loader->eventFd = -1;
+  pthread_mutex_init(&loader->mutex, NULL);
+
+  if (!allowIOUring) return;
+  if (!initIOUring(&loader->ring, 64)) return;
+
+  int requiredOps[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE};
+  for (int i = 0; i < sizeof(requiredOps) / sizeof(requiredOps[0]); ++i) {
+    if (!supportsOpcode(&loader->ring, requiredOps[i])) {
+      deinitIOUring(&loader->ring);
+      return;
+    }
+  }
+
+  loader->eventFd = eventfd(0, EFD_CLOEXEC);
+  if (loader->eventFd < 0) {
+    deinitIOUring(&loader->ring);
+    return;
+  }
+
+  loader->useIOUring = true;
+  loader->shouldContinue = true;
+  // Each request has at most 2 operations in flight (open + statx),
+  // one more slot is taken by eventfd read
+  loader->maxInFlight = (loader->ring.sqEntries - 1) / 2;
+
+  auto error = pthread_create(&loader->thread, NULL, fileLoaderThreadProc, loader);
+  if (error) {
+    fprintf(stderr, "%s:%d pthread_create failed: %s\n",
+      __FILE__, __LINE__, strerror(error));
+    abort();
+  }
+}
+
+void deinitFileLoader(FileLoader *loader) {
+  if (loader->useIOUring) {
+    pthread_mutex_lock(&loader->mutex);
+    loader->shouldContinue = false;
+    pthread_mutex_unlock(&loader->mutex);
+
+    uint64_t one = 1;
+    write(loader->eventFd, &one, sizeof(one));
+    pthread_join(loader->thread, NULL);
+
+    close(loader->eventFd);
+    deinitIOUring(&loader->ring);
+  }
+  pthread_mutex_destroy(&loader->mutex);
+}
+
+void allocFileBuffer(FileLoader *loader, FileLoadRequest *req) {
+  // First block also fits AST of a typical file
+  initGrowableAllocator(&req->region, &loader->compiler->mainAllocator,
+                        (req->size + 1) * 4 + 16 * 1024, ALLOCATOR_FLAG_RELEASABLE);
+  req->buffer = ALLOC_ARRAY(char, req->size + 1, &req->region);
+}
+
+void finishFileLoad(FileLoader *loader, FileLoadRequest *req) {
+  TRACE_SCOPE("finish file load", req->relativePath);
+  auto compiler = loader->compiler;
+  auto readJob = req->job;
+
+  if (req->error) {
+    fprintf(compiler->diagnostics, "%.*s| error Failed to read file: %s\n",
+      (int)req->relativePath.len, req->relativePath.data,
+      strerror(req->error));
+    failJob(compiler, readJob, 1);
+    releaseAllocator(&req->region);
+    releasePreviousVersion(&compiler->globalData, readJob->previousFileIndex);
+  } else if (compilationCancelled(&compiler->globalData)) {
+    releaseAllocator(&req->region);
+    releasePreviousVersion(&compiler->globalData, readJob->previousFileIndex);
+  } else {
+    req->buffer[req->bytesRead] = '\0';
+
+    // Paths live as long as the slot, thread allocators are rewound after
+    // every compilation. Reloaded file keeps path of its previous version.
+    FileEntry entry = {};
+    auto previousIndex = readJob->previousFileIndex;
+    if (previousIndex != FILE_INDEX_NONE &&
+        fileEntryAt(&compiler->globalData.files, previousIndex)->absolutePath.data == req->absolutePath.data) {
+      entry.absolutePath = req->absolutePath;
+    } else {
+      entry.absolutePath = SPrintf(&compiler->mainAllocator, "%.*s",
+                                   (int)req->absolutePath.len, req->absolutePath.data);
+    }
+    entry.relativePath = Str{entry.absolutePath.data + entry.absolutePath.len - req->relativePath.len,
+                             req->relativePath.len};
+    entry.content = Str{req->buffer, req->bytesRead};
+    entry.index = addFileEntry(&compiler->globalData.files, entry);
+    auto slot = fileSlotAt(&compiler->globalData.files, entry.index);
+    slot->region = req->region;
+    slot->identity = req->identity;
+    slot->mtimeSec = req->mtimeSec;
+    slot->mtimeNsec = req->mtimeNsec;
+    slot->size = req->bytesRead;
+    slot->compilation = compiler->globalData.loadedFiles.compilation;
+    setFileIdentityIndex(&compiler->globalData.loadedFiles, req->identity, entry.index,
+                         &compiler->mainAllocator);
+
+    auto job = allocOrReuseCompilerJob(compiler);
+    job->type = COMPILER_JOB_TYPE_PARSE;
+    job->fileEntry = entry;
+    job->previousFileIndex = readJob->previousFileIndex;
+    job->priority = entry.content.len;
+    spawnChildJob(compiler, readJob, job);
+  }
+
+  pthread_mutex_lock(&loader->mutex);
+  req->next = loader->freelistNext;
+  loader->freelistNext = req;
+  pthread_mutex_unlock(&loader->mutex);
+
+  finishJob(compiler, readJob);
+}
+
+void loadFileBlocking(FileLoader *loader, FileLoadRequest *req) {
+  TRACE_SCOPE("read file blocking", req->relativePath);
+  req->fd = open(req->absolutePath.data, O_RDONLY|O_CLOEXEC);
+  if (req->fd < 0) {
+    req->error = errno;
+    finishFileLoad(loader, req);
+    return;
+  }
+
+  struct stat st = {};
+  if (fstat(req->fd, &st) != 0) {
+    req->error = errno;
+    close(req->fd);
+    finishFileLoad(loader, req);
+    return;
+  }
+
+  req->size = st.st_size;
+  req->mtimeSec = st.st_mtim.tv_sec;
+  req->mtimeNsec = st.st_mtim.tv_nsec;
+  allocFileBuffer(loader, req);
+
+  while (req->bytesRead < req->size) {
+    auto n = read(req->fd, req->buffer + req->bytesRead, req->size - req->bytesRead);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      req->error = errno;
+      break;
+    }
+    if (n == 0) break;
+    req->bytesRead += n;
+  }
+
+  close(req->fd);
+  finishFileLoad(loader, req);
+}
+
+void loadFile(FileLoader *loader, ThreadData *td, CompilerJob *job, Str fileName) {
+  auto cwd = td->globalData->currentWorkingDirectory;
+
+  // Canonical paths are NUL terminated already
+  Str absolutePath = {};
+  if (fileName.len && fileName.data[0] == '/') {
+    absolutePath = fileName;
+  } else {
+    absolutePath = SPrintf(&td->allocator, "%s/%.*s", cwd, (int)fileName.len, fileName.data);
+  }
+
+  auto relativePath = pathRelativeTo(cwd, absolutePath);
+
+  pthread_mutex_lock(&loader->mutex);
+  auto req = loader->freelistNext;
+  if (req) loader->freelistNext = req->next;
+  pthread_mutex_unlock(&loader->mutex);
+
+  if (!req) req = ALLOC(FileLoadRequest, &loader->compiler->mainAllocator);
+
+  *req = {};
+  retainJob(job);
+  req->job = job;
+  req->fd = -1;
+  req->absolutePath = absolutePath;
+  req->relativePath = relativePath;
+  req->identity = job->fileIdentity;
+
+  if (!loader->useIOUring) {
+    loadFileBlocking(loader, req);
+    return;
+  }
+
+  pthread_mutex_lock(&loader->mutex);
+  if (loader->pendingTail) {
+    loader->pendingTail->next = req;
+  } else {
+    loader->pendingHead = req;
+  }
+  loader->pendingTail = req;
+  pthread_mutex_unlock(&loader->mutex);
+
+  uint64_t one = 1;
+  write(loader->eventFd, &one, sizeof(one));
+}
+
+// All prepare functions rely on maxInFlight limit to always have a free sqe
+
+void prepareWakeup(FileLoader *loader) {
+  auto sqe = getSQE(&loader->ring);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = loader->eventFd;
+  sqe->addr = (uint64_t) &loader->eventValue;
+  sqe->len = sizeof(loader->eventValue);
+  sqe->user_data = FILE_LOAD_OP_WAKEUP;
+}
+
+void prepareOpen(FileLoader *loader, FileLoadRequest *req) {
+  auto sqe = getSQE(&loader->ring);
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uint64_t) req->absolutePath.data;
+  sqe->open_flags = O_RDONLY|O_CLOEXEC;
+  sqe->user_data = (uint64_t) req | FILE_LOAD_OP_OPEN;
+}
+
+void prepareStatx(FileLoader *loader, FileLoadRequest *req) {
+  auto sqe = getSQE(&loader->ring);
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uint64_t) req->absolutePath.data;
+  sqe->len = STATX_SIZE|STATX_MTIME;
+  sqe->off = (uint64_t) &req->stx;
+  sqe->user_data = (uint64_t) req | FILE_LOAD_OP_STATX;
+}
+
+void prepareRead(FileLoader *loader, FileLoadRequest *req) {
+  auto sqe = getSQE(&loader->ring);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = req->fd;
+  sqe->addr = (uint64_t) (req->buffer + req->bytesRead);
+  sqe->len = req->size - req->bytesRead;
+  sqe->off = req->bytesRead;
+  sqe->user_data = (uint64_t) req | FILE_LOAD_OP_READ;
+}
+
+// Closes file if it was opened, request is finished on close completion
+void prepareCloseOrFinish(FileLoader *loader, FileLoadRequest *req) {
+  if (req->fd < 0) {
+    loader->inFlight--;
+    finishFileLoad(loader, req);
+    return;
+  }
+  auto sqe = getSQE(&loader->ring);
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = req->fd;
+  sqe->user_data = (uint64_t) req | FILE_LOAD_OP_CLOSE;
+}
+
+void admitPendingFileLoads(FileLoader *loader) {
+  pthread_mutex_lock(&loader->mutex);
+  while (loader->pendingHead && loader->inFlight < loader->maxInFlight) {
+    auto req = loader->pendingHead;
+    loader->pendingHead = req->next;
+    if (!loader->pendingHead) loader->pendingTail = NULL;
+    req->next = NULL;
+
+    // open and statx are independent and go to kernel in the same batch
+    req->pendingOps = 2;
+    prepareOpen(loader, req);
+    prepareStatx(loader, req);
+    loader->inFlight++;
+  }
+  pthread_mutex_unlock(&loader->mutex);
+}
+
+void handleFileLoadCompletion(FileLoader *loader, FileLoadRequest *req, FileLoadOp op, int res) {
+  switch (op) {
+  case FILE_LOAD_OP_OPEN:
+  case FILE_LOAD_OP_STATX: {
+    if (res < 0) {
+      if (!req->error) req->error = -res;
+    } else if (op == FILE_LOAD_OP_OPEN) {
+      req->fd = res;
+    } else {
+      req->size = req->stx.stx_size;
+      req->mtimeSec = req->stx.stx_mtime.tv_sec;
+      req->mtimeNsec = req->stx.stx_mtime.tv_nsec;
+    }
+
+    req->pendingOps--;
+    if (req->pendingOps) break;
+
+    if (req->error) {
+      prepareCloseOrFinish(loader, req);
+      break;
+    }
+
+    allocFileBuffer(loader, req);
+    if (req->size == 0) {
+      prepareCloseOrFinish(loader, req);
+    } else {
+      prepareRead(loader, req);
+    }
+  } break;
+  case FILE_LOAD_OP_READ: {
+    if (res < 0) {
+      req->error = -res;
+      prepareCloseOrFinish(loader, req);
+      break;
+    }
+    req->bytesRead += res;
+    if (res > 0 && req->bytesRead < req->size) {
+      prepareRead(loader, req);
+    } else {
+      prepareCloseOrFinish(loader, req);
+    }
+  } break;
+  case FILE_LOAD_OP_CLOSE: {
+    loader->inFlight--;
+    finishFileLoad(loader, req);
+  } break;
+  default: abort();
+  }
+}
+
+void *fileLoaderThreadProc(void *arg) {
+  auto loader = static_cast<FileLoader *>(arg);
+  auto ring = &loader->ring;
+
+  nameTraceThread("file loader");
+  prepareWakeup(loader);
+
+  for (bool shouldContinue = true; shouldContinue;) {
+    int result = 0;
+    {
+      TRACE_SCOPE("wait for io");
+      result = submitAndWait(ring, 1);
+    }
+    if (result < 0) {
+      fprintf(stderr, "%s:%d io_uring_enter failed: %s\n",
+        __FILE__, __LINE__, strerror(errno));
+      abort();
+    }
+
+    for (io_uring_cqe *cqe; (cqe = peekCQE(ring)); ) {
+      auto userData = cqe->user_data;
+      auto res = cqe->res;
+      seenCQE(ring);
+
+      auto op = static_cast<FileLoadOp>(userData & FILE_LOAD_OP_MASK);
+      if (op == FILE_LOAD_OP_WAKEUP) {
+        pthread_mutex_lock(&loader->mutex);
+        shouldContinue = loader->shouldContinue;
+        pthread_mutex_unlock(&loader->mutex);
+        prepareWakeup(loader);
+        continue;
+      }
+
+      auto req = (FileLoadRequest *)(userData & ~FILE_LOAD_OP_MASK);
+      handleFileLoadCompletion(loader, req, op, res);
+    }
+
+    admitPendingFileLoads(loader);
+  }
+
+  return NULL;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include "core_types.h"
+#include "utils/iouring.h"
+
+struct CompilerJob;
+struct FileLoadRequest {
+  CompilerJob *job; // retained until PARSE job is spawned
+  Str absolutePath; // NUL terminated
+  Str relativePath;
+
+  int fd;
+  int pendingOps;
+  int error;
+  struct statx stx;
+  FileIdentity identity;
+  int64_t mtimeSec;
+  int64_t mtimeNsec;
+
+  Allocator region; // becomes region of the file, buffer is allocated in it
+  char *buffer;
+  size_t size;
+  size_t bytesRead;
+
+  FileLoadRequest *next;
+};
+
+// Reads source files for the compiler. When io_uring is available a dedicated
+// thread submits opens/stats/reads in batches and turns completed reads into
+// PARSE jobs; otherwise the worker which asked for the file reads it with
+// blocking syscalls.
+struct FileLoader {
+  Compiler *compiler;
+
+  bool useIOUring;
+  IOUring ring;
+  pthread_t thread;
+  int eventFd;
+  uint64_t eventValue;
+  int inFlight;
+  int maxInFlight;
+
+  pthread_mutex_t mutex;
+  FileLoadRequest *pendingHead;
+  FileLoadRequest *pendingTail;
+  FileLoadRequest *freelistNext;
+  bool shouldContinue;
+};
+
+void initFileLoader(FileLoader *loader, Compiler *compiler, bool allowIOUring);
+void deinitFileLoader(FileLoader *loader);
+void loadFile(FileLoader *loader, ThreadData *td, CompilerJob *job, Str fileName);
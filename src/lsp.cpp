@@ -0,0 +1,654 @@
+#include "lsp.h"
+
+#include <stdlib.h>
+#include <strings.h>
+
+#include "utils/json.h"
+
+const size_t LSP_MAX_MESSAGE_SIZE = 256 * 1024 * 1024;
+
+enum LSPErrorCode {
+  LSP_ERROR_PARSE = -32700,
+  LSP_ERROR_INVALID_REQUEST = -32600,
+  LSP_ERROR_METHOD_NOT_FOUND = -32601,
+};
+
+enum LSPSymbolKind {
+  LSP_SYMBOL_FIELD = 8,
+  LSP_SYMBOL_FUNCTION = 12,
+  LSP_SYMBOL_VARIABLE = 13,
+  LSP_SYMBOL_CONSTANT = 14,
+  LSP_SYMBOL_STRUCT = 23,
+};
+
+// Messages
+
+// Returns false at end of input
+bool readLSPMessage(LSPServer *server, Str *body, Allocator *a) {
+  size_t length = 0;
+  bool haveLength = false;
+  char line[256];
+  for (;;) {
+    if (!fgets(line, sizeof(line), server->in)) return false;
+    if (strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0) {
+      if (haveLength) break;
+      continue;
+    }
+    if (strncasecmp(line, "Content-Length:", 15) == 0) {
+      length = strtoull(line + 15, NULL, 10);
+      haveLength = true;
+    }
+  }
+  if (length > LSP_MAX_MESSAGE_SIZE) return false;
+
+  body->data = ALLOC_ARRAY(char, length + 1, a);
+  body->len = length;
+  return fread(body->data, 1, length, server->in) == length;
+}
+
+// Message is built in memory, its length goes first
+struct LSPMessage {
+  FILE *out;
+  char *buffer;
+  size_t size;
+};
+
+void beginLSPMessage(LSPMessage *message) {
+  *message = {};
+  message->out = open_memstream(&message->buffer, &message->size);
+  if (!message->out) {
+    fprintf(stderr, "%s:%d open_memstream failed\n", __FILE__, __LINE__);
+    abort();
+  }
+  fputs("{\"jsonrpc\":\"2.0\",", message->out);
+}
+
+void endLSPMessage(LSPServer *server, LSPMessage *message) {
+  fputc('}', message->out);
+  fclose(message->out);
+  fprintf(server->out, "Content-Length: %zu\r\n\r\n", message->size);
+  fwrite(message->buffer, 1, message->size, server->out);
+  fflush(server->out);
+  free(message->buffer);
+}
+
+void sendLSPError(LSPServer *server, JsonValue *id, int code, const char *text) {
+  LSPMessage message;
+  beginLSPMessage(&message);
+  fputs("\"id\":", message.out);
+  writeJson(message.out, id);
+  fprintf(message.out, ",\"error\":{\"code\":%d,\"message\":", code);
+  writeJsonString(message.out, CStringToStr(text));
+  fputc('}', message.out);
+  endLSPMessage(server, &message);
+}
+
+// Positions are lines and UTF-16 code units, as the protocol requires by
+// default
+
+bool isUTF8Continuation(char c) {
+  return ((unsigned char)c & 0xC0) == 0x80;
+}
+
+Array<uint32_t> lineStartsOf(Str content, Allocator *a) {
+  Array<uint32_t> starts = {};
+  append(&starts, 0u, a);
+  for (auto it = content.data, end = content.data + content.len;
+       (it = (char *)memchr(it, '\n', end - it)); ++it) {
+    append(&starts, (uint32_t)(it - content.data + 1), a);
+  }
+  return starts;
+}
+
+void ensureLineStarts(LSPDocument *doc, Allocator *scratch) {
+  if (doc->lineStarts.len) return;
+  AllocatorCheckpoint checkpoint(scratch);
+  doc->lineStarts = copyArray(lineStartsOf(doc->content, scratch), &doc->region);
+}
+
+uint32_t offsetInLines(Str content, Array<uint32_t> lineStarts, uint32_t line, uint32_t character) {
+  if (line >= lineStarts.len) return content.len;
+  uint32_t offset = lineStarts.data[line];
+  for (uint32_t units = 0; units < character && offset < content.len && content.data[offset] != '\n';) {
+    auto lead = (unsigned char)content.data[offset++];
+    while (offset < content.len && isUTF8Continuation(content.data[offset])) offset++;
+    units += lead >= 0xF0 ? 2 : 1;
+  }
+  return offset;
+}
+
+uint32_t offsetAtPosition(LSPDocument *doc, uint32_t line, uint32_t character, Allocator *scratch) {
+  ensureLineStarts(doc, scratch);
+  return offsetInLines(doc->content, doc->lineStarts, line, character);
+}
+
+uint32_t lineAtOffset(LSPDocument *doc, uint32_t offset, Allocator *scratch) {
+  ensureLineStarts(doc, scratch);
+  uint32_t lo = 0, hi = doc->lineStarts.len;
+  while (lo + 1 < hi) {
+    auto mid = lo + (hi - lo) / 2;
+    if (doc->lineStarts.data[mid] <= offset) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+void writePosition(FILE *out, LSPDocument *doc, uint32_t offset, Allocator *scratch) {
+  if (offset > doc->content.len) offset = doc->content.len;
+  auto line = lineAtOffset(doc, offset, scratch);
+  uint32_t character = 0;
+  for (uint32_t i = doc->lineStarts.data[line]; i < offset; ++i) {
+    auto c = (unsigned char)doc->content.data[i];
+    if (!isUTF8Continuation(c)) character += c >= 0xF0 ? 2 : 1;
+  }
+  fprintf(out, "{\"line\":%u,\"character\":%u}", line, character);
+}
+
+void writeRange(FILE *out, LSPDocument *doc, uint32_t offset0, uint32_t offset1, Allocator *scratch) {
+  fputs("{\"start\":", out);
+  writePosition(out, doc, offset0, scratch);
+  fputs(",\"end\":", out);
+  writePosition(out, doc, offset1, scratch);
+  fputc('}', out);
+}
+
+// Documents
+
+Str pathFromURI(Str uri, Allocator *a) {
+  auto prefix = STR("file://");
+  if (uri.len < prefix.len || memcmp(uri.data, prefix.data, prefix.len) != 0) return {};
+  Str result = {ALLOC_ARRAY(char, uri.len - prefix.len + 1, a), 0};
+  for (size_t i = prefix.len; i < uri.len; ++i) {
+    if (uri.data[i] == '%' && i + 2 < uri.len && hexDigitValue(uri.data[i + 1]) >= 0 &&
+        hexDigitValue(uri.data[i + 2]) >= 0) {
+      result.data[result.len++] = hexDigitValue(uri.data[i + 1]) * 16 + hexDigitValue(uri.data[i + 2]);
+      i += 2;
+    } else {
+      result.data[result.len++] = uri.data[i];
+    }
+  }
+  result.data[result.len] = '\0';
+  return result;
+}
+
+Str uriFromPath(Str path, Allocator *a) {
+  auto prefix = STR("file://");
+  Str result = {ALLOC_ARRAY(char, prefix.len + 3 * path.len, a), prefix.len};
+  memcpy(result.data, prefix.data, prefix.len);
+  for (size_t i = 0; i < path.len; ++i) {
+    auto c = (unsigned char)path.data[i];
+    if (('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || ('0' <= c && c <= '9') ||
+        strchr("-._~/", c)) {
+      result.data[result.len++] = c;
+    } else {
+      result.len += sprintf(result.data + result.len, "%%%02X", c);
+    }
+  }
+  return result;
+}
+
+void initDocumentRegion(LSPServer *server, LSPDocument *doc) {
+  doc->region = {};
+  initGrowableAllocator(&doc->region, &server->memory, 64 * 1024, ALLOCATOR_FLAG_RELEASABLE);
+}
+
+LSPDocument *addDocument(LSPServer *server, Str uri, uint32_t file) {
+  auto a = &server->td.allocator;
+  auto doc = ALLOC(LSPDocument, a);
+  *doc = {};
+  doc->uri = StrDup(uri, a);
+  doc->file = file;
+  initDocumentRegion(server, doc);
+  append(&server->documents, doc, a);
+  return doc;
+}
+
+LSPDocument *findDocument(LSPServer *server, Str uri) {
+  for (uint32_t i = 0; i < server->documents.len; ++i) {
+    auto doc = server->documents.data[i];
+    if (StrEqual(doc->uri, uri)) return doc;
+  }
+  return NULL;
+}
+
+LSPDocument *documentForFile(LSPServer *server, uint32_t file, Allocator *scratch) {
+  for (uint32_t i = 0; i < server->documents.len; ++i) {
+    auto doc = server->documents.data[i];
+    if (doc->file == file) return doc;
+  }
+  AllocatorCheckpoint checkpoint(scratch);
+  return addDocument(server, uriFromPath(queryFilePath(&server->queries, file), scratch), file);
+}
+
+// Takes current version from the query engine (parsing it if it changed),
+// caches built for an older one are dropped
+void syncDocument(LSPServer *server, LSPDocument *doc) {
+  auto td = &server->td;
+  auto memo = fetchQuery(&td, &server->queries, NULL, QueryKey{QUERY_PARSED_FILE, doc->file, {}});
+  doc->parsed = &memo->parsed;
+  doc->content = memo->parsed.content;
+  if (memo->changedAt == doc->changedAt) return;
+
+  doc->changedAt = memo->changedAt;
+  releaseAllocator(&doc->region);
+  initDocumentRegion(server, doc);
+  doc->lineStarts = {};
+  doc->indexValid = false;
+}
+
+void ensureIndex(LSPDocument *doc, Allocator *scratch) {
+  if (doc->indexValid || !doc->parsed->ast) return;
+  buildASTIndex(&doc->index, doc->parsed->ast, &doc->region, scratch);
+  doc->indexValid = true;
+}
+
+// Name resolution
+
+struct LSPDeclaration {
+  LSPDocument *doc;
+  AST *decl;
+  ASTIdentifier *name;
+};
+
+// Identifier of `name` if decl declares it
+ASTIdentifier *declaredName(AST *decl, Str name) {
+  ASTIdentifier *candidate = NULL;
+  switch (decl->type) {
+  case ASTConst_: candidate = static_cast<ASTConst *>(decl)->name; break;
+  case ASTStruct_: candidate = static_cast<ASTStruct *>(decl)->name; break;
+  case ASTFunction_: candidate = static_cast<ASTFunction *>(decl)->name; break;
+  case ASTVar_: candidate = static_cast<ASTVar *>(decl)->name; break;
+  case ASTVariableDefinition_: {
+    auto names = static_cast<ASTVariableDefinition *>(decl)->names;
+    for (uint32_t i = 0; i < names.len; ++i) {
+      if (StrEqual(names.data[i]->name, name)) return names.data[i];
+    }
+  } break;
+  default: break;
+  }
+  return candidate && StrEqual(candidate->name, name) ? candidate : NULL;
+}
+
+// Variables are visible after their definition, other declarations in the
+// whole scope
+bool findDeclarationIn(Array<AST *> decls, Str name, uint32_t usedAt, LSPDeclaration *result) {
+  for (uint32_t i = 0; i < decls.len; ++i) {
+    auto decl = decls.data[i];
+    if (decl->type == ASTVariableDefinition_ && decl->offset0 > usedAt) continue;
+    if (auto ident = declaredName(decl, name)) {
+      result->decl = decl;
+      result->name = ident;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool findArgument(Array<ASTVar *> args, Str name, LSPDeclaration *result) {
+  for (uint32_t i = 0; i < args.len; ++i) {
+    if (auto ident = declaredName(args.data[i], name)) {
+      result->decl = args.data[i];
+      result->name = ident;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Top level of the file and of files it loads
+bool findTopLevelDeclaration(LSPServer *server, LSPDocument *doc, Str name, Allocator *scratch,
+                             LSPDeclaration *result) {
+  auto td = &server->td;
+  auto resolution = queryResolve(&td, &server->queries, NULL, doc->file, name);
+  if (resolution.file == FILE_INDEX_NONE) return false;
+
+  auto decls = queryDeclsOf(&td, &server->queries, NULL, resolution.file);
+  auto declDoc = documentForFile(server, resolution.file, scratch);
+  syncDocument(server, declDoc);
+  auto decl = declDoc->parsed->ast->topLevelDecls[decls->decls.data[resolution.decl].index];
+  result->doc = declDoc;
+  result->decl = decl;
+  result->name = declaredName(decl, name);
+  return result->name != NULL;
+}
+
+bool resolveIdentifier(LSPServer *server, LSPDocument *doc, uint32_t nodeIndex,
+                       Allocator *scratch, LSPDeclaration *result) {
+  auto nodes = doc->index.nodes.data;
+  auto ident = AST_CAST(ASTIdentifier, nodes[nodeIndex].node);
+  if (!ident) return false;
+  *result = {doc, NULL, NULL};
+
+  auto parentIndex = nodes[nodeIndex].parent;
+  auto parent = parentIndex != AST_INDEX_NONE ? nodes[parentIndex].node : NULL;
+  // Field depends on the type of accessed struct, which is not known here
+  if (!parent) return false;
+  if (auto access = AST_CAST(ASTMemberAccess, parent)) {
+    if (access->field == ident) return false;
+  }
+  if (declaredName(parent, ident->name) == ident) {
+    result->decl = parent;
+    result->name = ident;
+    return true;
+  }
+
+  for (auto i = parentIndex; i != AST_INDEX_NONE; i = nodes[i].parent) {
+    auto scope = nodes[i].node;
+    if (auto block = AST_CAST(ASTBlock, scope)) {
+      if (findDeclarationIn(block->statements, ident->name, ident->offset0, result)) return true;
+    } else if (auto function = AST_CAST(ASTFunction, scope)) {
+      if (findArgument(function->args, ident->name, result) ||
+          findArgument(function->returns, ident->name, result)) {
+        return true;
+      }
+    } else if (scope->type == ASTFile_) {
+      return findTopLevelDeclaration(server, doc, ident->name, scratch, result);
+    }
+  }
+  return false;
+}
+
+// Requests
+
+// Document of the request, synced
+LSPDocument *documentOfParams(LSPServer *server, JsonValue *params) {
+  auto uri = jsonString(jsonGet(jsonGet(params, "textDocument"), "uri"));
+  auto doc = uri.len ? findDocument(server, uri) : NULL;
+  if (doc) syncDocument(server, doc);
+  return doc;
+}
+
+uint32_t offsetOfParams(LSPDocument *doc, JsonValue *params, Allocator *scratch) {
+  auto position = jsonGet(params, "position");
+  return offsetAtPosition(doc, jsonNumber(jsonGet(position, "line"), 0),
+                          jsonNumber(jsonGet(position, "character"), 0), scratch);
+}
+
+// Identifier at the position of params and its declaration
+bool resolvePositionOfParams(LSPServer *server, JsonValue *params, Allocator *scratch,
+                             LSPDocument **doc, LSPDeclaration *result) {
+  // Files which are not open may have changed on disk
+  refreshQueryFiles(&server->queries);
+  *doc = documentOfParams(server, params);
+  if (!*doc || !(*doc)->parsed->ast) return false;
+  auto offset = offsetOfParams(*doc, params, scratch);
+  ensureIndex(*doc, scratch);
+  auto nodeIndex = innermostASTNodeAt(&(*doc)->index, offset);
+  return nodeIndex != AST_INDEX_NONE && resolveIdentifier(server, *doc, nodeIndex, scratch, result);
+}
+
+void publishDiagnostics(LSPServer *server, LSPDocument *doc, Allocator *scratch) {
+  LSPMessage message;
+  beginLSPMessage(&message);
+  fputs("\"method\":\"textDocument/publishDiagnostics\",\"params\":{\"uri\":", message.out);
+  writeJsonString(message.out, doc->uri);
+  fputs(",\"diagnostics\":[", message.out);
+  if (doc->open && !doc->parsed->ast) {
+    auto error = doc->parsed->error;
+    fputs("{\"range\":", message.out);
+    writeRange(message.out, doc, error.offset, error.offset, scratch);
+    fputs(",\"severity\":1,\"source\":\"c6\",\"message\":", message.out);
+    writeJsonString(message.out, error.message);
+    fputc('}', message.out);
+  }
+  fputs("]}", message.out);
+  endLSPMessage(server, &message);
+}
+
+void handleDidOpen(LSPServer *server, JsonValue *params, Allocator *scratch) {
+  auto textDocument = jsonGet(params, "textDocument");
+  auto uri = jsonString(jsonGet(textDocument, "uri"));
+  if (!uri.len) return;
+
+  auto doc = findDocument(server, uri);
+  if (!doc) {
+    // Other schemes are kept as they are, such documents can't be loaded
+    auto path = pathFromURI(uri, scratch);
+    doc = addDocument(server, uri, queryFileId(&server->queries, path.len ? path : uri));
+  }
+  doc->open = true;
+  setQueryFileContent(&server->queries, doc->file, jsonString(jsonGet(textDocument, "text")));
+  syncDocument(server, doc);
+  publishDiagnostics(server, doc, scratch);
+}
+
+void handleDidChange(LSPServer *server, JsonValue *params, Allocator *scratch) {
+  auto doc = documentOfParams(server, params);
+  auto changes = jsonGet(params, "contentChanges");
+  if (!doc || !doc->open || !changes || changes->type != JSON_ARRAY) return;
+
+  // Changes follow one another, each applies to the result of the previous.
+  // The result is parsed once, reusing declarations outside of the changes.
+  auto text = doc->content;
+  for (uint32_t i = 0; i < changes->items.len; ++i) {
+    auto change = changes->items.data[i];
+    auto range = jsonGet(change, "range");
+    if (!range) {
+      text = jsonString(jsonGet(change, "text"));
+      continue;
+    }
+    Array<uint32_t> lineStarts = {};
+    if (text.data == doc->content.data) {
+      ensureLineStarts(doc, scratch);
+      lineStarts = doc->lineStarts;
+    } else {
+      lineStarts = lineStartsOf(text, scratch);
+    }
+    auto start = jsonGet(range, "start"), end = jsonGet(range, "end");
+    SourceEdit edit = {};
+    edit.offset0 = offsetInLines(text, lineStarts, jsonNumber(jsonGet(start, "line"), 0),
+                                 jsonNumber(jsonGet(start, "character"), 0));
+    edit.offset1 = offsetInLines(text, lineStarts, jsonNumber(jsonGet(end, "line"), 0),
+                                 jsonNumber(jsonGet(end, "character"), 0));
+    if (edit.offset1 < edit.offset0) edit.offset1 = edit.offset0;
+    edit.text = jsonString(jsonGet(change, "text"));
+    text = applySourceEdits(text, &edit, 1, scratch);
+  }
+  setQueryFileContent(&server->queries, doc->file, text);
+  syncDocument(server, doc);
+  publishDiagnostics(server, doc, scratch);
+}
+
+void handleDidClose(LSPServer *server, JsonValue *params, Allocator *scratch) {
+  auto doc = documentOfParams(server, params);
+  if (!doc) return;
+  // Open files may still load it, from now on as it is on disk
+  doc->open = false;
+  clearQueryFileContent(&server->queries, doc->file);
+  publishDiagnostics(server, doc, scratch);
+}
+
+void beginLSPResult(LSPMessage *message, JsonValue *id) {
+  beginLSPMessage(message);
+  fputs("\"id\":", message->out);
+  writeJson(message->out, id);
+  fputs(",\"result\":", message->out);
+}
+
+void handleHover(LSPServer *server, JsonValue *id, JsonValue *params, Allocator *scratch) {
+  LSPMessage message;
+  beginLSPResult(&message, id);
+  LSPDocument *doc = NULL;
+  LSPDeclaration declaration = {};
+  if (!resolvePositionOfParams(server, params, scratch, &doc, &declaration)) {
+    fputs("null", message.out);
+    endLSPMessage(server, &message);
+    return;
+  }
+
+  // First line of the declaration
+  auto declDoc = declaration.doc;
+  auto content = declDoc->content;
+  auto line = lineAtOffset(declDoc, declaration.decl->offset0, scratch);
+  auto lineStart = declDoc->lineStarts.data[line];
+  auto lineEnd = lineStart;
+  while (lineEnd < content.len && content.data[lineEnd] != '\n') lineEnd++;
+  auto text = SPrintf(scratch, "```c6\n%.*s\n```", (int)(lineEnd - lineStart), content.data + lineStart);
+
+  // Hovered identifier is the one at the position, not the declaration
+  auto hovered = doc->index.nodes.data[innermostASTNodeAt(&doc->index, offsetOfParams(doc, params, scratch))].node;
+  fputs("{\"contents\":{\"kind\":\"markdown\",\"value\":", message.out);
+  writeJsonString(message.out, text);
+  fputs("},\"range\":", message.out);
+  writeRange(message.out, doc, hovered->offset0, hovered->offset1, scratch);
+  fputc('}', message.out);
+  endLSPMessage(server, &message);
+}
+
+void handleDefinition(LSPServer *server, JsonValue *id, JsonValue *params, Allocator *scratch) {
+  LSPMessage message;
+  beginLSPResult(&message, id);
+  LSPDocument *doc = NULL;
+  LSPDeclaration declaration = {};
+  if (resolvePositionOfParams(server, params, scratch, &doc, &declaration)) {
+    fputs("{\"uri\":", message.out);
+    writeJsonString(message.out, declaration.doc->uri);
+    fputs(",\"range\":", message.out);
+    writeRange(message.out, declaration.doc, declaration.name->offset0, declaration.name->offset1, scratch);
+    fputc('}', message.out);
+  } else {
+    fputs("null", message.out);
+  }
+  endLSPMessage(server, &message);
+}
+
+void writeDocumentSymbol(FILE *out, LSPDocument *doc, ASTIdentifier *name, LSPSymbolKind kind,
+                         AST *decl, Allocator *scratch) {
+  fputs("{\"name\":", out);
+  writeJsonString(out, name->name);
+  fprintf(out, ",\"kind\":%d,\"range\":", kind);
+  writeRange(out, doc, decl->offset0, decl->offset1, scratch);
+  fputs(",\"selectionRange\":", out);
+  writeRange(out, doc, name->offset0, name->offset1, scratch);
+  fputs(",\"children\":[", out);
+  if (auto structAST = AST_CAST(ASTStruct, decl)) {
+    for (uint32_t i = 0; i < structAST->members.len; ++i) {
+      auto member = structAST->members.data[i];
+      if (i) fputc(',', out);
+      writeDocumentSymbol(out, doc, member->name, LSP_SYMBOL_FIELD, member, scratch);
+    }
+  }
+  fputs("]}", out);
+}
+
+void handleDocumentSymbol(LSPServer *server, JsonValue *id, JsonValue *params, Allocator *scratch) {
+  LSPMessage message;
+  beginLSPResult(&message, id);
+  auto doc = documentOfParams(server, params);
+  fputc('[', message.out);
+  bool first = true;
+  auto ast = doc ? doc->parsed->ast : NULL;
+  for (uint32_t i = 0; ast && i < ast->topLevelDecls.len; ++i) {
+    auto decl = ast->topLevelDecls.data[i];
+    switch (decl->type) {
+    case ASTConst_:
+    case ASTStruct_:
+    case ASTFunction_: {
+      auto kind = decl->type == ASTConst_ ? LSP_SYMBOL_CONSTANT
+                : decl->type == ASTStruct_ ? LSP_SYMBOL_STRUCT : LSP_SYMBOL_FUNCTION;
+      auto name = decl->type == ASTConst_ ? static_cast<ASTConst *>(decl)->name
+                : decl->type == ASTStruct_ ? static_cast<ASTStruct *>(decl)->name
+                : static_cast<ASTFunction *>(decl)->name;
+      if (!name) break;
+      if (!first) fputc(',', message.out);
+      first = false;
+      writeDocumentSymbol(message.out, doc, name, kind, decl, scratch);
+    } break;
+    case ASTVariableDefinition_: {
+      auto names = static_cast<ASTVariableDefinition *>(decl)->names;
+      for (uint32_t j = 0; j < names.len; ++j) {
+        if (!first) fputc(',', message.out);
+        first = false;
+        writeDocumentSymbol(message.out, doc, names.data[j], LSP_SYMBOL_VARIABLE, decl, scratch);
+      }
+    } break;
+    default: break;
+    }
+  }
+  fputc(']', message.out);
+  endLSPMessage(server, &message);
+}
+
+void handleLSPMessage(LSPServer *server, Str method, JsonValue *id, JsonValue *params,
+                      Allocator *scratch) {
+  bool isRequest = id != NULL;
+  if (server->shutdownRequested && isRequest) {
+    sendLSPError(server, id, LSP_ERROR_INVALID_REQUEST, "Server is shutting down");
+    return;
+  }
+
+  if (StrEqual(method, STR("initialize"))) {
+    LSPMessage message;
+    beginLSPResult(&message, id);
+    fputs("{\"capabilities\":{"
+            "\"textDocumentSync\":{\"openClose\":true,\"change\":2},"
+            "\"hoverProvider\":true,"
+            "\"definitionProvider\":true,"
+            "\"documentSymbolProvider\":true"
+          "},\"serverInfo\":{\"name\":\"c6\"}}", message.out);
+    endLSPMessage(server, &message);
+  } else if (StrEqual(method, STR("shutdown"))) {
+    server->shutdownRequested = true;
+    LSPMessage message;
+    beginLSPResult(&message, id);
+    fputs("null", message.out);
+    endLSPMessage(server, &message);
+  } else if (StrEqual(method, STR("textDocument/didOpen"))) {
+    handleDidOpen(server, params, scratch);
+  } else if (StrEqual(method, STR("textDocument/didChange"))) {
+    handleDidChange(server, params, scratch);
+  } else if (StrEqual(method, STR("textDocument/didClose"))) {
+    handleDidClose(server, params, scratch);
+  } else if (StrEqual(method, STR("textDocument/hover"))) {
+    handleHover(server, id, params, scratch);
+  } else if (StrEqual(method, STR("textDocument/definition"))) {
+    handleDefinition(server, id, params, scratch);
+  } else if (StrEqual(method, STR("textDocument/documentSymbol"))) {
+    handleDocumentSymbol(server, id, params, scratch);
+  } else if (isRequest) {
+    sendLSPError(server, id, LSP_ERROR_METHOD_NOT_FOUND, "Method not found");
+  }
+}
+
+int runLanguageServer(FILE *in, FILE *out) {
+  auto server = (LSPServer *)malloc(sizeof(LSPServer));
+  *server = {};
+  server->in = in;
+  server->out = out;
+  initVirtualAllocator(&server->memory, NULL, 64ull * 1024ull * 1024ull * 1024ull,
+                       ALLOCATOR_FLAG_SHARED);
+  initGlobalData(&server->globalData);
+  initThreadData(&server->td, &server->globalData, &server->memory);
+  initQueryEngine(&server->queries, NULL, &server->memory);
+
+  int status = 1;
+  for (;;) {
+    // Message lives in one scratch, handlers use the other for temporaries
+    auto messageScratch = getScratch(&server->td);
+    AllocatorCheckpoint checkpoint(messageScratch);
+    Str body = {};
+    if (!readLSPMessage(server, &body, messageScratch)) break;
+
+    auto message = parseJson(body, messageScratch);
+    if (!message || message->type != JSON_OBJECT) {
+      sendLSPError(server, NULL, LSP_ERROR_PARSE, "Malformed message");
+      continue;
+    }
+    auto method = jsonString(jsonGet(message, "method"));
+    if (StrEqual(method, STR("exit"))) {
+      status = server->shutdownRequested ? 0 : 1;
+      break;
+    }
+    handleLSPMessage(server, method, jsonGet(message, "id"), jsonGet(message, "params"),
+                     getScratch(&server->td, messageScratch));
+  }
+
+  deinitQueryEngine(&server->queries);
+  deinitGlobalData(&server->globalData);
+  deinitVirtualAllocator(&server->memory);
+  free(server);
+  return status;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "ast_index.h"
+#include "core_types.h"
+#include "parsing/parser.h"
+#include "query.h"
+
+// Document opened by the client or a file loaded by one, its content and
+// tree come from the query engine (from disk unless it is open)
+struct LSPDocument {
+  Str uri;
+  uint32_t file; // in LSPServer::queries
+  bool open;
+
+  // Current version, see syncDocument
+  Str content;
+  ParsedFile *parsed;
+  uint64_t changedAt; // of the parsed file caches below were built for
+
+  // Built on first use after a change
+  Allocator region;
+  Array<uint32_t> lineStarts;
+  ASTIndex index;
+  bool indexValid;
+};
+
+struct LSPServer {
+  FILE *in;
+  FILE *out;
+
+  Allocator memory; // reservoir of document and query regions
+  GlobalData globalData;
+  ThreadData td;
+  QueryEngine queries;
+
+  Array<LSPDocument *> documents;
+  bool shutdownRequested;
+};
+
+// Serves the language server protocol over in/out until exit notification
+// or end of input, returns exit status. Diagnostics (parse errors), hover,
+// go-to-definition and document symbols are answered from trees kept in
+// memory, edits are reparsed incrementally (see reparseEditedFile), names
+// are resolved across loaded files by queries and position lookups go
+// through ASTIndex.
+int runLanguageServer(FILE *in, FILE *out);
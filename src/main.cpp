@@ -1,6 +1,98 @@
 #include "all.h"
 #include "all.cpp"
 
+void printUsage(const char *program) {
+  fprintf(stderr, "usage: %s [--keep-going] [--pin-threads] [--hash-cons-types]\n"
+                  "    [--cache-dir=DIR] [--snapshot=FILE] [--restore=FILE]\n"
+                  "    [--threads=N] [--watch] [--trace=FILE [--trace-parser]] entry.c6\n"
+                  "       %s --server=SOCKET [compiler options]\n"
+                  "       %s --connect=SOCKET [--keep-going] entry.c6\n"
+                  "       %s --connect=SOCKET --shutdown\n"
+                  "       %s --lsp\n", program, program, program, program, program);
+}
+
 int main(int argc, char **argv) {
-  return 0;
+  CompilerOptions options = {};
+  const char *snapshotPath = NULL;
+  const char *serverSocket = NULL;
+  const char *clientSocket = NULL;
+  bool shutdownServer = false;
+  bool watch = false;
+  bool languageServer = false;
+  const char *tracePath = NULL;
+  bool traceParser = false;
+  for (int i = 1; i < argc; ++i) {
+    auto arg = argv[i];
+    if (strcmp(arg, "--keep-going") == 0) {
+      options.keepGoing = true;
+    } else if (strcmp(arg, "--pin-threads") == 0) {
+      options.pinThreads = true;
+    } else if (strcmp(arg, "--hash-cons-types") == 0) {
+      options.hashConsTypes = true;
+    } else if (strncmp(arg, "--snapshot=", 11) == 0) {
+      snapshotPath = arg + 11;
+    } else if (strncmp(arg, "--restore=", 10) == 0) {
+      options.restoreSnapshot = arg + 10;
+    } else if (strncmp(arg, "--cache-dir=", 12) == 0) {
+      options.cacheDirectory = arg + 12;
+    } else if (strncmp(arg, "--server=", 9) == 0) {
+      serverSocket = arg + 9;
+    } else if (strncmp(arg, "--connect=", 10) == 0) {
+      clientSocket = arg + 10;
+    } else if (strcmp(arg, "--shutdown") == 0) {
+      shutdownServer = true;
+    } else if (strcmp(arg, "--watch") == 0) {
+      watch = true;
+    } else if (strcmp(arg, "--lsp") == 0) {
+      languageServer = true;
+    } else if (strncmp(arg, "--trace=", 8) == 0) {
+      tracePath = arg + 8;
+    } else if (strcmp(arg, "--trace-parser") == 0) {
+      traceParser = true;
+    } else if (strncmp(arg, "--threads=", 10) == 0) {
+      options.threads = atoi(arg + 10);
+    } else if (arg[0] == '-' || options.entryPoint) {
+      printUsage(argv[0]);
+      return 2;
+    } else {
+      options.entryPoint = arg;
+    }
+  }
+
+  if (options.threads < 0) options.threads = 0;
+  if (languageServer) return runLanguageServer(stdin, stdout);
+  if (serverSocket) return runCompileServer(options, serverSocket);
+  if (clientSocket && shutdownServer) return stopCompileServer(clientSocket);
+
+  if (!options.entryPoint) {
+    printUsage(argv[0]);
+    return 2;
+  }
+  if (clientSocket) {
+    uint32_t flags = options.keepGoing ? COMPILE_REQUEST_KEEP_GOING : 0;
+    return runCompileClient(clientSocket, options.entryPoint, flags, stderr);
+  }
+  if (watch) return runWatchMode(options);
+
+  if (tracePath) {
+    nameTraceThread("main");
+    startTracing(traceParser);
+  }
+  Compiler compiler;
+  initCompiler(&compiler, options);
+  auto status = waitForCompilerToFinish(&compiler);
+  if (status == 0 && snapshotPath && !writeCompilerSnapshot(&compiler, snapshotPath)) {
+    fprintf(stderr, "error Failed to write snapshot %s\n", snapshotPath);
+    status = 1;
+  }
+  // Joins workers, so their last events are recorded
+  deinitCompiler(&compiler);
+  if (tracePath) {
+    stopTracing();
+    if (!writeTrace(tracePath)) {
+      fprintf(stderr, "error Failed to write trace %s\n", tracePath);
+      status = 1;
+    }
+  }
+  return status;
 }
@@ -1,27 +1,66 @@
 #include "parser.h"
 
+#include "../ast_walker.h"
+#include "../utils/trace.h"
+
+// Once nesting is too deep every production fails, and on the way up this
+// error replaces whatever the enclosing productions reported
+void setTooDeepError(Lexer *lexer, ParsingError *error) {
+  error->offset = lexer->tooDeepOffset;
+  error->message = STR("Nesting is too deep");
+  error->producerSourceCodeFile = __FILE__;
+  error->producerSourceCodeLine = __LINE__;
+}
+
 AST *decorateParseFunctionCall(ParseFunction *fn, ThreadData *ctx, Lexer *lexer,
                             uint64_t parsingFlags, ParsingError *error) {
   Token positionBefore = lexer->peek();
+  if (lexer->depth >= MAX_PARSING_DEPTH && !lexer->tooDeep) {
+    lexer->tooDeep = true;
+    lexer->tooDeepOffset = positionBefore.offset0;
+  }
+  if (lexer->tooDeep) {
+    setTooDeepError(lexer, error);
+    return NULL;
+  }
+
   ParsingError tmpError = {};
-  char *allocatorPositionBefore = ctx->allocator.current;
+  auto allocatorPositionBefore = allocatorPosition(&ctx->allocator);
+  lexer->depth++;
   AST *result = fn(ctx, lexer, parsingFlags, &tmpError);
+  lexer->depth--;
+  // Whatever enclosing productions made of failed parts is discarded too
+  if (lexer->tooDeep) result = NULL;
   if (!result) {
-    if (tmpError.offset > error->offset)
+    if (lexer->tooDeep) {
+      setTooDeepError(lexer, error);
+    } else if (tmpError.offset > error->offset) {
       *error = tmpError;
+    }
     lexer->reset(positionBefore);
-    ctx->allocator.current = allocatorPositionBefore;
+    rewindAllocator(&ctx->allocator, allocatorPositionBefore);
   } else {
     *error = {};
   }
   return result;
 }
 
+// Out of line, so untraced productions stay as cheap as they were
+AST *tracedParseFunctionCall(const char *name, ParseFunction *fn, ThreadData *ctx, Lexer *lexer,
+                             uint64_t parsingFlags, ParsingError *error) {
+  TRACE_SCOPE(name);
+  return decorateParseFunctionCall(fn, ctx, lexer, parsingFlags, error);
+}
+
 #define DEFINE_PARSER(NAME)                                                    \
   AST *NAME##Impl(ThreadData *ctx, Lexer *lexer, uint64_t parsingFlags,        \
                   ParsingError *error);                                        \
   AST *NAME(ThreadData *ctx, Lexer *lexer, uint64_t parsingFlags,              \
             ParsingError *error) {                                             \
+    if (__builtin_expect(tracingParserProductions(), 0)) {                     \
+      return tracedParseFunctionCall(#NAME, NAME##Impl, ctx, lexer,            \
+                                     parsingFlags, error);                     \
+    }                                                                          \
     return decorateParseFunctionCall(NAME##Impl, ctx, lexer, parsingFlags,     \
                                      error);                                   \
   }                                                                            \
@@ -47,6 +86,14 @@ AST *decorateParseFunctionCall(ParseFunction *fn, ThreadData *ctx, Lexer *lexer,
     return NULL;                                                               \
   } while (0)
 
+// Polled once per top level declaration and statement, cheap enough to not
+// show up in profile while stopping long parses soon after first error
+#define CHECK_CANCELLED()                                                      \
+  do {                                                                         \
+    if (compilationCancelled(ctx->globalData))                                 \
+      RETURN_NULL_WITH_ERROR(lexer->peek().offset0, "Compilation cancelled");  \
+  } while (0)
+
 bool matchStatementBoundary(uint32_t prevOffset1, Lexer *lexer, ParsingError *error, const char *file, int line) {
   auto nextTokenType = lexer->peek().type;
   if (nextTokenType == TOKEN_TYPE_SEMICOLON || nextTokenType == TOKEN_TYPE_EOF) {
@@ -65,6 +112,33 @@ bool matchStatementBoundary(uint32_t prevOffset1, Lexer *lexer, ParsingError *er
   return false;
 }
 
+// Called when no top level declaration could be parsed: either the file is
+// over, or lexer or the failed declaration explain what is wrong
+bool matchEndOfFile(Lexer *lexer, ParsingError *error, const char *file, int line) {
+  auto token = lexer->peek();
+  if (token.type == TOKEN_TYPE_EOF) {
+    lexer->eat();
+    return true;
+  }
+  if (token.type == TOKEN_TYPE_UNEXPECTED_SEQUENCE_OF_CHARS) {
+    error->offset = token.offset0;
+    error->message = STR("Unexpected sequence of characters");
+  } else if (token.type == TOKEN_TYPE_UNTERMINATED_STRING_LITERAL) {
+    error->offset = token.offset0;
+    error->message = STR("Unterminated string literal");
+  } else {
+    return false;
+  }
+  error->producerSourceCodeFile = file;
+  error->producerSourceCodeLine = line;
+  return false;
+}
+
+#define MATCH_END_OF_FILE()                                                    \
+  do {                                                                         \
+    if (!matchEndOfFile(lexer, error, __FILE__, __LINE__)) return NULL;        \
+  } while (0)
+
 #define MATCH_STATEMENT_BOUNDARY(PREV_OFFSET1)                                 \
   do {                                                                         \
     if (!matchStatementBoundary((PREV_OFFSET1), lexer, error, __FILE__,        \
@@ -246,7 +320,7 @@ DEFINE_PARSER(parseParenExpr) {
   if (binaryOp) {
     binaryOp->flags |= AST_FLAGS_EXPR_IN_PAREN;
     binaryOp->offset0 = openingParen.offset0;
-    binaryOp->offset1 = openingParen.offset1;
+    binaryOp->offset1 = closingParen.offset1;
   }
 
   return expr;
@@ -391,29 +465,201 @@ DEFINE_PARSER(parseExpr) {
 }
 
 DEFINE_PARSER(parseFile) {
+  AllocatorCheckpoint checkpoint(getScratch(ctx));
   Array<AST *> topLevelDecls = {};
   for (;;) {
+    CHECK_CANCELLED();
     auto decl = parseTopLevelDeclaration(ctx, lexer, parsingFlags, error);
     if (decl) {
-      append(&topLevelDecls, decl, &ctx->allocator);
+      append(&topLevelDecls, decl, checkpoint.allocator);
     } else {
-      auto token = lexer->peek();
+      MATCH_END_OF_FILE();
+      break;
+    }
+  }
 
-      if (token.type == TOKEN_TYPE_EOF) {
-        lexer->eat();
-        break;
-      } else if (token.type == TOKEN_TYPE_UNEXPECTED_SEQUENCE_OF_CHARS) {
-        RETURN_NULL_WITH_ERROR(token.offset0, "Unexpected sequence of characters");
-      } else if (token.type == TOKEN_TYPE_UNTERMINATED_STRING_LITERAL) {
-        RETURN_NULL_WITH_ERROR(token.offset0, "Unterminated string literal");
-      } else {
-        return NULL;
-      }
+  auto file = AST_ALLOC(ASTFile, &ctx->allocator);
+  file->topLevelDecls = copyArray(topLevelDecls, &ctx->allocator);
+  return file;
+}
+
+void checkSourceEdits(Str source, const SourceEdit *edits, uint32_t count) {
+  for (uint32_t i = 0; i < count; ++i) {
+    auto edit = edits[i];
+    if (edit.offset0 > edit.offset1 || edit.offset1 > source.len ||
+        (i > 0 && edit.offset0 < edits[i - 1].offset1)) {
+      fprintf(stderr, "%s:%d Edit %u [%u, %u) is out of order or out of source of %u bytes\n",
+              __FILE__, __LINE__, i, edit.offset0, edit.offset1, (uint32_t)source.len);
+      abort();
+    }
+  }
+}
+
+Str applySourceEdits(Str source, const SourceEdit *edits, uint32_t count, Allocator *a) {
+  checkSourceEdits(source, edits, count);
+  size_t len = source.len;
+  for (uint32_t i = 0; i < count; ++i) {
+    len = len - (edits[i].offset1 - edits[i].offset0) + edits[i].text.len;
+  }
+
+  Str result = {ALLOC_ARRAY(char, len + 1, a), len};
+  auto to = result.data;
+  uint32_t from = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    auto edit = edits[i];
+    memcpy(to, source.data + from, edit.offset0 - from);
+    to += edit.offset0 - from;
+    memcpy(to, edit.text.data, edit.text.len);
+    to += edit.text.len;
+    from = edit.offset1;
+  }
+  memcpy(to, source.data + from, source.len - from);
+  result.data[len] = '\0';
+  return result;
+}
+
+struct ASTShift {
+  int64_t delta;
+  uint32_t fileIndex;
+  // Type expressions are shared by variables declared together (`a, b : T`)
+  // and, once hash-consed, by every use of the type, so their nodes are
+  // remembered in an open addressing set and shifted once
+  AST **shiftedTypes;
+  uint32_t shiftedLen;
+  uint32_t shiftedCap;
+  Allocator *allocator;
+};
+
+uint32_t hashASTPointer(AST *node) {
+  return (uint32_t)(((uintptr_t)node >> 4) * 0x9E3779B97F4A7C15ull >> 32);
+}
+
+// Returns false if node was shifted already
+bool markTypeShifted(ASTShift *shift, AST *node) {
+  if (shift->shiftedCap) {
+    auto mask = shift->shiftedCap - 1;
+    for (uint32_t i = hashASTPointer(node) & mask;; i = (i + 1) & mask) {
+      if (!shift->shiftedTypes[i]) break;
+      if (shift->shiftedTypes[i] == node) return false;
+    }
+  }
+
+  // Keep load factor under 1/2
+  if ((shift->shiftedLen + 1) * 2 > shift->shiftedCap) {
+    uint32_t newCap = shift->shiftedCap ? shift->shiftedCap * 2 : 64;
+    auto newTypes = ALLOC_ARRAY(AST *, newCap, shift->allocator);
+    memset(newTypes, 0, newCap * sizeof(AST *));
+    for (uint32_t i = 0; i < shift->shiftedCap; ++i) {
+      auto type = shift->shiftedTypes[i];
+      if (!type) continue;
+      uint32_t j = hashASTPointer(type) & (newCap - 1);
+      while (newTypes[j]) j = (j + 1) & (newCap - 1);
+      newTypes[j] = type;
+    }
+    shift->shiftedTypes = newTypes;
+    shift->shiftedCap = newCap;
+  }
+  uint32_t i = hashASTPointer(node) & (shift->shiftedCap - 1);
+  while (shift->shiftedTypes[i]) i = (i + 1) & (shift->shiftedCap - 1);
+  shift->shiftedTypes[i] = node;
+  shift->shiftedLen++;
+  return true;
+}
+
+void shiftASTNode(AST *node, ASTShift *shift) {
+  node->fileIndex = shift->fileIndex;
+  node->offset0 += shift->delta;
+  node->offset1 += shift->delta;
+}
+
+void shiftTypeAST(AST *node, void *arg) {
+  auto shift = static_cast<ASTShift *>(arg);
+  if (!node || !markTypeShifted(shift, node)) return;
+  shiftASTNode(node, shift);
+  forEachASTChild(node, shiftTypeAST, shift);
+}
+
+// Recursion is bounded by nesting of the source, like the parser's own
+void shiftAST(AST *node, void *arg) {
+  auto shift = static_cast<ASTShift *>(arg);
+  shiftASTNode(node, shift);
+
+  if (auto var = AST_CAST(ASTVar, node)) {
+    if (var->name) shiftAST(var->name, shift);
+    shiftTypeAST(var->typeExpr, shift);
+    if (var->initExpr) shiftAST(var->initExpr, shift);
+  } else if (auto def = AST_CAST(ASTVariableDefinition, node)) {
+    for (uint32_t i = 0; i < def->names.len; ++i) shiftAST(def->names.data[i], shift);
+    shiftTypeAST(def->typeExpr, shift);
+    for (uint32_t i = 0; i < def->initilizationValues.len; ++i) {
+      shiftAST(def->initilizationValues.data[i], shift);
+    }
+  } else if (auto cast = AST_CAST(ASTCast, node)) {
+    if (cast->operand) shiftAST(cast->operand, shift);
+    shiftTypeAST(cast->toTypeExpr, shift);
+  } else {
+    forEachASTChild(node, shiftAST, shift);
+  }
+}
+
+ASTFile *reparseFile(ThreadData *ctx, Lexer *lexer, ASTFile *oldFile, Str oldSource,
+                     const SourceEdit *edits, uint32_t count, ParsingError *error) {
+  checkSourceEdits(oldSource, edits, count);
+  auto decls = oldFile->topLevelDecls;
+  uint32_t damage0 = count ? edits[0].offset0 : oldSource.len;
+  uint32_t damage1 = count ? edits[count - 1].offset1 : oldSource.len;
+  // Every edit is before the declarations which may be reused at the end
+  int64_t delta = (int64_t)lexer->source.len - (int64_t)oldSource.len;
+
+  // Declaration is kept while the next one starts before damage: text up to
+  // it decided where the declaration ends (statement boundary, last token)
+  uint32_t kept = 0;
+  while (kept + 1 < decls.len && decls.data[kept + 1]->offset0 < damage0) kept++;
+  // Declarations starting after damage are reused as soon as parsing reaches
+  // one of them, text from there to the end is the same
+  uint32_t next = kept;
+  while (next < decls.len && decls.data[next]->offset0 < damage1) next++;
+
+  AllocatorCheckpoint checkpoint(getScratch(ctx));
+  Array<AST *> topLevelDecls = {};
+  for (uint32_t i = 0; i < kept; ++i) append(&topLevelDecls, decls.data[i], checkpoint.allocator);
+
+  lexer->hasBufferedToken = false;
+  lexer->offset = kept ? decls.data[kept]->offset0 : 0;
+  bool resynced = false;
+  for (;;) {
+    CHECK_CANCELLED();
+    auto position = lexer->peek().offset0;
+    while (next < decls.len && decls.data[next]->offset0 + delta < position) next++;
+    if (next < decls.len && decls.data[next]->offset0 + delta == position) {
+      resynced = true;
+      break;
+    }
+
+    auto decl = parseTopLevelDeclaration(ctx, lexer, 0, error);
+    if (decl) {
+      append(&topLevelDecls, decl, checkpoint.allocator);
+    } else {
+      MATCH_END_OF_FILE();
+      break;
+    }
+  }
+
+  // Old tree is changed only once the new one is complete
+  if (resynced) {
+    ASTShift shift = {};
+    shift.delta = delta;
+    shift.fileIndex = lexer->fileIndex;
+    shift.allocator = checkpoint.allocator;
+    for (uint32_t i = next; i < decls.len; ++i) {
+      auto decl = decls.data[i];
+      if (delta || decl->fileIndex != lexer->fileIndex) shiftAST(decl, &shift);
+      append(&topLevelDecls, decl, checkpoint.allocator);
     }
   }
 
   auto file = AST_ALLOC(ASTFile, &ctx->allocator);
-  file->topLevelDecls = topLevelDecls;
+  file->topLevelDecls = copyArray(topLevelDecls, &ctx->allocator);
   return file;
 }
 
@@ -452,6 +698,7 @@ DEFINE_PARSER(parseAnonymousStruct) {
   auto newStruct = AST_ALLOC(ASTStruct, &ctx->allocator);
 
   while (lexer->peek().type != TOKEN_TYPE_RIGHT_BRACE) {
+    AllocatorCheckpoint checkpoint(getScratch(ctx));
     Array<ASTIdentifier *> fieldNames = {};
 
     while (lexer->peek().type != TOKEN_TYPE_COLON) {
@@ -459,7 +706,7 @@ DEFINE_PARSER(parseAnonymousStruct) {
       if (!ident) return NULL;
 
       append(&fieldNames, AST_ASSERT_CAST(ASTIdentifier, ident),
-        &ctx->allocator);
+        checkpoint.allocator);
 
       if (lexer->peek().type == TOKEN_TYPE_COMMA) {
         lexer->eat();
@@ -480,6 +727,9 @@ DEFINE_PARSER(parseAnonymousStruct) {
       newMember->name = name;
       newMember->typeExpr = typeExpr;
       newMember->parentScope = newStruct;
+      newMember->fileIndex = lexer->fileIndex;
+      newMember->offset0 = name->offset0;
+      newMember->offset1 = typeExpr->offset1;
       append(&newStruct->members, newMember, &ctx->allocator);
     }
   }
@@ -541,6 +791,7 @@ DEFINE_PARSER(parseAnonymousFunction) {
   MATCH_TOKEN(openingParen, TOKEN_TYPE_LEFT_PAREN, "Expected '('");
 
   while (lexer->peek().type != TOKEN_TYPE_RIGHT_PAREN) {
+    AllocatorCheckpoint checkpoint(getScratch(ctx));
     Array<ASTIdentifier *> parameterNames = {};
 
     while (lexer->peek().type != TOKEN_TYPE_COLON) {
@@ -548,7 +799,7 @@ DEFINE_PARSER(parseAnonymousFunction) {
       if (!ident) return NULL;
 
       append(&parameterNames, AST_ASSERT_CAST(ASTIdentifier, ident),
-        &ctx->allocator);
+        checkpoint.allocator);
 
       if (lexer->peek().type == TOKEN_TYPE_COMMA) {
         lexer->eat();
@@ -569,6 +820,9 @@ DEFINE_PARSER(parseAnonymousFunction) {
       newMember->name = name;
       newMember->typeExpr = typeExpr;
       newMember->parentScope = newFunction;
+      newMember->fileIndex = lexer->fileIndex;
+      newMember->offset0 = name->offset0;
+      newMember->offset1 = typeExpr->offset1;
       append(&newFunction->args, newMember, &ctx->allocator);
     }
 
@@ -633,11 +887,15 @@ DEFINE_PARSER(parseBlock) {
   MATCH_TOKEN(openingBrace, TOKEN_TYPE_LEFT_BRACE, "expected '{'");
   auto block = AST_ALLOC(ASTBlock, &ctx->allocator);
 
+  AllocatorCheckpoint checkpoint(getScratch(ctx));
+  Array<AST *> statements = {};
   while (lexer->peek().type != TOKEN_TYPE_RIGHT_BRACE) {
+    CHECK_CANCELLED();
     auto statement = parseStatement(ctx, lexer, parsingFlags, error);
     if (!statement) return NULL;
-    append(&block->statements, statement, &ctx->allocator);
+    append(&statements, statement, checkpoint.allocator);
   }
+  block->statements = copyArray(statements, &ctx->allocator);
   MATCH_TOKEN(closingBrace, TOKEN_TYPE_RIGHT_BRACE, "expected '}'");
   block->fileIndex = lexer->fileIndex;
   block->offset0 = openingBrace.offset0;
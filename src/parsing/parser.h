@@ -14,6 +14,11 @@ struct ParsingError {
   const char *producerSourceCodeFile;
   int producerSourceCodeLine;
 };
+// Every production is a call, so nesting takes stack of the parsing thread
+// (job fibers included). Deeper input fails with an error instead of
+// overflowing the stack.
+const uint32_t MAX_PARSING_DEPTH = 4096;
+
 typedef AST *(ParseFunction)(ThreadData *ctx, Lexer *lexer,
                              uint64_t parsingFlags, ParsingError *error);
 
@@ -47,3 +52,24 @@ FORWARD_DECLARE_PARSER(parseCallContinuation);
 FORWARD_DECLARE_PARSER(parseSubscriptContinuation);
 FORWARD_DECLARE_PARSER(parseMemberAccessContinuation);
 FORWARD_DECLARE_PARSER(parseCastContinuation);
+
+// Replaces [offset0, offset1) of old source with text
+struct SourceEdit {
+  uint32_t offset0, offset1;
+  Str text;
+};
+
+// Edits should be sorted and should not overlap, result is NUL terminated
+Str applySourceEdits(Str source, const SourceEdit *edits, uint32_t count, Allocator *a);
+
+// Parses lexer->source, which is oldSource with edits applied, as parseFile
+// would. Top level declarations of oldFile before the first edit are reused,
+// parsing starts at the first damaged one and stops as soon as it reaches
+// the start of an old declaration after the last edit: that one and the rest
+// are reused with offsets shifted. Reused declarations are changed in place,
+// so oldFile should not be used afterwards unless NULL is returned; their
+// names still point into oldSource, which should outlive the new tree (or
+// the tree should be compacted). Type expressions may be shared between
+// declarations (see hashAST), shared nodes are shifted once.
+ASTFile *reparseFile(ThreadData *ctx, Lexer *lexer, ASTFile *oldFile, Str oldSource,
+                     const SourceEdit *edits, uint32_t count, ParsingError *error);
@@ -71,6 +71,12 @@ struct Lexer {
   Str source;
   uint32_t offset;
 
+  // Parser state: productions entered and not returned yet, and where the
+  // first one over MAX_PARSING_DEPTH started (parsing fails from then on)
+  uint32_t depth;
+  bool tooDeep;
+  uint32_t tooDeepOffset;
+
   Token eat();
   Token peek();
   void reset(Token to);
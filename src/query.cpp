@@ -0,0 +1,554 @@
+#include "query.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ast_compaction.h"
+#include "compiler.h"
+#include "utils/fs.h"
+#include "utils/hash.h"
+
+void initQueryEngine(QueryEngine *engine, Compiler *compiler, Allocator *reservoir) {
+  *engine = {};
+  engine->compiler = compiler;
+  engine->reservoir = reservoir;
+  pthread_mutex_init(&engine->mutex, NULL);
+  pthread_cond_init(&engine->finishedCond, NULL);
+  initGrowableAllocator(&engine->allocator, reservoir, 64 * 1024, ALLOCATOR_FLAG_RELEASABLE);
+  // Memos start at revision 0, so every one is verified on first fetch
+  engine->revision = 1;
+}
+
+void deinitQueryEngine(QueryEngine *engine) {
+  for (uint32_t i = 0; i < engine->memosCap; ++i) {
+    auto memo = engine->memos[i];
+    if (memo && memo->hasRegion) releaseAllocator(&memo->region);
+  }
+  releaseAllocator(&engine->allocator);
+  pthread_mutex_destroy(&engine->mutex);
+  pthread_cond_destroy(&engine->finishedCond);
+}
+
+// Tables
+
+uint64_t hashQueryKey(QueryKey key) {
+  return hashMemory(key.name.data, key.name.len, ((uint64_t)key.kind << 32) | key.file);
+}
+
+bool queryKeysEqual(QueryKey a, QueryKey b) {
+  return a.kind == b.kind && a.file == b.file && StrEqual(a.name, b.name);
+}
+
+QueryMemo **findQueryMemoSlot(QueryMemo **slots, uint32_t cap, QueryKey key, uint64_t hash) {
+  for (uint32_t i = hash & (cap - 1);; i = (i + 1) & (cap - 1)) {
+    auto memo = slots[i];
+    if (!memo || (memo->hash == hash && queryKeysEqual(memo->key, key))) return slots + i;
+  }
+}
+
+// Should be called under mutex of the engine
+QueryMemo *findOrInsertQueryMemo(QueryEngine *engine, QueryKey key) {
+  // Keep load factor under 1/2
+  if ((engine->memosLen + 1) * 2 > engine->memosCap) {
+    uint32_t newCap = engine->memosCap ? engine->memosCap * 2 : 256;
+    auto newMemos = ALLOC_ARRAY(QueryMemo *, newCap, &engine->allocator);
+    memset(newMemos, 0, newCap * sizeof(QueryMemo *));
+    for (uint32_t i = 0; i < engine->memosCap; ++i) {
+      auto memo = engine->memos[i];
+      if (memo) *findQueryMemoSlot(newMemos, newCap, memo->key, memo->hash) = memo;
+    }
+    engine->memos = newMemos;
+    engine->memosCap = newCap;
+  }
+
+  auto hash = hashQueryKey(key);
+  auto slot = findQueryMemoSlot(engine->memos, engine->memosCap, key, hash);
+  if (!*slot) {
+    auto memo = ALLOC(QueryMemo, &engine->allocator);
+    *memo = {};
+    memo->key = key;
+    if (key.name.len) memo->key.name = StrDup(key.name, &engine->allocator);
+    memo->hash = hash;
+    *slot = memo;
+    engine->memosLen++;
+  }
+  return *slot;
+}
+
+uint32_t *findQueryFileSlot(QueryEngine *engine, uint32_t *slots, uint32_t cap, Str path,
+                            uint64_t hash) {
+  for (uint32_t i = hash & (cap - 1);; i = (i + 1) & (cap - 1)) {
+    if (!slots[i]) return slots + i;
+    auto file = engine->files.data + slots[i] - 1;
+    if (file->hash == hash && StrEqual(file->path, path)) return slots + i;
+  }
+}
+
+uint32_t queryFileId(QueryEngine *engine, Str path) {
+  char joined[PATH_MAX + 1];
+  snprintf(joined, sizeof(joined), "%.*s", (int)path.len, path.data);
+  char canonical[PATH_MAX + 1];
+  if (!realpath(joined, canonical)) {
+    // Files which don't exist (yet) still get an absolute path, loads are
+    // relative to its directory
+    char cwd[PATH_MAX + 1];
+    if (joined[0] == '/' || !getcwd(cwd, sizeof(cwd)) ||
+        snprintf(canonical, sizeof(canonical), "%s/%s", cwd, joined) >= (int)sizeof(canonical)) {
+      snprintf(canonical, sizeof(canonical), "%s", joined);
+    }
+  }
+  auto key = CStringToStr(canonical);
+  auto hash = hashMemory(key.data, key.len, 0);
+
+  pthread_mutex_lock(&engine->mutex);
+  if ((engine->files.len + 1) * 2 > engine->fileSlotsCap) {
+    uint32_t newCap = engine->fileSlotsCap ? engine->fileSlotsCap * 2 : 64;
+    auto newSlots = ALLOC_ARRAY(uint32_t, newCap, &engine->allocator);
+    memset(newSlots, 0, newCap * sizeof(uint32_t));
+    for (uint32_t i = 0; i < engine->files.len; ++i) {
+      auto file = engine->files.data + i;
+      *findQueryFileSlot(engine, newSlots, newCap, file->path, file->hash) = i + 1;
+    }
+    engine->fileSlots = newSlots;
+    engine->fileSlotsCap = newCap;
+  }
+  auto slot = findQueryFileSlot(engine, engine->fileSlots, engine->fileSlotsCap, key, hash);
+  if (!*slot) {
+    QueryFile file = {};
+    file.path = SPrintf(&engine->allocator, "%.*s", (int)key.len, key.data);
+    file.hash = hash;
+    append(&engine->files, file, &engine->allocator);
+    *slot = engine->files.len;
+  }
+  auto result = *slot - 1;
+  pthread_mutex_unlock(&engine->mutex);
+  return result;
+}
+
+Str queryFilePath(QueryEngine *engine, uint32_t file) {
+  pthread_mutex_lock(&engine->mutex);
+  auto path = engine->files.data[file].path;
+  pthread_mutex_unlock(&engine->mutex);
+  return path;
+}
+
+// Values
+
+Allocator newQueryRegion(QueryEngine *engine, size_t size) {
+  Allocator region = {};
+  initGrowableAllocator(&region, engine->reservoir, size, ALLOCATOR_FLAG_RELEASABLE);
+  return region;
+}
+
+void replaceQueryRegion(QueryMemo *memo, Allocator region) {
+  if (memo->hasRegion) releaseAllocator(&memo->region);
+  memo->region = region;
+  memo->hasRegion = true;
+}
+
+// Lexer expects source to be NUL terminated
+Str copyQuerySource(Str content, Allocator *a) {
+  Str result = {ALLOC_ARRAY(char, content.len + 1, a), content.len};
+  memcpy(result.data, content.data, content.len);
+  result.data[result.len] = '\0';
+  return result;
+}
+
+// Inputs
+
+void setQueryFileContent(QueryEngine *engine, uint32_t file, Str content) {
+  pthread_mutex_lock(&engine->mutex);
+  auto memo = findOrInsertQueryMemo(engine, QueryKey{QUERY_FILE_CONTENT, file, {}});
+  if (!(memo->overridden && memo->hasValue && StrEqual(memo->content, content))) {
+    auto region = newQueryRegion(engine, content.len + 1);
+    memo->content = copyQuerySource(content, &region);
+    replaceQueryRegion(memo, region);
+    memo->exists = true;
+    memo->overridden = true;
+    memo->stale = false;
+    memo->hasValue = true;
+    memo->state = QUERY_STATE_DONE;
+    memo->changedAt = memo->verifiedAt = ++engine->revision;
+  }
+  pthread_mutex_unlock(&engine->mutex);
+}
+
+void clearQueryFileContent(QueryEngine *engine, uint32_t file) {
+  pthread_mutex_lock(&engine->mutex);
+  auto memo = findOrInsertQueryMemo(engine, QueryKey{QUERY_FILE_CONTENT, file, {}});
+  if (memo->overridden) {
+    memo->overridden = false;
+    memo->stale = true;
+    engine->revision++;
+  }
+  pthread_mutex_unlock(&engine->mutex);
+}
+
+void invalidateQueryFile(QueryEngine *engine, uint32_t file) {
+  pthread_mutex_lock(&engine->mutex);
+  auto memo = findOrInsertQueryMemo(engine, QueryKey{QUERY_FILE_CONTENT, file, {}});
+  if (memo->hasValue && !memo->overridden && !memo->stale) {
+    memo->stale = true;
+    engine->revision++;
+  }
+  pthread_mutex_unlock(&engine->mutex);
+}
+
+uint32_t refreshQueryFiles(QueryEngine *engine) {
+  uint32_t changed = 0;
+  pthread_mutex_lock(&engine->mutex);
+  for (uint32_t i = 0; i < engine->memosCap; ++i) {
+    auto memo = engine->memos[i];
+    if (!memo || memo->key.kind != QUERY_FILE_CONTENT || !memo->hasValue || memo->overridden ||
+        memo->stale) {
+      continue;
+    }
+    struct stat st = {};
+    bool exists = stat(engine->files.data[memo->key.file].path.data, &st) == 0 &&
+                  !S_ISDIR(st.st_mode);
+    if (exists != memo->exists ||
+        (exists && ((uint64_t)st.st_size != memo->content.len ||
+                    st.st_mtim.tv_sec != memo->mtimeSec || st.st_mtim.tv_nsec != memo->mtimeNsec))) {
+      memo->stale = true;
+      changed++;
+    }
+  }
+  if (changed) engine->revision++;
+  pthread_mutex_unlock(&engine->mutex);
+  return changed;
+}
+
+// Computations, each returns whether the value changed
+
+bool readQueryFileContent(ThreadData *td, QueryEngine *engine, QueryMemo *memo) {
+  auto path = queryFilePath(engine, memo->key.file);
+  struct stat st = {};
+  bool exists = stat(path.data, &st) == 0 && !S_ISDIR(st.st_mode);
+  memo->mtimeSec = st.st_mtim.tv_sec;
+  memo->mtimeNsec = st.st_mtim.tv_nsec;
+  memo->stale = false;
+
+  auto scratch = getScratch(td);
+  AllocatorCheckpoint checkpoint(scratch);
+  Str content = {};
+  if (exists) {
+    auto file = readFile(scratch, path.data);
+    exists = file.ok;
+    content = file.content;
+  }
+  if (memo->hasValue && exists == memo->exists && StrEqual(content, memo->content)) return false;
+
+  auto region = newQueryRegion(engine, content.len + 1);
+  memo->content = copyQuerySource(content, &region);
+  replaceQueryRegion(memo, region);
+  memo->exists = exists;
+  return true;
+}
+
+// Edits leave old versions behind (reused declarations point into older
+// sources), so the region is compacted once it outgrows the live version
+void compactParsedFile(QueryEngine *engine, QueryMemo *memo) {
+  if (usage(&memo->region) < 4 * memo->liveUsage + 1024 * 1024) return;
+
+  auto parsed = &memo->parsed;
+  auto compacted = newQueryRegion(engine, parsed->content.len + 64 * 1024);
+  if (parsed->ast) {
+    parsed->ast = compactFileAST(parsed->ast, &parsed->content, &compacted);
+  } else {
+    parsed->content = copyQuerySource(parsed->content, &compacted);
+  }
+  replaceQueryRegion(memo, compacted);
+  memo->liveUsage = usage(&memo->region);
+}
+
+// Declarations of the previous version outside of the edited range are
+// reused, see reparseEditedFile
+bool computeParsedFile(ThreadData **td, QueryEngine *engine, QueryFrame *frame, QueryMemo *memo) {
+  auto content = queryFileContent(td, engine, frame, memo->key.file);
+  auto t = *td;
+
+  auto previous = memo->parsed;
+  if (!previous.ast) replaceQueryRegion(memo, newQueryRegion(engine, 4 * content.len + 64 * 1024));
+  ParsedFile parsed = {};
+  parsed.content = copyQuerySource(content, &memo->region);
+
+  Lexer lexer = {};
+  lexer.fileIndex = memo->key.file;
+  lexer.source = parsed.content;
+  auto threadAllocator = t->allocator;
+  t->allocator = memo->region;
+  if (previous.ast) {
+    parsed.ast = reparseEditedFile(t, &lexer, previous.ast, previous.content, &parsed.error);
+  } else {
+    parsed.ast = static_cast<ASTFile *>(parseFile(t, &lexer, 0, &parsed.error));
+  }
+  memo->region = t->allocator;
+  t->allocator = threadAllocator;
+
+  memo->parsed = parsed;
+  if (!previous.ast) memo->liveUsage = usage(&memo->region);
+  compactParsedFile(engine, memo);
+  return true;
+}
+
+void addQueryDecl(Array<QueryDecl> *decls, ASTIdentifier *name, ASTNodeType type, uint32_t index,
+                  Allocator *scratch, Allocator *a) {
+  if (!name) return;
+  QueryDecl decl = {};
+  decl.name = StrDup(name->name, a);
+  decl.type = type;
+  decl.index = index;
+  append(decls, decl, scratch);
+}
+
+bool fileDeclsEqual(FileDecls *a, FileDecls *b) {
+  if (a->decls.len != b->decls.len || a->loads.len != b->loads.len) return false;
+  for (uint32_t i = 0; i < a->decls.len; ++i) {
+    auto x = a->decls.data + i, y = b->decls.data + i;
+    if (x->type != y->type || x->index != y->index || !StrEqual(x->name, y->name)) return false;
+  }
+  return memcmp(a->loads.data, b->loads.data, a->loads.len * sizeof(uint32_t)) == 0;
+}
+
+bool computeDeclsOf(ThreadData **td, QueryEngine *engine, QueryFrame *frame, QueryMemo *memo) {
+  auto parsed = queryParsedFile(td, engine, frame, memo->key.file);
+  auto topLevelDecls = parsed->ast ? parsed->ast->topLevelDecls : Array<AST *>{};
+  auto directory = directoryOf(queryFilePath(engine, memo->key.file));
+
+  auto scratch = getScratch(*td);
+  AllocatorCheckpoint checkpoint(scratch);
+  auto region = newQueryRegion(engine, topLevelDecls.len * 64 + 4096);
+  FileDecls decls = {};
+  for (uint32_t i = 0; i < topLevelDecls.len; ++i) {
+    auto decl = topLevelDecls.data[i];
+    switch (decl->type) {
+    case ASTConst_:
+      addQueryDecl(&decls.decls, static_cast<ASTConst *>(decl)->name, decl->type, i, scratch, &region);
+      break;
+    case ASTStruct_:
+      addQueryDecl(&decls.decls, static_cast<ASTStruct *>(decl)->name, decl->type, i, scratch, &region);
+      break;
+    case ASTFunction_:
+      addQueryDecl(&decls.decls, static_cast<ASTFunction *>(decl)->name, decl->type, i, scratch, &region);
+      break;
+    case ASTVariableDefinition_: {
+      auto names = static_cast<ASTVariableDefinition *>(decl)->names;
+      for (uint32_t j = 0; j < names.len; ++j) {
+        addQueryDecl(&decls.decls, names.data[j], decl->type, i, scratch, &region);
+      }
+    } break;
+    case ASTLoadDirective_: {
+      auto path = static_cast<ASTLoadDirective *>(decl)->path->value;
+      auto fullPath = path.len && path.data[0] == '/'
+                        ? path
+                        : SPrintf(scratch, "%.*s/%.*s", (int)directory.len, directory.data,
+                                  (int)path.len, path.data);
+      append(&decls.loads, queryFileId(engine, fullPath), scratch);
+    } break;
+    default: break;
+    }
+  }
+  decls.decls = copyArray(decls.decls, &region);
+  decls.loads = copyArray(decls.loads, &region);
+
+  if (memo->hasValue && fileDeclsEqual(&decls, &memo->decls)) {
+    releaseAllocator(&region);
+    return false;
+  }
+  replaceQueryRegion(memo, region);
+  memo->decls = decls;
+  return true;
+}
+
+bool computeResolve(ThreadData **td, QueryEngine *engine, QueryFrame *frame, QueryMemo *memo) {
+  // Kept across fetches, which may resume on another thread, so not scratch
+  auto temporary = newQueryRegion(engine, 4096);
+  Array<uint32_t> stack = {};
+  Array<uint8_t> visited = {};
+  Array<QueryKey> prefetch = {};
+
+  QueryResolution result = {FILE_INDEX_NONE, 0};
+  append(&stack, memo->key.file, &temporary);
+  while (stack.len && result.file == FILE_INDEX_NONE) {
+    auto file = stack.data[--stack.len];
+    if (file < visited.len && visited.data[file]) continue;
+    if (file >= visited.len) {
+      auto len = visited.len;
+      ensureAtLeast(&visited, file + 1, &temporary);
+      memset(visited.data + len, 0, visited.len - len);
+    }
+    visited.data[file] = 1;
+
+    auto decls = queryDeclsOf(td, engine, frame, file);
+    for (uint32_t i = 0; i < decls->decls.len; ++i) {
+      if (StrEqual(decls->decls.data[i].name, memo->key.name)) {
+        result = {file, i};
+        break;
+      }
+    }
+    if (result.file != FILE_INDEX_NONE) break;
+
+    // Loaded files are searched in order, their declarations are computed
+    // in parallel up front
+    prefetch.len = 0;
+    for (uint32_t i = 0; i < decls->loads.len; ++i) {
+      auto load = decls->loads.data[i];
+      if (load < visited.len && visited.data[load]) continue;
+      append(&prefetch, QueryKey{QUERY_DECLS_OF, load, {}}, &temporary);
+    }
+    *td = fetchQueriesParallel(*td, engine, frame, prefetch.data, prefetch.len);
+    for (uint32_t i = decls->loads.len; i-- > 0;) {
+      append(&stack, decls->loads.data[i], &temporary);
+    }
+  }
+  releaseAllocator(&temporary);
+
+  bool changed = !memo->hasValue || result.file != memo->resolution.file ||
+                 result.decl != memo->resolution.decl;
+  memo->resolution = result;
+  return changed;
+}
+
+// Fetching
+
+ThreadData *ensureQueryMemo(ThreadData *td, QueryEngine *engine, QueryFrame *frame, QueryMemo *memo);
+
+// Dependencies are checked in the order they were fetched, the first one
+// which changed means the rest may not even be needed anymore
+bool queryDependencyChanged(ThreadData **td, QueryEngine *engine, QueryFrame *frame,
+                            QueryMemo *memo) {
+  QueryFrame verifying = {memo, frame, true};
+  for (uint32_t i = 0; i < memo->dependencies.len; ++i) {
+    auto dependency = memo->dependencies.data[i];
+    pthread_mutex_lock(&engine->mutex);
+    *td = ensureQueryMemo(*td, engine, &verifying, dependency);
+    bool changed = dependency->changedAt > memo->verifiedAt;
+    pthread_mutex_unlock(&engine->mutex);
+    if (changed) return true;
+  }
+  return false;
+}
+
+ThreadData *updateQueryMemo(ThreadData *td, QueryEngine *engine, QueryFrame *frame, QueryMemo *memo,
+                            uint64_t revision) {
+  if (memo->key.kind == QUERY_FILE_CONTENT) {
+    if (memo->hasValue && (memo->overridden || !memo->stale)) return td;
+  } else if (memo->hasValue && !queryDependencyChanged(&td, engine, frame, memo)) {
+    return td;
+  }
+
+  __atomic_add_fetch(&engine->computations[memo->key.kind], 1, __ATOMIC_RELAXED);
+  // Nothing else appends to dependencies of memo until it is computed
+  memo->dependencies.len = 0;
+  QueryFrame computing = {memo, frame, false};
+  bool changed = false;
+  switch (memo->key.kind) {
+  case QUERY_FILE_CONTENT: changed = readQueryFileContent(td, engine, memo); break;
+  case QUERY_PARSED_FILE: changed = computeParsedFile(&td, engine, &computing, memo); break;
+  case QUERY_DECLS_OF: changed = computeDeclsOf(&td, engine, &computing, memo); break;
+  case QUERY_RESOLVE: changed = computeResolve(&td, engine, &computing, memo); break;
+  default: abort();
+  }
+  if (changed || !memo->hasValue) memo->changedAt = revision;
+  memo->hasValue = true;
+  return td;
+}
+
+// Should be called under mutex of the engine, returns with it locked
+ThreadData *waitForQueryMemo(ThreadData *td, QueryEngine *engine, QueryMemo *memo) {
+  if (!td->currentFiber) {
+    pthread_cond_wait(&engine->finishedCond, &engine->mutex);
+    return td;
+  }
+  pthread_mutex_unlock(&engine->mutex);
+  td = waitForJobEvent(td, &memo->finished);
+  // Wait could return before signaling thread released the event
+  lockJobEvent(&memo->finished);
+  unlockJobEvent(&memo->finished);
+  pthread_mutex_lock(&engine->mutex);
+  return td;
+}
+
+// Should be called under mutex of the engine, which is released while memo
+// is verified or computed
+ThreadData *ensureQueryMemo(ThreadData *td, QueryEngine *engine, QueryFrame *frame, QueryMemo *memo) {
+  if (frame && !frame->verifying) {
+    append(&frame->memo->dependencies, memo, &engine->allocator);
+  }
+
+  for (;;) {
+    if (memo->state == QUERY_STATE_DONE && memo->verifiedAt == engine->revision) return td;
+    if (memo->state != QUERY_STATE_COMPUTING) break;
+
+    for (auto f = frame; f; f = f->parent) {
+      if (f->memo == memo) {
+        fprintf(stderr, "%s:%d Query of kind %d depends on itself\n", __FILE__, __LINE__,
+                memo->key.kind);
+        abort();
+      }
+    }
+    td = waitForQueryMemo(td, engine, memo);
+  }
+
+  auto revision = engine->revision;
+  memo->state = QUERY_STATE_COMPUTING;
+  lockJobEvent(&memo->finished);
+  memo->finished.signaled = false;
+  unlockJobEvent(&memo->finished);
+  pthread_mutex_unlock(&engine->mutex);
+
+  td = updateQueryMemo(td, engine, frame, memo, revision);
+
+  pthread_mutex_lock(&engine->mutex);
+  memo->state = QUERY_STATE_DONE;
+  memo->verifiedAt = revision;
+  pthread_cond_broadcast(&engine->finishedCond);
+  if (engine->compiler) {
+    signalJobEvent(engine->compiler, &memo->finished);
+  } else {
+    memo->finished.signaled = true;
+  }
+  return td;
+}
+
+QueryMemo *fetchQuery(ThreadData **td, QueryEngine *engine, QueryFrame *frame, QueryKey key) {
+  pthread_mutex_lock(&engine->mutex);
+  auto memo = findOrInsertQueryMemo(engine, key);
+  *td = ensureQueryMemo(*td, engine, frame, memo);
+  pthread_mutex_unlock(&engine->mutex);
+  return memo;
+}
+
+struct QueryPrefetch {
+  QueryEngine *engine;
+  QueryFrame *frame;
+  QueryKey *keys;
+};
+
+void prefetchQuery(ThreadData *td, void *arg, uint32_t index) {
+  auto prefetch = static_cast<QueryPrefetch *>(arg);
+  fetchQuery(&td, prefetch->engine, prefetch->frame, prefetch->keys[index]);
+}
+
+ThreadData *fetchQueriesParallel(ThreadData *td, QueryEngine *engine, QueryFrame *frame,
+                                 QueryKey *keys, uint32_t count) {
+  QueryPrefetch prefetch = {engine, frame, keys};
+  return parallelFor(td, count, prefetchQuery, &prefetch);
+}
+
+Str queryFileContent(ThreadData **td, QueryEngine *engine, QueryFrame *frame, uint32_t file) {
+  return fetchQuery(td, engine, frame, QueryKey{QUERY_FILE_CONTENT, file, {}})->content;
+}
+
+ParsedFile *queryParsedFile(ThreadData **td, QueryEngine *engine, QueryFrame *frame, uint32_t file) {
+  return &fetchQuery(td, engine, frame, QueryKey{QUERY_PARSED_FILE, file, {}})->parsed;
+}
+
+FileDecls *queryDeclsOf(ThreadData **td, QueryEngine *engine, QueryFrame *frame, uint32_t file) {
+  return &fetchQuery(td, engine, frame, QueryKey{QUERY_DECLS_OF, file, {}})->decls;
+}
+
+QueryResolution queryResolve(ThreadData **td, QueryEngine *engine, QueryFrame *frame,
+                             uint32_t file, Str name) {
+  return fetchQuery(td, engine, frame, QueryKey{QUERY_RESOLVE, file, name})->resolution;
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "core_types.h"
+#include "parsing/parser.h"
+
+// Demand-driven, memoized computations over source files. A query is
+// computed on first fetch, records queries it fetched while computing and is
+// reused until one of them changes. Inputs (file contents) change between
+// fetches, bumping the revision; a memo older than the revision is verified
+// by checking its dependencies first and computed again only if one of them
+// changed since. Value equal to the previous one doesn't count as a change
+// (early cutoff), so e.g. editing a function body reparses the file but
+// doesn't touch name resolution.
+//
+// Fetching is thread safe. Inside of jobs concurrent fetches of the same
+// query wait for the one computing it (waitForJobEvent) and independent ones
+// can be computed in parallel with fetchQueriesParallel.
+enum QueryKind {
+  // Input: source of the file, read from disk unless set by the client
+  QUERY_FILE_CONTENT,
+  QUERY_PARSED_FILE,
+  QUERY_DECLS_OF,
+  // Top level declaration of the name seen from file: its own or of a file
+  // it loads (transitively), first in load order
+  QUERY_RESOLVE,
+  QUERY_KIND_COUNT,
+};
+
+struct QueryKey {
+  QueryKind kind;
+  uint32_t file; // see queryFileId
+  Str name; // QUERY_RESOLVE
+};
+
+struct ParsedFile {
+  Str content;
+  ASTFile *ast; // NULL if content doesn't parse
+  ParsingError error;
+};
+
+struct QueryDecl {
+  Str name;
+  ASTNodeType type;
+  uint32_t index; // in topLevelDecls of the parsed file
+};
+
+struct FileDecls {
+  Array<QueryDecl> decls;
+  Array<uint32_t> loads; // files of #load directives
+};
+
+struct QueryResolution {
+  uint32_t file; // FILE_INDEX_NONE if name is not declared
+  uint32_t decl; // in FileDecls::decls of file
+};
+
+enum QueryState {
+  QUERY_STATE_EMPTY,
+  QUERY_STATE_COMPUTING,
+  QUERY_STATE_DONE,
+};
+
+struct QueryMemo {
+  QueryKey key;
+  uint64_t hash;
+  QueryState state;
+  // Signaled when computation in progress is done, reset by the next one
+  JobEvent finished;
+
+  uint64_t verifiedAt; // revision the value is known to be current at
+  uint64_t changedAt; // revision the value last changed at
+  Array<QueryMemo *> dependencies; // fetched by the last computation
+  bool hasValue;
+
+  // Value, fields of the kind are used. Everything it points to lives in
+  // the region, which is replaced (or compacted) when value changes.
+  Allocator region;
+  bool hasRegion;
+  // QUERY_FILE_CONTENT
+  Str content;
+  bool exists;
+  bool overridden; // set by the client, disk is not looked at
+  bool stale; // disk version changed
+  int64_t mtimeSec, mtimeNsec;
+  // QUERY_PARSED_FILE
+  ParsedFile parsed;
+  size_t liveUsage;
+  // QUERY_DECLS_OF
+  FileDecls decls;
+  // QUERY_RESOLVE
+  QueryResolution resolution;
+};
+
+// Query being computed (or verified) by this thread, dependencies are
+// recorded into its memo
+struct QueryFrame {
+  QueryMemo *memo;
+  QueryFrame *parent;
+  bool verifying; // only checks dependencies, doesn't record them
+};
+
+struct QueryFile {
+  Str path; // NUL terminated, absolute; canonical if file existed when it was added
+  uint64_t hash;
+};
+
+struct Compiler;
+struct QueryEngine {
+  Compiler *compiler; // wakes up jobs waiting for queries, may be NULL
+  Allocator *reservoir; // regions of values
+
+  pthread_mutex_t mutex;
+  // Waiters outside of jobs
+  pthread_cond_t finishedCond;
+  Allocator allocator; // memos, keys, dependencies
+
+  uint64_t revision;
+
+  // Open addressing tables
+  QueryMemo **memos;
+  uint32_t memosLen;
+  uint32_t memosCap;
+  Array<QueryFile> files;
+  uint32_t *fileSlots;
+  uint32_t fileSlotsCap;
+
+  // Number of computations (not verifications) per kind
+  uint64_t computations[QUERY_KIND_COUNT];
+};
+
+void initQueryEngine(QueryEngine *engine, Compiler *compiler, Allocator *reservoir);
+void deinitQueryEngine(QueryEngine *engine);
+
+// Same id for every path of the file which exists
+uint32_t queryFileId(QueryEngine *engine, Str path);
+Str queryFilePath(QueryEngine *engine, uint32_t file);
+
+// Inputs should not change while queries are being fetched
+void setQueryFileContent(QueryEngine *engine, uint32_t file, Str content);
+// File follows the disk again
+void clearQueryFileContent(QueryEngine *engine, uint32_t file);
+void invalidateQueryFile(QueryEngine *engine, uint32_t file);
+// Checks size and modification time of every file read from disk, returns
+// number of files which changed
+uint32_t refreshQueryFiles(QueryEngine *engine);
+
+// Frame is the query fetching this one, NULL at top level. Value of returned
+// memo stays valid until inputs change. Job may resume on another worker,
+// so *td is updated.
+QueryMemo *fetchQuery(ThreadData **td, QueryEngine *engine, QueryFrame *frame, QueryKey key);
+// Fetches all keys as parallel jobs, sequentially outside of jobs
+ThreadData *fetchQueriesParallel(ThreadData *td, QueryEngine *engine, QueryFrame *frame,
+                                 QueryKey *keys, uint32_t count);
+
+Str queryFileContent(ThreadData **td, QueryEngine *engine, QueryFrame *frame, uint32_t file);
+ParsedFile *queryParsedFile(ThreadData **td, QueryEngine *engine, QueryFrame *frame, uint32_t file);
+FileDecls *queryDeclsOf(ThreadData **td, QueryEngine *engine, QueryFrame *frame, uint32_t file);
+QueryResolution queryResolve(ThreadData **td, QueryEngine *engine, QueryFrame *frame,
+                             uint32_t file, Str name);
@@ -43,7 +43,7 @@ void report(ThreadData *ctx, FILE *out, const char *levelPrefix, int fileIndex,
   }
 
   const char *line0End = line0Start;
-  while (*line0End != '\n') ++line0End;
+  while (line0End < end && *line0End != '\n') ++line0End;
 
   auto prefixLen = snprintf(NULL, 0, "%.*s:%d:%d",
     (int)fileEntry.relativePath.len,
@@ -0,0 +1,223 @@
+#include "server.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+bool sendAll(int fd, const void *data, size_t size) {
+  auto p = (const char *)data;
+  while (size) {
+    // Client which went away must not kill the server with SIGPIPE
+    auto n = send(fd, p, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool receiveAll(int fd, void *data, size_t size) {
+  auto p = (char *)data;
+  while (size) {
+    auto n = recv(fd, p, size, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool sendServerMessage(int fd, ServerMessageType type, const void *payload, uint32_t len) {
+  ServerMessageHeader header = {type, len};
+  return sendAll(fd, &header, sizeof(header)) && sendAll(fd, payload, len);
+}
+
+bool initUnixSocketAddress(sockaddr_un *address, const char *socketPath) {
+  *address = {};
+  address->sun_family = AF_UNIX;
+  if (strlen(socketPath) >= sizeof(address->sun_path)) return false;
+  strcpy(address->sun_path, socketPath);
+  return true;
+}
+
+struct DiagnosticsStream {
+  Compiler *compiler;
+  int fd;
+  bool disconnected;
+};
+
+// Called by stdio with its lock held, so messages of different workers
+// don't interleave
+ssize_t writeDiagnostics(void *cookie, const char *data, size_t size) {
+  auto stream = static_cast<DiagnosticsStream *>(cookie);
+  if (!stream->disconnected &&
+      !sendServerMessage(stream->fd, SERVER_MESSAGE_DIAGNOSTICS, data, size)) {
+    // Nobody waits for the result anymore
+    stream->disconnected = true;
+    cancelCompilation(&stream->compiler->globalData);
+  }
+  return size;
+}
+
+int serveCompileRequest(Compiler *compiler, int fd, char *payload, uint32_t len) {
+  uint32_t flags = 0;
+  if (len < sizeof(flags) || payload[len - 1] != '\0') return 2;
+  memcpy(&flags, payload, sizeof(flags));
+  auto cwd = payload + sizeof(flags);
+  auto cwdLen = strlen(cwd);
+  if (sizeof(flags) + cwdLen + 1 >= len || cwdLen >= PATH_MAX) return 2;
+  auto entryPoint = cwd + cwdLen + 1;
+
+  DiagnosticsStream stream = {compiler, fd, false};
+  cookie_io_functions_t functions = {};
+  functions.write = writeDiagnostics;
+  auto diagnostics = fopencookie(&stream, "w", functions);
+  if (!diagnostics) return 2;
+  setvbuf(diagnostics, NULL, _IOLBF, 0);
+
+  memcpy(compiler->globalData.currentWorkingDirectory, cwd, cwdLen + 1);
+  compiler->options.keepGoing = flags & COMPILE_REQUEST_KEEP_GOING;
+  compiler->diagnostics = diagnostics;
+  startCompilation(compiler, entryPoint);
+  // Client which hung up doesn't wait for the result, even if compilation
+  // has nothing to report and would never notice it is gone
+  int status = 0;
+  bool cancelled = false;
+  while (!waitForCompilerToFinishFor(compiler, SERVER_DISCONNECT_POLL_MS, &status)) {
+    pollfd pfd = {fd, POLLRDHUP, 0};
+    if (!cancelled && poll(&pfd, 1, 0) > 0) {
+      cancelled = true;
+      cancelCompilation(&compiler->globalData);
+    }
+  }
+  compiler->diagnostics = stderr;
+  fclose(diagnostics);
+  return status;
+}
+
+int runCompileServer(CompilerOptions options, const char *socketPath) {
+  sockaddr_un address;
+  if (!initUnixSocketAddress(&address, socketPath)) {
+    fprintf(stderr, "error Socket path is too long: %s\n", socketPath);
+    return 1;
+  }
+
+  int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  unlink(socketPath);
+  if (listenFd < 0 || bind(listenFd, (sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(listenFd, 64) != 0) {
+    fprintf(stderr, "error Failed to listen on %s: %s\n", socketPath, strerror(errno));
+    if (listenFd >= 0) close(listenFd);
+    return 1;
+  }
+
+  // Pool shrinks back while nobody compiles
+  options.entryPoint = NULL;
+  if (!options.idleWorkerTimeoutMs) options.idleWorkerTimeoutMs = 5000;
+  auto compiler = (Compiler *)malloc(sizeof(Compiler));
+  initCompiler(compiler, options);
+
+  char payload[SERVER_MESSAGE_MAX_LEN];
+  for (bool shutdown = false; !shutdown;) {
+    int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      fprintf(stderr, "error accept failed: %s\n", strerror(errno));
+      break;
+    }
+
+    // Client which connects and doesn't send its request doesn't block others
+    timeval timeout = {SERVER_RECEIVE_TIMEOUT_MS / 1000, SERVER_RECEIVE_TIMEOUT_MS % 1000 * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    ServerMessageHeader header = {};
+    if (receiveAll(fd, &header, sizeof(header)) && header.len <= sizeof(payload) &&
+        receiveAll(fd, payload, header.len)) {
+      if (header.type == SERVER_MESSAGE_SHUTDOWN) {
+        shutdown = true;
+      } else if (header.type == SERVER_MESSAGE_COMPILE) {
+        int32_t status = serveCompileRequest(compiler, fd, payload, header.len);
+        sendServerMessage(fd, SERVER_MESSAGE_STATUS, &status, sizeof(status));
+      }
+    }
+    close(fd);
+  }
+
+  deinitCompiler(compiler);
+  free(compiler);
+  close(listenFd);
+  unlink(socketPath);
+  return 0;
+}
+
+int connectToCompileServer(const char *socketPath) {
+  sockaddr_un address;
+  if (!initUnixSocketAddress(&address, socketPath)) return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  if (connect(fd, (sockaddr *)&address, sizeof(address)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int runCompileClient(const char *socketPath, const char *entryPoint, uint32_t flags, FILE *out) {
+  char payload[SERVER_MESSAGE_MAX_LEN];
+  char cwd[PATH_MAX + 1];
+  auto entryLen = strlen(entryPoint);
+  if (!getcwd(cwd, sizeof(cwd))) return 2;
+  auto cwdLen = strlen(cwd);
+  uint32_t len = sizeof(flags) + cwdLen + 1 + entryLen + 1;
+  if (len > sizeof(payload)) {
+    fprintf(out, "error Entry point path is too long\n");
+    return 2;
+  }
+  memcpy(payload, &flags, sizeof(flags));
+  memcpy(payload + sizeof(flags), cwd, cwdLen + 1);
+  memcpy(payload + sizeof(flags) + cwdLen + 1, entryPoint, entryLen + 1);
+
+  int fd = connectToCompileServer(socketPath);
+  if (fd < 0 || !sendServerMessage(fd, SERVER_MESSAGE_COMPILE, payload, len)) {
+    fprintf(out, "error Compile server is not reachable at %s\n", socketPath);
+    if (fd >= 0) close(fd);
+    return 2;
+  }
+
+  int status = 2;
+  ServerMessageHeader header = {};
+  while (receiveAll(fd, &header, sizeof(header))) {
+    if (header.type == SERVER_MESSAGE_DIAGNOSTICS) {
+      // Text is not limited by message size, it is copied in pieces
+      bool ok = true;
+      for (uint32_t left = header.len; ok && left;) {
+        auto piece = left < sizeof(payload) ? left : (uint32_t)sizeof(payload);
+        ok = receiveAll(fd, payload, piece);
+        if (ok) fwrite(payload, 1, piece, out);
+        left -= piece;
+      }
+      if (!ok) break;
+    } else if (header.type == SERVER_MESSAGE_STATUS && header.len == sizeof(int32_t)) {
+      int32_t value = 0;
+      if (receiveAll(fd, &value, sizeof(value))) status = value;
+      break;
+    } else {
+      break;
+    }
+  }
+  close(fd);
+  return status;
+}
+
+int stopCompileServer(const char *socketPath) {
+  int fd = connectToCompileServer(socketPath);
+  if (fd < 0) return 2;
+  auto sent = sendServerMessage(fd, SERVER_MESSAGE_SHUTDOWN, NULL, 0);
+  close(fd);
+  return sent ? 0 : 2;
+}
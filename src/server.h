@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "compiler.h"
+
+// Compile server keeps one Compiler alive, so process startup, arena and
+// worker pool are paid once and files which didn't change are reused by
+// following compilations. Requests are served one at a time, every
+// compilation gets the whole worker pool.
+//
+// Every message on the socket is ServerMessageHeader followed by payload:
+//   COMPILE     client -> server, uint32_t flags, cwd and entry point (NUL terminated)
+//   SHUTDOWN    client -> server, no payload
+//   DIAGNOSTICS server -> client, text as it is produced
+//   STATUS      server -> client, int32_t exit status, last message
+enum ServerMessageType {
+  SERVER_MESSAGE_COMPILE,
+  SERVER_MESSAGE_SHUTDOWN,
+  SERVER_MESSAGE_DIAGNOSTICS,
+  SERVER_MESSAGE_STATUS,
+};
+
+struct ServerMessageHeader {
+  uint32_t type;
+  uint32_t len;
+};
+
+enum CompileRequestFlag {
+  COMPILE_REQUEST_KEEP_GOING = 1 << 0,
+};
+
+const uint32_t SERVER_MESSAGE_MAX_LEN = 2 * (PATH_MAX + 1) + sizeof(uint32_t);
+// Request should arrive this soon after connecting
+const int SERVER_RECEIVE_TIMEOUT_MS = 2000;
+// How often running compilation checks that its client is still connected
+const int SERVER_DISCONNECT_POLL_MS = 50;
+
+// Serves requests until SHUTDOWN is received, entry point of options is
+// ignored. Returns exit status for the server process.
+int runCompileServer(CompilerOptions options, const char *socketPath);
+
+// Sends compile request to the server and copies diagnostics to `out`.
+// Returns exit status of the compilation, or 2 if server is not reachable.
+int runCompileClient(const char *socketPath, const char *entryPoint, uint32_t flags, FILE *out);
+int stopCompileServer(const char *socketPath);
+// Returns connected socket or -1
+int connectToCompileServer(const char *socketPath);
@@ -0,0 +1,145 @@
+#include "snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool inArena(Allocator *arena, const void *data, size_t size) {
+  return (char *)data >= arena->start && (char *)data + size <= arena->current;
+}
+
+bool writeCompilerSnapshot(Compiler *compiler, const char *path) {
+  auto arena = &compiler->mainAllocator;
+  auto files = &compiler->globalData.files;
+  auto count = filesCount(files);
+
+  auto records = (SnapshotFile *)calloc(count ? count : 1, sizeof(SnapshotFile));
+  for (uint32_t i = 0; i < count; ++i) {
+    // Records are restored in order, so every index needs a file
+    auto slot = publishedFileSlot(files, i);
+    if (!slot) {
+      free(records);
+      return false;
+    }
+    auto record = records + i;
+    record->entry = slot->entry;
+
+    auto entry = &slot->entry;
+    if (!slot->ast || slot->image ||
+        !inArena(arena, entry->absolutePath.data, entry->absolutePath.len + 1) ||
+        !inArena(arena, entry->content.data, entry->content.len) ||
+        !inArena(arena, slot->ast, sizeof(ASTFile))) {
+      // Still recorded, so the file is loaded again and indices don't shift
+      record->entry.content = {};
+      if (!inArena(arena, entry->absolutePath.data, entry->absolutePath.len + 1)) {
+        free(records);
+        return false;
+      }
+      continue;
+    }
+
+    record->ast = slot->ast;
+    record->region = slot->region;
+    record->mtimeSec = slot->mtimeSec;
+    record->mtimeNsec = slot->mtimeNsec;
+  }
+
+  SnapshotHeader header = {};
+  header.magic = SNAPSHOT_MAGIC;
+  header.version = SNAPSHOT_VERSION;
+  header.filesCount = count;
+  header.arenaAddress = (uint64_t)arena->start;
+  header.arenaSize = arena->current - arena->start;
+  header.arenaOffset = alignAddressUpwards(sizeof(header) + count * sizeof(SnapshotFile), 4096);
+
+  char tmpPath[PATH_MAX + 32];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", path, getpid());
+  int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  bool ok = fd >= 0 &&
+            pwrite(fd, &header, sizeof(header), 0) == sizeof(header) &&
+            pwrite(fd, records, count * sizeof(SnapshotFile), sizeof(header)) ==
+                (ssize_t)(count * sizeof(SnapshotFile));
+  free(records);
+
+  // Arena is written from memory directly, pwrite may do it in parts
+  for (uint64_t written = 0; ok && written < header.arenaSize;) {
+    auto n = pwrite(fd, arena->start + written, header.arenaSize - written,
+                    header.arenaOffset + written);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) ok = false;
+    else written += n;
+  }
+  if (fd >= 0) ok = close(fd) == 0 && ok;
+  if (ok) ok = rename(tmpPath, path) == 0;
+  if (!ok) unlink(tmpPath);
+  return ok;
+}
+
+bool restoreCompilerSnapshot(Compiler *compiler, const char *path) {
+  auto arena = &compiler->mainAllocator;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+
+  SnapshotHeader header = {};
+  struct stat st = {};
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || fstat(fd, &st) != 0 ||
+      header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION ||
+      header.arenaAddress != (uint64_t)arena->start || arena->current != arena->start ||
+      header.arenaSize > (uint64_t)(arena->end - arena->start) ||
+      header.arenaOffset < sizeof(header) + header.filesCount * sizeof(SnapshotFile) ||
+      header.arenaOffset % 4096 || header.arenaOffset + header.arenaSize != (uint64_t)st.st_size) {
+    close(fd);
+    return false;
+  }
+
+  // Replaces reserved pages of the arena with private copy of the image,
+  // pages are read lazily as restored files are touched
+  auto mappedSize = alignAddressUpwards(header.arenaSize, 4096);
+  if (mappedSize && mmap(arena->start, mappedSize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_FIXED, fd, header.arenaOffset) == MAP_FAILED) {
+    fprintf(stderr, "%s:%d Failed to map snapshot because: %s\n",
+      __FILE__, __LINE__, strerror(errno));
+    abort();
+  }
+  arena->current = arena->start + header.arenaSize;
+  arena->committed = arena->start + mappedSize;
+
+  auto records = ALLOC_ARRAY(SnapshotFile, header.filesCount, arena);
+  auto recordsSize = header.filesCount * sizeof(SnapshotFile);
+  if (pread(fd, records, recordsSize, sizeof(header)) != (ssize_t)recordsSize) {
+    header.filesCount = 0;
+  }
+  close(fd);
+
+  auto globalData = &compiler->globalData;
+  for (uint32_t i = 0; i < header.filesCount; ++i) {
+    auto record = records + i;
+    auto index = addFileEntry(&globalData->files, record->entry);
+    auto slot = fileSlotAt(&globalData->files, index);
+
+    slot->parsedEvent.signaled = true;
+
+    // Slot of file which is gone stays empty, others are checked on visit
+    struct stat fileStat = {};
+    if (!record->ast || stat(record->entry.absolutePath.data, &fileStat) != 0) {
+      slot->entry.content = {};
+      continue;
+    }
+
+    slot->identity.device = fileStat.st_dev;
+    slot->identity.inode = fileStat.st_ino;
+    slot->mtimeSec = record->mtimeSec;
+    slot->mtimeNsec = record->mtimeNsec;
+    slot->size = record->entry.content.len;
+    slot->region = record->region;
+    slot->region.reservoir = arena;
+    slot->region.generation = 0;
+    slot->region.freeBlocks = NULL;
+    slot->ast = record->ast;
+    setFileIdentityIndex(&globalData->loadedFiles, slot->identity, index, arena);
+  }
+  return true;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "compiler.h"
+
+// Snapshot is the used part of the main arena followed by file table roots.
+// Arena lives at fixed address, so pointers in the image stay valid when it
+// is mapped back and unchanged files need neither reading nor parsing.
+//
+// File layout: header, SnapshotFile records, arena (at page aligned offset).
+const uint64_t SNAPSHOT_MAGIC = 0x50414E534E494336ull; // "C6INSNAP"
+const uint32_t SNAPSHOT_VERSION = 1;
+
+struct SnapshotHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t filesCount;
+  uint64_t arenaAddress;
+  uint64_t arenaSize;
+  uint64_t arenaOffset;
+};
+
+struct SnapshotFile {
+  FileEntry entry; // strings point into arena
+  ASTFile *ast; // NULL if file can't be restored (e.g. it came from parse cache)
+  Allocator region;
+
+  // State of the file on disk when it was read
+  int64_t mtimeSec;
+  int64_t mtimeNsec;
+};
+
+// Should be called after compilation finished successfully, while files are
+// still alive. Returns false if snapshot could not be written.
+bool writeCompilerSnapshot(Compiler *compiler, const char *path);
+
+// Called by initCompiler before anything is allocated from the arena. Files
+// keep their indices and ASTs and are reused by compilations like files
+// loaded by earlier ones, so changed files are loaded again when visited.
+// Returns false (leaving compiler untouched) if snapshot is missing or
+// doesn't match.
+bool restoreCompilerSnapshot(Compiler *compiler, const char *path);
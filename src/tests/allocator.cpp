@@ -0,0 +1,211 @@
+#include "../all.h"
+
+TEST(GrowableAllocatorChainsBlocksAndRewinds) (T *t) {
+  size_t reservoirSize = 1024 * 1024;
+  Allocator reservoir = {};
+  initAllocator(&reservoir, (char *)malloc(reservoirSize), reservoirSize);
+
+  Allocator a = {};
+  initGrowableAllocator(&a, &reservoir, 256);
+
+  auto first = ALLOC_ARRAY(char, 100, &a);
+  memset(first, 1, 100);
+  auto firstBlock = a.block;
+  auto position = allocatorPosition(&a);
+
+  // Doesn't fit into first block, nor into default size of the second one
+  auto big = ALLOC_ARRAY(uint64_t, 1000, &a);
+  memset(big, 2, 1000 * sizeof(uint64_t));
+  if (a.block == firstBlock) FAILF("Expected allocator to chain new block\n");
+  if (a.block->prev != firstBlock) FAILF("New block is not linked to the previous one\n");
+  if ((uint64_t)big % alignof(uint64_t)) FAILF("Allocation is not aligned\n");
+
+  auto reservoirUsage = usage(&reservoir);
+  rewindAllocator(&a, position);
+  if (a.block != firstBlock) FAILF("Rewind did not return to the first block\n");
+
+  auto again = ALLOC_ARRAY(char, 100, &a);
+  if (again != first + 100) FAILF("Rewound space is not reused\n");
+
+  // Rewound block is reused instead of taking more memory from reservoir
+  ALLOC_ARRAY(uint64_t, 1000, &a);
+  if (usage(&reservoir) != reservoirUsage) FAILF("Reservoir grew after rewind\n");
+
+  for (int i = 0; i < 100; ++i) {
+    if (first[i] != 1) FAILF("Memory before rewind position was overwritten\n");
+  }
+
+  reset(&a);
+  if (a.block != firstBlock || a.current != a.start) FAILF("Reset did not return to the first block\n");
+}
+
+TEST(VirtualAllocatorCommitsOnDemandAndReleasesOnReset) (T *t) {
+  size_t size = 1024ull * 1024ull * 1024ull;
+  Allocator a = {};
+  initVirtualAllocator(&a, NULL, size, ALLOCATOR_FLAG_HUGE_PAGES);
+
+  if (a.committed != a.start) FAILF("Nothing should be committed before first allocation\n");
+
+  size_t bytes = 3 * 1024 * 1024;
+  auto data = ALLOC_ARRAY(char, bytes, &a);
+  memset(data, 7, bytes);
+  if (a.committed < data + bytes) FAILF("Allocated memory is not committed\n");
+  if (a.committed >= a.end) FAILF("Whole reservation was committed\n");
+
+  reset(&a);
+  if (a.current != a.start) FAILF("Reset did not rewind allocator\n");
+  auto again = ALLOC_ARRAY(char, bytes, &a);
+  if (again != data) FAILF("Memory is not reused after reset\n");
+  if (again[0] != 0 || again[bytes - 1] != 0) FAILF("Pages were not given back on reset\n");
+
+  deinitVirtualAllocator(&a);
+}
+
+struct SharedAllocatorTestThread {
+  Allocator *allocator;
+  uint64_t **pointers;
+  int count;
+  uint64_t id;
+};
+
+void *sharedAllocatorTestThreadProc(void *arg) {
+  auto data = (SharedAllocatorTestThread *)arg;
+  for (int i = 0; i < data->count; ++i) {
+    // Mix small (per-thread chunk) and big (direct) allocations
+    auto n = i % 16 == 0 ? 100 : 1;
+    auto p = ALLOC_ARRAY(uint64_t, n, data->allocator);
+    for (int j = 0; j < n; ++j) p[j] = data->id;
+    data->pointers[i] = p;
+  }
+  return NULL;
+}
+
+TEST(SharedAllocatorHandsOutDisjointMemory) (T *t) {
+  Allocator a = {};
+  initVirtualAllocator(&a, NULL, 1024ull * 1024ull * 1024ull, ALLOCATOR_FLAG_SHARED);
+
+  const int threads = 4;
+  const int count = 10000;
+  SharedAllocatorTestThread data[threads] = {};
+  pthread_t handles[threads] = {};
+  for (int i = 0; i < threads; ++i) {
+    data[i].allocator = &a;
+    data[i].pointers = (uint64_t **)malloc(count * sizeof(uint64_t *));
+    data[i].count = count;
+    data[i].id = i + 1;
+    pthread_create(handles + i, NULL, sharedAllocatorTestThreadProc, data + i);
+  }
+  for (int i = 0; i < threads; ++i) pthread_join(handles[i], NULL);
+
+  for (int i = 0; i < threads; ++i) {
+    for (int j = 0; j < count; ++j) {
+      auto n = j % 16 == 0 ? 100 : 1;
+      for (int k = 0; k < n; ++k) {
+        if (data[i].pointers[j][k] != data[i].id) {
+          FAILF("Allocation %d of thread %d was overwritten\n", j, i);
+        }
+      }
+    }
+    free(data[i].pointers);
+  }
+
+  deinitVirtualAllocator(&a);
+}
+
+TEST(ScratchCheckpointsRewindAndNest) (T *t) {
+  size_t size = 1024 * 1024;
+  Allocator reservoir = {};
+  initAllocator(&reservoir, (char *)malloc(size), size);
+  ThreadData td = {};
+  initThreadData(&td, NULL, &reservoir);
+
+  auto outer = getScratch(&td);
+  {
+    AllocatorCheckpoint checkpoint(outer);
+    auto result = ALLOC_ARRAY(int, 10, outer);
+    {
+      // Callee building result in `outer` gets other scratch allocator
+      auto inner = getScratch(&td, outer);
+      if (inner == outer) FAILF("Nested scratch conflicts with outer one\n");
+      AllocatorCheckpoint innerCheckpoint(inner);
+      ALLOC_ARRAY(int, 100, inner);
+      result[0] = 1;
+    }
+    if (usage(getScratch(&td, outer)) != 0) FAILF("Inner scratch was not rewound\n");
+    if (usage(outer) == 0) FAILF("Outer scratch was rewound too early\n");
+  }
+  if (usage(outer) != 0) FAILF("Outer scratch was not rewound\n");
+}
+
+TEST(NumaLocalAllocatorTakesWholePages) (T *t) {
+  Allocator reservoir = {};
+  initVirtualAllocator(&reservoir, NULL, 64ull * 1024ull * 1024ull, ALLOCATOR_FLAG_SHARED);
+
+  Allocator a = {};
+  initGrowableAllocator(&a, &reservoir, 1000, ALLOCATOR_FLAG_NUMA_LOCAL);
+  ALLOC(int, &reservoir); // misalign reservoir
+  for (int i = 0; i < 3; ++i) {
+    ALLOC_ARRAY(char, 3000, &a);
+    if ((uint64_t)a.block % 4096 || (uint64_t)a.block->end % 4096) {
+      FAILF("Block %d is not page aligned: %p-%p\n", i, a.block, a.block->end);
+    }
+  }
+
+  deinitVirtualAllocator(&reservoir);
+}
+
+TEST(ReleasedBlocksAreReused) (T *t) {
+  Allocator reservoir = {};
+  initVirtualAllocator(&reservoir, NULL, 64ull * 1024ull * 1024ull, ALLOCATOR_FLAG_SHARED);
+
+  Allocator region = {};
+  initGrowableAllocator(&region, &reservoir, 16 * 1024, ALLOCATOR_FLAG_RELEASABLE);
+  auto data = ALLOC_ARRAY(char, 10000, &region);
+  memset(data, 1, 10000);
+  ALLOC_ARRAY(char, 40000, &region);
+  auto reservoirUsage = usage(&reservoir);
+
+  releaseAllocator(&region);
+  if (region.block) FAILF("Released allocator still owns blocks\n");
+  if (!reservoir.freeBlocks) FAILF("Blocks were not returned to reservoir\n");
+
+  Allocator other = {};
+  initGrowableAllocator(&other, &reservoir, 16 * 1024, ALLOCATOR_FLAG_RELEASABLE);
+  auto reused = ALLOC_ARRAY(char, 10000, &other);
+  ALLOC_ARRAY(char, 40000, &other);
+  if (usage(&reservoir) != reservoirUsage) FAILF("Reservoir grew instead of reusing released blocks\n");
+  if (reused[5000] != 0) FAILF("Released pages were not given back\n");
+
+  deinitVirtualAllocator(&reservoir);
+}
+
+TEST(BlocksTooSmallAfterRewindAreKept) (T *t) {
+  Allocator reservoir = {};
+  initVirtualAllocator(&reservoir, NULL, 64ull * 1024ull * 1024ull, ALLOCATOR_FLAG_SHARED);
+
+  Allocator region = {};
+  initGrowableAllocator(&region, &reservoir, 16 * 1024, ALLOCATOR_FLAG_RELEASABLE);
+  ALLOC_ARRAY(char, 10000, &region);
+  auto position = allocatorPosition(&region);
+  ALLOC_ARRAY(char, 10000, &region);
+  auto small = region.block;
+
+  // Second block is left after rewinding but can't fit the next allocation
+  rewindAllocator(&region, position);
+  ALLOC_ARRAY(char, 100000, &region);
+  if (region.block->next != small) FAILF("Block too small for allocation was dropped\n");
+
+  // Once the big block is full, the small one is used again
+  auto reservoirUsage = usage(&reservoir);
+  ALLOC_ARRAY(char, region.end - region.current, &region);
+  ALLOC_ARRAY(char, 10000, &region);
+  if (region.block != small) FAILF("Block too small for earlier allocation was not reused\n");
+  if (usage(&reservoir) != reservoirUsage) FAILF("Reservoir grew instead of reusing the block\n");
+
+  releaseAllocator(&region);
+  uint32_t freeBlocks = 0;
+  for (auto block = reservoir.freeBlocks; block; block = block->next) freeBlocks++;
+  if (freeBlocks != 3) FAILF("Expected 3 blocks returned to reservoir, got %u\n", freeBlocks);
+
+  deinitVirtualAllocator(&reservoir);
+}
@@ -29,3 +29,260 @@ TEST(ASTSafeCastWorks) (T *t) {
     t->Fail();
   }
 }
+
+TEST(ASTCompactionKeepsTreeInPreOrder) (T *t) {
+  char src[] = "S :: struct { a, b : i32; }\nmain :: func(x : i32) { print(\"hi\", x); }\n";
+  Str content = STR(src);
+
+  size_t size = 64 * 1024;
+  GlobalData globalData = {};
+  ThreadData td = {};
+  td.globalData = &globalData;
+  initAllocator(&td.allocator, (char *)malloc(size), size);
+  initAllocator(td.scratch + 0, (char *)malloc(size), size);
+  initAllocator(td.scratch + 1, (char *)malloc(size), size);
+  Lexer lexer = {};
+  lexer.source = content;
+
+  ParsingError error = {};
+  auto file = AST_CAST(ASTFile, parseFile(&td, &lexer, 0, &error));
+  if (!file) FAILF("Failed to parse: %.*s\n", (int)error.message.len, error.message.data);
+
+  Allocator to = {};
+  initAllocator(&to, (char *)malloc(size), size);
+  auto compacted = compactFileAST(file, &content, &to);
+
+  if (content.data == src) FAILF("Source was not copied\n");
+  if ((char *)compacted < content.data + content.len) FAILF("Nodes should follow source\n");
+
+  auto s = AST_ASSERT_CAST(ASTStruct, compacted->topLevelDecls[0]);
+  auto a = s->members[0];
+  auto b = s->members[1];
+  if (a->typeExpr != b->typeExpr) FAILF("Shared type expression was duplicated\n");
+  if (a->parentScope != s) FAILF("parentScope was not relocated\n");
+  if ((char *)a < (char *)s || (char *)b < (char *)a) FAILF("Nodes are not in pre-order\n");
+  if (!StrEqual(a->name->name, STR("a")) || a->name->name.data < content.data ||
+      a->name->name.data >= content.data + content.len) {
+    FAILF("Identifier does not point into copied source\n");
+  }
+
+  auto f = AST_ASSERT_CAST(ASTFunction, compacted->topLevelDecls[1]);
+  auto call = AST_ASSERT_CAST(ASTCall, f->body->statements[0]);
+  if (f->args[0]->parentScope != f) FAILF("Function argument parentScope was not relocated\n");
+  if ((char *)call < (char *)f->body) FAILF("Call should follow function body\n");
+  auto literal = AST_ASSERT_CAST(ASTStringLiteral, call->args[0]);
+  if (!StrEqual(literal->value, STR("hi"))) FAILF("String literal value was lost\n");
+}
+
+TEST(ASTIndexFindsInnermostNode) (T *t) {
+  char src[] = "S :: struct { a, b : i32; }\nmain :: func(x : i32) { y := (x + 1) * 2; }\n";
+  Str content = STR(src);
+
+  size_t size = 64 * 1024;
+  GlobalData globalData = {};
+  ThreadData td = {};
+  td.globalData = &globalData;
+  initAllocator(&td.allocator, (char *)malloc(size), size);
+  initAllocator(td.scratch + 0, (char *)malloc(size), size);
+  initAllocator(td.scratch + 1, (char *)malloc(size), size);
+  Lexer lexer = {};
+  lexer.source = content;
+
+  ParsingError error = {};
+  auto file = AST_CAST(ASTFile, parseFile(&td, &lexer, 0, &error));
+  if (!file) FAILF("Failed to parse: %.*s\n", (int)error.message.len, error.message.data);
+
+  ASTIndex index = {};
+  buildASTIndex(&index, file, &td.allocator, td.scratch + 0);
+
+  struct {
+    const char *at;
+    ASTNodeType type;
+    ASTNodeType parentType;
+  } cases[] = {
+    {"S ::", ASTIdentifier_, ASTStruct_},
+    {"b :", ASTIdentifier_, ASTVar_},
+    {"i32; }", ASTIdentifier_, ASTVar_},
+    {"x :", ASTIdentifier_, ASTVar_},
+    {"x +", ASTIdentifier_, ASTBinaryOp_},
+    {"+ 1", ASTBinaryOp_, ASTBinaryOp_},
+    {"* 2", ASTBinaryOp_, ASTVariableDefinition_},
+    {"y :=", ASTIdentifier_, ASTVariableDefinition_},
+  };
+  for (auto &c : cases) {
+    auto offset = (uint32_t)(strstr(src, c.at) - src);
+    auto found = innermostASTNodeAt(&index, offset);
+    if (found == AST_INDEX_NONE) FAILF("No node at '%s'\n", c.at);
+    auto node = index.nodes[found];
+    if (node.node->type != c.type || node.node->offset0 > offset || node.node->offset1 <= offset) {
+      FAILF("At '%s' want %s got %s [%u, %u)\n", c.at, toString(c.type), toString(node.node->type),
+            node.node->offset0, node.node->offset1);
+    }
+    if (node.parent == AST_INDEX_NONE || index.nodes[node.parent].node->type != c.parentType) {
+      FAILF("At '%s' want parent %s\n", c.at, toString(c.parentType));
+    }
+  }
+  // Between declarations only the file covers the source
+  auto newline = (uint32_t)(strchr(src, '\n') - src);
+  if (innermostASTNodeAt(&index, newline) != AST_INDEX_NONE) FAILF("Newline should have no node\n");
+  if (innermostASTNodeAt(&index, content.len) != AST_INDEX_NONE) FAILF("End should have no node\n");
+}
+
+struct ASTWalkTestData {
+  Array<AST *> pre;
+  Array<AST *> post;
+  Allocator *allocator;
+};
+
+ASTWalkResult astWalkTestPre(ASTWalker *walker, AST *node) {
+  auto data = static_cast<ASTWalkTestData *>(walker->userData);
+  append(&data->pre, node, data->allocator);
+  return node->type == ASTBlock_ ? AST_WALK_SKIP_CHILDREN : AST_WALK_CONTINUE;
+}
+
+ASTWalkResult astWalkTestPost(ASTWalker *walker, AST *node) {
+  auto data = static_cast<ASTWalkTestData *>(walker->userData);
+  append(&data->post, node, data->allocator);
+  return AST_WALK_CONTINUE;
+}
+
+TEST(ASTWalkerVisitsChildrenInFieldOrder) (T *t) {
+  size_t size = 64 * 1024;
+  Allocator a = {};
+  initAllocator(&a, (char *)malloc(size), size);
+  Allocator scratch = {};
+  initAllocator(&scratch, (char *)malloc(size), size);
+
+  // f :: func(x : i32) { ... }
+  auto name = AST_ALLOC(ASTIdentifier, &a);
+  auto arg = AST_ALLOC(ASTVar, &a);
+  arg->name = AST_ALLOC(ASTIdentifier, &a);
+  arg->typeExpr = AST_ALLOC(ASTIdentifier, &a);
+  auto body = AST_ALLOC(ASTBlock, &a);
+  append(&body->statements, (AST *)AST_ALLOC(ASTNumberLiteral, &a), &a);
+  auto f = AST_ALLOC(ASTFunction, &a);
+  f->name = name;
+  append(&f->args, arg, &a);
+  f->body = body;
+  arg->parentScope = f;
+
+  ASTWalkTestData data = {};
+  data.allocator = &a;
+  ASTWalker walker = {};
+  walker.pre = astWalkTestPre;
+  walker.post = astWalkTestPost;
+  walker.userData = &data;
+  if (!walkAST(&walker, f, &scratch)) FAILF("Walk was stopped\n");
+
+  AST *wantPre[] = {f, name, arg, arg->name, arg->typeExpr, body};
+  AST *wantPost[] = {name, arg->name, arg->typeExpr, arg, body, f};
+  if (data.pre.len != 6 || data.post.len != 6) {
+    FAILF("Unexpected number of visits: pre %u, post %u\n", data.pre.len, data.post.len);
+  }
+  for (int i = 0; i < 6; ++i) {
+    if (data.pre[i] != wantPre[i]) FAILF("Pre-order #%d: got %s\n", i, toString(data.pre[i]->type));
+    if (data.post[i] != wantPost[i]) FAILF("Post-order #%d: got %s\n", i, toString(data.post[i]->type));
+  }
+  if (usage(&scratch) != 0) FAILF("Walker stack was not freed\n");
+}
+
+AST *sharedTypeOf(ASTVar *var) {
+  return AST_ASSERT_CAST(ASTTypeUse, var->typeExpr)->type;
+}
+
+TEST(ASTHashIgnoresPositionAndHashConsSharesTypes) (T *t) {
+  char src[] = "S :: struct { a : *u8; b : i32; }\n"
+               "f :: func(a : *u8, b : i32) { }\n"
+               "f :: func(a : *u8, b : i32) { }\n";
+  Str content = STR(src);
+
+  size_t size = 64 * 1024;
+  GlobalData globalData = {};
+  ThreadData td = {};
+  td.globalData = &globalData;
+  initAllocator(&td.allocator, (char *)malloc(size), size);
+  initAllocator(td.scratch + 0, (char *)malloc(size), size);
+  initAllocator(td.scratch + 1, (char *)malloc(size), size);
+  Lexer lexer = {};
+  lexer.source = content;
+
+  ParsingError error = {};
+  auto file = AST_CAST(ASTFile, parseFile(&td, &lexer, 0, &error));
+  if (!file) FAILF("Failed to parse: %.*s\n", (int)error.message.len, error.message.data);
+
+  hashAST(file, NULL, td.scratch + 0);
+  auto s = AST_ASSERT_CAST(ASTStruct, file->topLevelDecls[0]);
+  auto f0 = AST_ASSERT_CAST(ASTFunction, file->topLevelDecls[1]);
+  auto f1 = AST_ASSERT_CAST(ASTFunction, file->topLevelDecls[2]);
+  if (!file->hash || !s->hash) FAILF("Nodes were not hashed\n");
+  if (f0->hash != f1->hash) FAILF("Same functions at different offsets hash differently\n");
+  if (s->members[0]->hash != f0->args[0]->hash) FAILF("Same members hash differently\n");
+  if (s->members[0]->typeExpr->hash == s->members[1]->typeExpr->hash) {
+    FAILF("*u8 and i32 hash the same\n");
+  }
+  if (s->members[0]->typeExpr == f0->args[0]->typeExpr) FAILF("Types shared without table\n");
+
+  auto fileHash = file->hash;
+  ASTHashConsTable table;
+  initASTHashConsTable(&table, &td.allocator, &td.allocator);
+  hashAST(file, &table, td.scratch + 0);
+  if (sharedTypeOf(s->members[0]) != sharedTypeOf(f0->args[0]) ||
+      sharedTypeOf(s->members[0]) != sharedTypeOf(f1->args[0]) ||
+      sharedTypeOf(s->members[1]) != sharedTypeOf(f1->args[1])) {
+    FAILF("Equal type expressions were not shared\n");
+  }
+  if (file->hash != fileHash) FAILF("Hash-consing changed hash of the file\n");
+  // Both *u8 and u8 inside of it, and i32, are dropped twice
+  if (table.interned != 6) FAILF("Unexpected number of interned nodes: %u\n", table.interned);
+  if (internAST(&table, s->members[0]) != s->members[0]) FAILF("Node with refs was interned\n");
+  if (usage(td.scratch + 0) != 0) FAILF("Walker stack was not freed\n");
+}
+
+TEST(HashConsKeepsPositionOfEveryTypeUse) (T *t) {
+  char src[] = "f :: func(a : *u8) { }\n"
+               "g :: func(b : *u8) { }\n";
+  Str content = STR(src);
+
+  size_t size = 64 * 1024;
+  GlobalData globalData = {};
+  ThreadData td = {};
+  td.globalData = &globalData;
+  initAllocator(&td.allocator, (char *)malloc(size), size);
+  initAllocator(td.scratch + 0, (char *)malloc(size), size);
+  initAllocator(td.scratch + 1, (char *)malloc(size), size);
+  Lexer lexer = {};
+  lexer.source = content;
+
+  ParsingError error = {};
+  auto file = AST_CAST(ASTFile, parseFile(&td, &lexer, 0, &error));
+  if (!file) FAILF("Failed to parse: %.*s\n", (int)error.message.len, error.message.data);
+
+  auto f = AST_ASSERT_CAST(ASTFunction, file->topLevelDecls[0]);
+  auto g = AST_ASSERT_CAST(ASTFunction, file->topLevelDecls[1]);
+  // Unary operator spans its operator token
+  uint32_t fOffset = strstr(src, "*u8") - src;
+  uint32_t gOffset = strstr(src + fOffset + 1, "*u8") - src;
+  if (f->args[0]->typeExpr->offset0 != fOffset || g->args[0]->typeExpr->offset0 != gOffset) {
+    FAILF("Unexpected offsets of parsed type expressions\n");
+  }
+  auto fEnd = f->args[0]->typeExpr->offset1;
+  auto gEnd = g->args[0]->typeExpr->offset1;
+
+  ASTHashConsTable table;
+  initASTHashConsTable(&table, td.scratch + 1, &td.allocator);
+  hashAST(file, &table, td.scratch + 0);
+
+  auto fType = AST_CAST(ASTTypeUse, f->args[0]->typeExpr);
+  auto gType = AST_CAST(ASTTypeUse, g->args[0]->typeExpr);
+  if (!fType || !gType) FAILF("Type expressions were not replaced with uses\n");
+  if (fType->type != gType->type) FAILF("Equal type expressions were not shared\n");
+
+  if (fType->offset0 != fOffset || fType->offset1 != fEnd) {
+    FAILF("First use is at [%u, %u), expected [%u, %u)\n",
+          fType->offset0, fType->offset1, fOffset, fEnd);
+  }
+  if (gType->offset0 != gOffset || gType->offset1 != gEnd) {
+    FAILF("Second use is at [%u, %u), expected [%u, %u)\n",
+          gType->offset0, gType->offset1, gOffset, gEnd);
+  }
+}
@@ -4,21 +4,671 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <stddef.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
 
 TEST(CompilerSmokeTest) (T *t) {
   Compiler compiler;
   const char *entry = ".unittest.c6";
 
-  auto fd = open(entry, O_TRUNC | O_WRONLY);
+  auto fd = open(entry, O_CREAT | O_TRUNC | O_WRONLY, 0644);
   auto content = STR("main :: func() { print(\"Hello world\\n\"); }");
   write(fd, content.data, content.len);
   close(fd);
 
 
-  initCompiler(&compiler, 1, entry);
+  CompilerOptions options = {};
+  options.threads = 1;
+  options.entryPoint = entry;
+  initCompiler(&compiler, options);
   auto status = waitForCompilerToFinish(&compiler);
   deinitCompiler(&compiler);
 
   unlink(entry);
   if (status != 0) FAILF("Unexpected exit status: %d\n", status);
 }
+
+TEST(CompilerReportsParsingError) (T *t) {
+  Compiler compiler;
+  const char *entry = ".unittest.c6";
+
+  auto fd = open(entry, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  auto content = STR("main :: func() { print(\"Hello world\\n\"; }");
+  write(fd, content.data, content.len);
+  close(fd);
+
+  CompilerOptions options = {};
+  options.threads = 1;
+  options.entryPoint = entry;
+  initCompiler(&compiler, options);
+  auto status = waitForCompilerToFinish(&compiler);
+  auto slot = fileSlotAt(&compiler.globalData.files, 0);
+  auto regionReleased = !slot->region.block && !slot->entry.content.data;
+  deinitCompiler(&compiler);
+
+  unlink(entry);
+  if (status != 1) FAILF("Unexpected exit status: %d\n", status);
+  if (!regionReleased) FAILF("Memory of file which failed to parse was not released\n");
+}
+
+TEST(CompilerReportsMissingFile) (T *t) {
+  Compiler compiler;
+
+  CompilerOptions options = {};
+  options.threads = 1;
+  options.entryPoint = ".unittest-does-not-exist.c6";
+  initCompiler(&compiler, options);
+  auto status = waitForCompilerToFinish(&compiler);
+  deinitCompiler(&compiler);
+
+  if (status != 1) FAILF("Unexpected exit status: %d\n", status);
+}
+
+void writeTestFile(const char *name, Str content) {
+  auto fd = open(name, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  write(fd, content.data, content.len);
+  close(fd);
+}
+
+TEST(CompilerLoadsEveryFileOnce) (T *t) {
+  Compiler compiler;
+
+  // a -> b, c; b -> d; c -> d (through symlink and plain path); d -> a
+  writeTestFile(".unittest-a.c6", STR("#load \".unittest-b.c6\"\n#load \"./.unittest-c.c6\"\n"));
+  writeTestFile(".unittest-b.c6", STR("#load \".unittest-d.c6\"\nb :: 1;\n"));
+  writeTestFile(".unittest-c.c6", STR("#load \".unittest-e.c6\"\n#load \".//.unittest-d.c6\"\nc :: 2;\n"));
+  writeTestFile(".unittest-d.c6", STR("#load \".unittest-a.c6\"\nd :: 3;\n"));
+  unlink(".unittest-e.c6");
+  symlink(".unittest-d.c6", ".unittest-e.c6");
+
+  CompilerOptions options = {};
+  options.threads = 2;
+  options.entryPoint = ".unittest-a.c6";
+  initCompiler(&compiler, options);
+  auto status = waitForCompilerToFinish(&compiler);
+  auto loadedFilesCount = filesCount(&compiler.globalData.files);
+  deinitCompiler(&compiler);
+
+  unlink(".unittest-a.c6");
+  unlink(".unittest-b.c6");
+  unlink(".unittest-c.c6");
+  unlink(".unittest-d.c6");
+  unlink(".unittest-e.c6");
+
+  if (status != 0) FAILF("Unexpected exit status: %d\n", status);
+  if (loadedFilesCount != 4) FAILF("Expected 4 files to be loaded, got %u\n", loadedFilesCount);
+}
+
+TEST(CompilerReportsMissingLoadedFile) (T *t) {
+  Compiler compiler;
+
+  writeTestFile(".unittest.c6", STR("#load \".unittest-does-not-exist.c6\"\n"));
+
+  CompilerOptions options = {};
+  options.threads = 1;
+  options.entryPoint = ".unittest.c6";
+  initCompiler(&compiler, options);
+  auto status = waitForCompilerToFinish(&compiler);
+  deinitCompiler(&compiler);
+
+  unlink(".unittest.c6");
+  if (status != 1) FAILF("Unexpected exit status: %d\n", status);
+}
+
+// io_uring_setup fails with ENOSYS, as on kernels without io_uring
+bool disableIOUring() {
+  struct sock_filter filter[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_io_uring_setup, 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | ENOSYS),
+    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+  };
+  struct sock_fprog program = {sizeof(filter) / sizeof(filter[0]), filter};
+  return prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == 0 &&
+         prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &program) == 0;
+}
+
+// Compiles entry in a child process, which writes its errors to errorsPath.
+// Returns exit status of the compilation, -1 if the child failed.
+int compileInChildProcess(const char *entry, bool withoutIOUring, const char *errorsPath) {
+  auto pid = fork();
+  if (pid == 0) {
+    auto fd = open(errorsPath, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    dup2(fd, 2);
+    close(fd);
+    if (withoutIOUring && !disableIOUring()) _exit(100);
+
+    CompilerOptions options = {};
+    options.threads = 1;
+    options.entryPoint = entry;
+    Compiler compiler;
+    initCompiler(&compiler, options);
+    auto status = waitForCompilerToFinish(&compiler);
+    deinitCompiler(&compiler);
+    _exit(status);
+  }
+  int childStatus = 0;
+  if (pid < 0 || waitpid(pid, &childStatus, 0) != pid || !WIFEXITED(childStatus)) return -1;
+  auto status = WEXITSTATUS(childStatus);
+  return status == 100 ? -1 : status;
+}
+
+TEST(CompilerLoadsFilesSameWayWithoutIOUring) (T *t) {
+  auto fd = open(".unittest.c6", O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  // Error shows the line, so content read both ways is compared too
+  auto content = STR("main :: func() { x := ; }\n");
+  write(fd, content.data, content.len);
+  close(fd);
+
+  const char *entries[] = {".unittest.c6", ".unittest-does-not-exist.c6"};
+  for (auto entry : entries) {
+    // First run uses io_uring where available, second one always reads blocking
+    int status[2] = {};
+    char *errors[2] = {};
+    for (int blocking = 0; blocking < 2; ++blocking) {
+      status[blocking] = compileInChildProcess(entry, blocking, ".unittest-errors");
+      auto file = fopen(".unittest-errors", "r");
+      size_t len = 0;
+      if (file) getdelim(errors + blocking, &len, '\0', file);
+      if (file) fclose(file);
+    }
+    unlink(".unittest-errors");
+
+    bool sameErrors = errors[0] && errors[1] && strcmp(errors[0], errors[1]) == 0;
+    bool reported = errors[1] && strstr(errors[1], entry == entries[0] ? "x := ; }" : entry);
+    free(errors[0]);
+    free(errors[1]);
+    if (status[0] != 1 || status[1] != 1) {
+      unlink(".unittest.c6");
+      FAILF("Unexpected exit statuses for %s: %d %d\n", entry, status[0], status[1]);
+    }
+    if (!reported || !sameErrors) {
+      unlink(".unittest.c6");
+      FAILF("Errors for %s differ without io_uring\n", entry);
+    }
+  }
+  unlink(".unittest.c6");
+}
+
+// Compiler without threads, tests drive its job graph by hand
+void initJobGraphTestCompiler(Compiler *compiler) {
+  *compiler = {};
+  initAllocator(&compiler->mainAllocator, (char *)malloc(4096), 4096);
+  pthread_mutex_init(&compiler->jobQueueMutex, NULL);
+  pthread_cond_init(&compiler->jobQueueCond, NULL);
+  pthread_cond_init(&compiler->compilerFinishedCond, NULL);
+}
+
+void deinitJobGraphTestCompiler(Compiler *compiler) {
+  pthread_mutex_destroy(&compiler->jobQueueMutex);
+  pthread_cond_destroy(&compiler->jobQueueCond);
+  pthread_cond_destroy(&compiler->compilerFinishedCond);
+  free(compiler->mainAllocator.start);
+}
+
+TEST(CompilerWaitsForContinuations) (T *t) {
+  Compiler compiler;
+  initJobGraphTestCompiler(&compiler);
+
+  CompilerJob root = {};
+  CompilerJob child = {};
+  CompilerJob continuation = {};
+  CompilerJob *jobs[] = {&root, &child, &continuation};
+  for (auto job : jobs) {
+    job->unfinishedJobs = 1;
+    job->unfinishedDependencies = 1;
+  }
+  compiler.rootJob = &root;
+
+  // Root returns before child, continuation is posted after that
+  spawnChildJob(&compiler, &root, &child);
+  addContinuation(&child, &continuation);
+  postCompilerJob(&compiler, &continuation);
+  finishJob(&compiler, &root);
+  auto postedBeforeChild = compiler.jobQueue.len;
+  finishJob(&compiler, &child);
+  auto finishedBeforeContinuation = compiler.compilerFinished;
+  auto posted = compiler.jobQueue.len;
+  finishJob(&compiler, &continuation);
+  auto finished = compiler.compilerFinished;
+
+  deinitJobGraphTestCompiler(&compiler);
+
+  if (postedBeforeChild != 1) FAILF("Continuation was posted before child finished\n");
+  if (posted != 2) FAILF("Continuation wasn't posted\n");
+  if (finishedBeforeContinuation) FAILF("Compilation finished before continuation ran\n");
+  if (!finished) FAILF("Compilation didn't finish after continuation\n");
+}
+
+TEST(CompilerDispatchesJobsByPriorityThenSequence) (T *t) {
+  Compiler compiler;
+  initJobGraphTestCompiler(&compiler);
+
+  int priorities[6] = {1, 5, 1, 3, 5, 0};
+  CompilerJob jobs[6] = {};
+  for (uint32_t i = 0; i < 6; ++i) {
+    jobs[i].priority = priorities[i];
+    jobs[i].unfinishedJobs = 1;
+    jobs[i].unfinishedDependencies = 1;
+    postCompilerJob(&compiler, jobs + i);
+  }
+
+  // Equal priorities run in the order they were posted
+  uint32_t expected[6] = {1, 4, 3, 0, 2, 5};
+  uint32_t order[6] = {};
+  for (uint32_t i = 0; i < 6; ++i) {
+    order[i] = heapPop(&compiler.jobQueue, compilerJobLess) - jobs;
+  }
+  deinitJobGraphTestCompiler(&compiler);
+
+  for (uint32_t i = 0; i < 6; ++i) {
+    if (order[i] != expected[i]) {
+      FAILF("Job %u dispatched at position %u, expected job %u\n",
+            order[i], i, expected[i]);
+    }
+  }
+}
+
+TEST(CompilerParsesDeeplyNestedExpressions) (T *t) {
+  Compiler compiler;
+  const char *entry = ".unittest.c6";
+
+  // Parser recursion of a job runs on its fiber stack
+  auto fd = open(entry, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  auto header = STR("main :: func() { x := ");
+  write(fd, header.data, header.len);
+  for (int i = 0; i < 1000; ++i) write(fd, "(", 1);
+  write(fd, "1", 1);
+  for (int i = 0; i < 1000; ++i) write(fd, ")", 1);
+  write(fd, "; }", 3);
+  close(fd);
+
+  CompilerOptions options = {};
+  options.threads = 1;
+  options.entryPoint = entry;
+  initCompiler(&compiler, options);
+  auto status = waitForCompilerToFinish(&compiler);
+  deinitCompiler(&compiler);
+
+  unlink(entry);
+  if (status != 0) FAILF("Unexpected exit status: %d\n", status);
+}
+
+TEST(CompilerCancelsRemainingWorkOnError) (T *t) {
+  writeTestFile(".unittest.c6", STR("#load \".unittest-does-not-exist.c6\"\n#load \".unittest-b.c6\"\n"));
+  writeTestFile(".unittest-b.c6", STR("b :: 1;\n"));
+
+  uint32_t loadedFilesCount[2] = {};
+  int status[2] = {};
+  for (int keepGoing = 0; keepGoing < 2; ++keepGoing) {
+    CompilerOptions options = {};
+    options.threads = 1;
+    options.entryPoint = ".unittest.c6";
+    options.keepGoing = (bool)keepGoing;
+    Compiler compiler;
+    initCompiler(&compiler, options);
+    status[keepGoing] = waitForCompilerToFinish(&compiler);
+    loadedFilesCount[keepGoing] = filesCount(&compiler.globalData.files);
+    deinitCompiler(&compiler);
+  }
+
+  unlink(".unittest.c6");
+  unlink(".unittest-b.c6");
+
+  if (status[0] != 1) FAILF("Unexpected exit status: %d\n", status[0]);
+  if (status[1] != 1) FAILF("Unexpected exit status with keepGoing: %d\n", status[1]);
+  if (loadedFilesCount[0] != 1) FAILF("Expected 1 file to be loaded, got %u\n", loadedFilesCount[0]);
+  if (loadedFilesCount[1] != 2) FAILF("Expected 2 files to be loaded with keepGoing, got %u\n", loadedFilesCount[1]);
+}
+
+TEST(CompilerParsesFileLargerThanThreadBlock) (T *t) {
+  Compiler compiler;
+
+  auto fd = open(".unittest.c6", O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  for (int i = 0; i < 20000; ++i) {
+    char line[64];
+    auto len = snprintf(line, sizeof(line), "f%d :: func() { x := %d; }\n", i, i);
+    write(fd, line, len);
+  }
+  close(fd);
+
+  CompilerOptions options = {};
+  options.threads = 1;
+  options.entryPoint = ".unittest.c6";
+  initCompiler(&compiler, options);
+  auto status = waitForCompilerToFinish(&compiler);
+  deinitCompiler(&compiler);
+
+  unlink(".unittest.c6");
+  if (status != 0) FAILF("Unexpected exit status: %d\n", status);
+}
+
+TEST(CompilerStartsWorkersOnlyForBacklog) (T *t) {
+  Compiler compiler;
+
+  writeTestFile(".unittest.c6", STR("main :: func() { x := 1; }\n"));
+
+  CompilerOptions options = {};
+  options.threads = 8;
+  options.entryPoint = ".unittest.c6";
+  initCompiler(&compiler, options);
+  auto status = waitForCompilerToFinish(&compiler);
+  auto workers = compiler.allocatedWorkers;
+  deinitCompiler(&compiler);
+
+  unlink(".unittest.c6");
+  if (status != 0) FAILF("Unexpected exit status: %d\n", status);
+  if (workers != 1) FAILF("Single file compile should use 1 worker, used %d\n", workers);
+}
+
+struct CachedCompileResult {
+  int status;
+  bool mapped[2];
+  uint32_t declsCount[2];
+};
+
+CachedCompileResult compileWithCache(const char *entry) {
+  CompilerOptions options = {};
+  options.threads = 1;
+  options.entryPoint = entry;
+  options.cacheDirectory = ".unittest-cache";
+  Compiler compiler;
+  initCompiler(&compiler, options);
+  CachedCompileResult result = {};
+  result.status = waitForCompilerToFinish(&compiler);
+  for (uint32_t i = 0; i < 2 && i < filesCount(&compiler.globalData.files); ++i) {
+    auto slot = fileSlotAt(&compiler.globalData.files, i);
+    result.mapped[i] = slot->image != NULL;
+    if (slot->ast) {
+      result.declsCount[i] = slot->ast->topLevelDecls.len;
+      if (slot->ast->topLevelDecls.len && slot->ast->topLevelDecls[0]->fileIndex != i) {
+        result.status = -1;
+      }
+    }
+  }
+  deinitCompiler(&compiler);
+  return result;
+}
+
+TEST(CompilerReusesCachedASTOfUnchangedFiles) (T *t) {
+  auto a = STR("#load \".unittest-b.c6\"\nmain :: func(x : *u8) { print(\"a\", x); }\n");
+  auto b = STR("S :: struct { a, b : i32; }\nf :: func() { }\n");
+  writeTestFile(".unittest-a.c6", a);
+  writeTestFile(".unittest-b.c6", b);
+  char pathA[64], pathB[64];
+  snprintf(pathA, sizeof(pathA), ".unittest-cache/%016" PRIx64 ".ast", astCacheKey(a, 0));
+  snprintf(pathB, sizeof(pathB), ".unittest-cache/%016" PRIx64 ".ast", astCacheKey(b, 0));
+  unlink(pathA);
+  unlink(pathB);
+
+  auto cold = compileWithCache(".unittest-a.c6");
+  auto written = access(pathA, F_OK) == 0 && access(pathB, F_OK) == 0;
+  auto warm = compileWithCache(".unittest-a.c6");
+
+  // Truncated image is a miss, file is parsed again
+  struct stat st = {};
+  stat(pathB, &st);
+  truncate(pathB, st.st_size - 4);
+  auto damaged = compileWithCache(".unittest-a.c6");
+
+  unlink(pathA);
+  unlink(pathB);
+  rmdir(".unittest-cache");
+  unlink(".unittest-a.c6");
+  unlink(".unittest-b.c6");
+
+  if (cold.status != 0 || warm.status != 0 || damaged.status != 0) {
+    FAILF("Unexpected exit statuses: %d %d %d\n", cold.status, warm.status, damaged.status);
+  }
+  if (!written) FAILF("Cache files were not written\n");
+  if (cold.mapped[0] || cold.mapped[1]) FAILF("Nothing should be mapped on cold run\n");
+  if (!warm.mapped[0] || !warm.mapped[1]) FAILF("Unchanged files were parsed again\n");
+  if (warm.declsCount[0] != 2 || warm.declsCount[1] != 2) {
+    FAILF("Unexpected cached declarations: %u %u\n", warm.declsCount[0], warm.declsCount[1]);
+  }
+  if (!damaged.mapped[0] || damaged.mapped[1]) FAILF("Damaged image should not be used\n");
+}
+
+TEST(CompilerRestoresSnapshotAndReloadsChangedFiles) (T *t) {
+  writeTestFile(".unittest-a.c6", STR("#load \".unittest-b.c6\"\nmain :: func() { }\n"));
+  writeTestFile(".unittest-b.c6", STR("b :: 1;\n"));
+
+  CompilerOptions options = {};
+  options.threads = 1;
+  options.entryPoint = ".unittest-a.c6";
+  Compiler compiler;
+  initCompiler(&compiler, options);
+  auto coldStatus = waitForCompilerToFinish(&compiler);
+  auto written = writeCompilerSnapshot(&compiler, ".unittest.snapshot");
+  deinitCompiler(&compiler);
+
+  writeTestFile(".unittest-b.c6", STR("b :: 1;\nc :: 2;\n"));
+
+  options = {};
+  options.threads = 1;
+  options.entryPoint = ".unittest-a.c6";
+  options.restoreSnapshot = ".unittest.snapshot";
+  initCompiler(&compiler, options);
+  auto warmStatus = waitForCompilerToFinish(&compiler);
+  auto files = &compiler.globalData.files;
+  auto count = filesCount(files);
+  auto restored = count == 3 ? fileSlotAt(files, 0)->ast : NULL;
+  auto staleSlotEmpty = count == 3 && !fileSlotAt(files, 1)->ast;
+  auto reloaded = count == 3 ? fileSlotAt(files, 2)->ast : NULL;
+  auto restoredDecls = restored ? restored->topLevelDecls.len : 0;
+  auto reloadedDecls = reloaded ? reloaded->topLevelDecls.len : 0;
+  deinitCompiler(&compiler);
+
+  unlink(".unittest.snapshot");
+  unlink(".unittest-a.c6");
+  unlink(".unittest-b.c6");
+
+  if (coldStatus != 0 || warmStatus != 0) {
+    FAILF("Unexpected exit statuses: %d %d\n", coldStatus, warmStatus);
+  }
+  if (!written) FAILF("Snapshot was not written\n");
+  if (count != 3) FAILF("Expected 2 restored files and 1 reloaded, got %u files\n", count);
+  if (restoredDecls != 2) FAILF("Restored AST has %u declarations\n", restoredDecls);
+  if (!staleSlotEmpty) FAILF("Changed file was restored\n");
+  if (reloadedDecls != 2) FAILF("Changed file was not loaded again\n");
+}
+
+TEST(CompilerReusesUnchangedFilesAcrossCompilations) (T *t) {
+  writeTestFile(".unittest-a.c6", STR("#load \".unittest-b.c6\"\nmain :: func() { }\n"));
+  writeTestFile(".unittest-b.c6", STR("b :: 1;\n"));
+
+  Compiler compiler;
+  auto files = &compiler.globalData.files;
+  CompilerOptions options = {};
+  options.threads = 1;
+  options.entryPoint = ".unittest-a.c6";
+  initCompiler(&compiler, options);
+  auto firstStatus = waitForCompilerToFinish(&compiler);
+  auto firstAST = fileSlotAt(files, 0)->ast;
+
+  // Same content with new modification time is not parsed again
+  utimensat(AT_FDCWD, ".unittest-b.c6", NULL, 0);
+  startCompilation(&compiler, ".unittest-a.c6");
+  auto touchedStatus = waitForCompilerToFinish(&compiler);
+  auto touchedCount = filesCount(files);
+
+  writeTestFile(".unittest-b.c6", STR("b :: 1;\nc :: 2;\n"));
+  startCompilation(&compiler, ".unittest-a.c6");
+  auto editedStatus = waitForCompilerToFinish(&compiler);
+  auto editedCount = filesCount(files);
+  auto reused = fileSlotAt(files, 0)->ast == firstAST;
+  auto oldReleased = !fileSlotAt(files, 1)->ast;
+  auto reloaded = editedCount == 3 ? fileSlotAt(files, 2)->ast : NULL;
+  auto reloadedDecls = reloaded ? reloaded->topLevelDecls.len : 0;
+  // Path of the previous version is reused, not copied again
+  auto samePath = editedCount == 3 &&
+                  fileEntryAt(files, 2)->absolutePath.data == fileEntryAt(files, 1)->absolutePath.data;
+
+  // Errors are reported again by every compilation
+  writeTestFile(".unittest-b.c6", STR("b :: ;\n"));
+  startCompilation(&compiler, ".unittest-a.c6");
+  auto brokenStatus = waitForCompilerToFinish(&compiler);
+  startCompilation(&compiler, ".unittest-a.c6");
+  auto stillBrokenStatus = waitForCompilerToFinish(&compiler);
+  deinitCompiler(&compiler);
+
+  unlink(".unittest-a.c6");
+  unlink(".unittest-b.c6");
+
+  if (firstStatus != 0 || touchedStatus != 0 || editedStatus != 0) {
+    FAILF("Unexpected exit statuses: %d %d %d\n", firstStatus, touchedStatus, editedStatus);
+  }
+  if (touchedCount != 2) FAILF("Touched file was loaded again\n");
+  if (editedCount != 3) FAILF("Expected only edited file to be loaded again, have %u files\n", editedCount);
+  if (!reused) FAILF("Unchanged file was parsed again\n");
+  if (!oldReleased) FAILF("Old version of edited file was not released\n");
+  if (reloadedDecls != 2) FAILF("Edited file has %u declarations\n", reloadedDecls);
+  if (!samePath) FAILF("Path of edited file was copied again\n");
+  if (brokenStatus != 1 || stillBrokenStatus != 1) {
+    FAILF("Broken file should fail every time: %d %d\n", brokenStatus, stillBrokenStatus);
+  }
+}
+
+TEST(CompilerReparsesEditedFilesWithHashConsedTypes) (T *t) {
+  writeTestFile(".unittest-a.c6", STR("#load \".unittest-b.c6\"\nmain :: func() { }\n"));
+  writeTestFile(".unittest-b.c6", STR("b :: 1;\ns :: struct { x, y : *u8; }\nf :: func(p : *u8) { }\n"));
+
+  CompilerOptions options = {};
+  options.threads = 1;
+  options.entryPoint = ".unittest-a.c6";
+  options.hashConsTypes = true;
+  Compiler compiler;
+  auto files = &compiler.globalData.files;
+  initCompiler(&compiler, options);
+  auto firstStatus = waitForCompilerToFinish(&compiler);
+
+  // Declarations after the edit are reused with their positions shifted
+  char edited[] = "b :: 12345;\ns :: struct { x, y : *u8; }\nf :: func(p : *u8) { }\n";
+  writeTestFile(".unittest-b.c6", STR(edited));
+  startCompilation(&compiler, ".unittest-a.c6");
+  auto editedStatus = waitForCompilerToFinish(&compiler);
+  auto editedCount = filesCount(files);
+  auto reloaded = editedCount == 3 ? fileSlotAt(files, 2)->ast : NULL;
+
+  uint32_t offsets[3] = {};
+  bool shared = false;
+  if (reloaded && reloaded->topLevelDecls.len == 3) {
+    auto s = AST_ASSERT_CAST(ASTStruct, reloaded->topLevelDecls[1]);
+    auto f = AST_ASSERT_CAST(ASTFunction, reloaded->topLevelDecls[2]);
+    auto x = AST_CAST(ASTTypeUse, s->members[0]->typeExpr);
+    auto y = AST_CAST(ASTTypeUse, s->members[1]->typeExpr);
+    auto p = AST_CAST(ASTTypeUse, f->args[0]->typeExpr);
+    if (x && y && p) {
+      offsets[0] = x->offset0;
+      offsets[1] = y->offset0;
+      offsets[2] = p->offset0;
+      shared = x->type == p->type;
+    }
+  }
+  deinitCompiler(&compiler);
+
+  unlink(".unittest-a.c6");
+  unlink(".unittest-b.c6");
+
+  if (firstStatus != 0 || editedStatus != 0) {
+    FAILF("Unexpected exit statuses: %d %d\n", firstStatus, editedStatus);
+  }
+  if (!reloaded) FAILF("Edited file was not loaded again\n");
+  if (!shared) FAILF("Types of reused declarations are not hash-consed\n");
+  // Unary operator spans its operator token
+  uint32_t xOffset = strstr(edited, "*u8") - edited;
+  uint32_t pOffset = strstr(edited + xOffset + 1, "*u8") - edited;
+  if (offsets[0] != xOffset || offsets[1] != xOffset || offsets[2] != pOffset) {
+    FAILF("Types are at %u, %u and %u, expected %u, %u and %u\n", offsets[0], offsets[1],
+          offsets[2], xOffset, xOffset, pOffset);
+  }
+}
+
+struct ParallelForTest {
+  ParallelFor root;
+  uint32_t visits[100];
+  bool outOfRange;
+  bool returnedAfterAll;
+};
+
+void parallelForTestVisit(ThreadData *, void *arg, uint32_t index) {
+  auto test = (ParallelForTest *)arg;
+  if (index >= 100) {
+    __atomic_store_n(&test->outOfRange, true, __ATOMIC_RELAXED);
+    return;
+  }
+  __atomic_add_fetch(test->visits + index, 1, __ATOMIC_RELAXED);
+}
+
+void parallelForTestRoot(ThreadData *td, void *arg, uint32_t) {
+  auto test = (ParallelForTest *)arg;
+  parallelFor(td, 100, parallelForTestVisit, test);
+  bool all = true;
+  for (uint32_t i = 0; i < 100; ++i) all = all && __atomic_load_n(test->visits + i, __ATOMIC_RELAXED);
+  test->returnedAfterAll = all;
+}
+
+TEST(ParallelForVisitsEveryIndexOnce) (T *t) {
+  Compiler compiler;
+  CompilerOptions options = {};
+  options.threads = 3;
+  initCompiler(&compiler, options);
+
+  ParallelForTest test = {};
+  test.root = {parallelForTestRoot, &test, 1, {}};
+
+  auto root = allocOrReuseCompilerJob(&compiler);
+  root->type = COMPILER_JOB_TYPE_PARALLEL_FOR;
+  root->parallelFor = &test.root;
+  compiler.rootJob = root;
+  postCompilerJob(&compiler, root);
+
+  auto status = waitForCompilerToFinish(&compiler);
+  deinitCompiler(&compiler);
+
+  if (status != 0) FAILF("Unexpected exit status: %d\n", status);
+  if (test.outOfRange) FAILF("Body was called with index out of range\n");
+  for (uint32_t i = 0; i < 100; ++i) {
+    if (test.visits[i] != 1) FAILF("Index %u visited %u times\n", i, test.visits[i]);
+  }
+  if (!test.returnedAfterAll) FAILF("parallelFor returned before every index was visited\n");
+}
+
+TEST(CompilerReleasesFilesNoLongerUsed) (T *t) {
+  writeTestFile(".unittest-a.c6", STR("#load \".unittest-b.c6\"\nmain :: func() { }\n"));
+  writeTestFile(".unittest-b.c6", STR("b :: 1;\n"));
+
+  CompilerOptions options = {};
+  options.threads = 1;
+  options.entryPoint = ".unittest-a.c6";
+  Compiler compiler;
+  auto files = &compiler.globalData.files;
+  initCompiler(&compiler, options);
+  auto firstStatus = waitForCompilerToFinish(&compiler);
+
+  // Saved by rename, so the new version is a new file, and no longer loads b
+  writeTestFile(".unittest-a.c6.tmp", STR("main :: func() { x := 1; }\n"));
+  rename(".unittest-a.c6.tmp", ".unittest-a.c6");
+  startCompilation(&compiler, ".unittest-a.c6");
+  auto secondStatus = waitForCompilerToFinish(&compiler);
+  auto count = filesCount(files);
+  bool released = count == 3;
+  for (uint32_t i = 0; released && i < 2; ++i) {
+    auto slot = fileSlotAt(files, i);
+    released = !slot->ast && !slot->region.block && !slot->entry.content.data;
+  }
+  auto current = count == 3 ? fileSlotAt(files, 2)->ast : NULL;
+  deinitCompiler(&compiler);
+
+  unlink(".unittest-a.c6");
+  unlink(".unittest-b.c6");
+  if (firstStatus != 0 || secondStatus != 0) {
+    FAILF("Unexpected exit statuses: %d %d\n", firstStatus, secondStatus);
+  }
+  if (!released) FAILF("Replaced and unused files kept their memory (%u files)\n", count);
+  if (!current) FAILF("Current version of the file was released\n");
+}
@@ -0,0 +1,72 @@
+#include "../all.h"
+
+struct FileTableTestThread {
+  FileTable *table;
+  int id;
+  int n;
+};
+
+void *fileTableTestThreadProc(void *arg) {
+  auto data = static_cast<FileTableTestThread *>(arg);
+  for (int i = 0; i < data->n; ++i) {
+    FileEntry entry = {};
+    entry.content.len = data->id * data->n + i;
+    auto index = addFileEntry(data->table, entry);
+    auto got = fileEntryAt(data->table, index);
+    if (got->index != index || got->content.len != entry.content.len) return arg;
+  }
+  return NULL;
+}
+
+TEST(FileTableConcurrentAppendsKeepIndicesStable) (T *t) {
+  FileTable table = {};
+  const int threads = 4;
+  const int perThread = 5000;
+
+  pthread_t handles[threads];
+  FileTableTestThread data[threads];
+  for (int i = 0; i < threads; ++i) {
+    data[i] = {&table, i, perThread};
+    pthread_create(handles + i, NULL, fileTableTestThreadProc, data + i);
+  }
+
+  bool threadFailed = false;
+  for (int i = 0; i < threads; ++i) {
+    void *result = NULL;
+    pthread_join(handles[i], &result);
+    if (result) threadFailed = true;
+  }
+  if (threadFailed) FAILF("Entry read back right after append does not match\n");
+
+  auto count = filesCount(&table);
+  if (count != threads * perThread) FAILF("Unexpected files count: %u\n", count);
+
+  bool seen[threads * perThread] = {};
+  for (uint32_t i = 0; i < count; ++i) {
+    auto entry = fileEntryAt(&table, i);
+    if (entry->index != i) FAILF("Entry %u has index %u\n", i, entry->index);
+    seen[entry->content.len] = true;
+  }
+  for (int i = 0; i < threads * perThread; ++i) {
+    if (!seen[i]) FAILF("Entry %d was lost\n", i);
+  }
+
+  deinitFileTable(&table);
+}
+
+TEST(FileTableSkipsReservedUnpublishedSlots) (T *t) {
+  FileTable table = {};
+  FileEntry entry = {};
+  addFileEntry(&table, entry);
+  // Another thread reserved the next slot and didn't publish it yet
+  __atomic_add_fetch(&table.reserved, 1, __ATOMIC_RELAXED);
+
+  auto count = filesCount(&table);
+  auto first = publishedFileSlot(&table, 0);
+  auto reserved = publishedFileSlot(&table, 1);
+  deinitFileTable(&table);
+
+  if (count != 2) FAILF("Unexpected files count: %u\n", count);
+  if (!first) FAILF("Published slot was skipped\n");
+  if (reserved) FAILF("Unpublished slot was returned\n");
+}
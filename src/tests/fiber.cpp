@@ -0,0 +1,36 @@
+#include "../all.h"
+
+struct FiberTestData {
+  FiberContext mainContext;
+  FiberContext fiberContext;
+  int counter;
+  double value;
+};
+
+void fiberTestEntry(void *arg) {
+  auto data = static_cast<FiberTestData *>(arg);
+  for (;;) {
+    data->counter++;
+    data->value *= 1.5;
+    switchFiberContext(&data->fiberContext, &data->mainContext);
+  }
+}
+
+TEST(FiberSwitchesBackAndForth) (T *t) {
+  FiberTestData data = {};
+  data.value = 1.0;
+
+  auto stack = allocFiberStack(64 * 1024);
+  initFiberContext(&data.fiberContext, &stack, fiberTestEntry, &data);
+
+  for (int i = 1; i <= 10; ++i) {
+    switchFiberContext(&data.mainContext, &data.fiberContext);
+    if (data.counter != i) FAILF("Expected counter %d, got %d\n", i, data.counter);
+  }
+
+  double want = 1.0;
+  for (int i = 0; i < 10; ++i) want *= 1.5;
+  if (data.value != want) FAILF("Expected value %f, got %f\n", want, data.value);
+
+  freeFiberStack(&stack);
+}
@@ -0,0 +1,23 @@
+#include "../all.h"
+
+bool heapTestLess(int a, int b) {
+  return a < b;
+}
+
+TEST(HeapPopsInPriorityOrder) (T *t) {
+  Allocator a = {};
+  initAllocator(&a, (char *)malloc(4096), 4096);
+
+  int items[] = {5, 1, 9, 3, 7, 9, 0, 4};
+  Array<int> heap = {};
+  for (int i = 0; i < sizeof(items) / sizeof(items[0]); ++i) {
+    heapPush(&heap, items[i], heapTestLess, &a);
+  }
+
+  int want[] = {9, 9, 7, 5, 4, 3, 1, 0};
+  for (int i = 0; i < sizeof(want) / sizeof(want[0]); ++i) {
+    auto got = heapPop(&heap, heapTestLess);
+    if (got != want[i]) FAILF("Pop #%d: want %d, got %d\n", i, want[i], got);
+  }
+  if (heap.len != 0) FAILF("Heap should be empty, has %u items\n", heap.len);
+}
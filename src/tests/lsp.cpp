@@ -0,0 +1,136 @@
+#include "../all.h"
+
+#include <unistd.h>
+
+void appendLSPMessage(FILE *to, const char *body) {
+  fprintf(to, "Content-Length: %zu\r\n\r\n%s", strlen(body), body);
+}
+
+// Body of the response to request `id`, empty if there is none
+Str lspResponse(const char *text, int id) {
+  char key[32];
+  snprintf(key, sizeof(key), "\"id\":%d,", id);
+  auto start = strstr(text, key);
+  if (!start) return {};
+  auto end = strstr(start, "Content-Length");
+  return {(char *)start, end ? (size_t)(end - start) : strlen(start)};
+}
+
+bool contains(Str haystack, const char *needle) {
+  auto len = strlen(needle);
+  for (size_t i = 0; i + len <= haystack.len; ++i) {
+    if (memcmp(haystack.data + i, needle, len) == 0) return true;
+  }
+  return false;
+}
+
+TEST(LanguageServerAnswersQueriesAfterEdits) (T *t) {
+  auto lib = fopen(".unittest-lsp-lib.c6", "w");
+  fputs("LIMIT :: 10;\n", lib);
+  fclose(lib);
+  char cwd[PATH_MAX];
+  if (!getcwd(cwd, sizeof(cwd))) FAILF("getcwd failed\n");
+
+  char *input = NULL;
+  size_t inputLen = 0;
+  auto in = open_memstream(&input, &inputLen);
+  char body[4096];
+  appendLSPMessage(in, "{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"initialize\",\"params\":{}}");
+  auto bodyLen = snprintf(body, sizeof(body),
+           "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didOpen\",\"params\":{\"textDocument\":"
+           "{\"uri\":\"file://%s/.unittest-lsp.c6\",\"languageId\":\"c6\",\"version\":1,\"text\":"
+           "\"#load \\\".unittest-lsp-lib.c6\\\"\\nmain :: func(x : i32) {\\n  y := x + LIMIT;\\n}\\n\"}}}",
+           cwd);
+  if (bodyLen >= (int)sizeof(body)) FAILF("Path of the working directory is too long\n");
+  appendLSPMessage(in, body);
+  // Remove LIMIT, put it back, then add a line using y
+  const char *changes[] = {
+    "{\"range\":{\"start\":{\"line\":2,\"character\":11},\"end\":{\"line\":2,\"character\":16}},\"text\":\"\"}",
+    "{\"range\":{\"start\":{\"line\":2,\"character\":11},\"end\":{\"line\":2,\"character\":11}},\"text\":\"LIMIT\"}",
+    "{\"range\":{\"start\":{\"line\":3,\"character\":0},\"end\":{\"line\":3,\"character\":0}},\"text\":\"  z := y;\\n\"}",
+  };
+  for (auto change : changes) {
+    bodyLen = snprintf(body, sizeof(body),
+                       "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didChange\",\"params\":{\"textDocument\":"
+                       "{\"uri\":\"file://%s/.unittest-lsp.c6\"},\"contentChanges\":[%s]}}", cwd, change);
+    if (bodyLen >= (int)sizeof(body)) FAILF("Path of the working directory is too long\n");
+    appendLSPMessage(in, body);
+  }
+  const char *requests[] = {
+    "\"id\":2,\"method\":\"textDocument/hover\",\"params\":{%s,\"position\":{\"line\":2,\"character\":7}}",
+    // First request about the loaded file
+    "\"id\":8,\"method\":\"textDocument/hover\",\"params\":{%s,\"position\":{\"line\":2,\"character\":12}}",
+    "\"id\":3,\"method\":\"textDocument/definition\",\"params\":{%s,\"position\":{\"line\":2,\"character\":12}}",
+    "\"id\":4,\"method\":\"textDocument/definition\",\"params\":{%s,\"position\":{\"line\":3,\"character\":7}}",
+    "\"id\":5,\"method\":\"textDocument/documentSymbol\",\"params\":{%s}",
+    "\"id\":6,\"method\":\"textDocument/unknown\",\"params\":{%s}",
+  };
+  for (auto request : requests) {
+    char textDocument[PATH_MAX + 64];
+    snprintf(textDocument, sizeof(textDocument), "\"textDocument\":{\"uri\":\"file://%s/.unittest-lsp.c6\"}", cwd);
+    char fields[PATH_MAX + 256];
+    snprintf(fields, sizeof(fields), request, textDocument);
+    bodyLen = snprintf(body, sizeof(body), "{\"jsonrpc\":\"2.0\",%s}", fields);
+    if (bodyLen >= (int)sizeof(body)) FAILF("Path of the working directory is too long\n");
+    appendLSPMessage(in, body);
+  }
+  appendLSPMessage(in, "{\"jsonrpc\":\"2.0\",\"id\":7,\"method\":\"shutdown\"}");
+  appendLSPMessage(in, "{\"jsonrpc\":\"2.0\",\"method\":\"exit\"}");
+  fclose(in);
+
+  char *text = NULL;
+  size_t textLen = 0;
+  in = fmemopen(input, inputLen, "r");
+  auto out = open_memstream(&text, &textLen);
+  auto status = runLanguageServer(in, out);
+  fclose(in);
+  fclose(out);
+  free(input);
+  unlink(".unittest-lsp-lib.c6");
+
+  if (status != 0) FAILF("Unexpected exit status %d\n", status);
+  if (!contains(lspResponse(text, 1), "\"definitionProvider\":true")) FAILF("Bad initialize response\n");
+
+  // One publication per open and per change
+  Str diagnostics[4] = {};
+  auto it = text;
+  for (int i = 0; i < 4; ++i) {
+    it = strstr(it, "publishDiagnostics");
+    if (!it) FAILF("Missing diagnostics %d\n", i);
+    auto end = strstr(it, "Content-Length");
+    diagnostics[i] = {it, end ? (size_t)(end - it) : strlen(it)};
+    it++;
+  }
+  if (!contains(diagnostics[0], "\"diagnostics\":[]")) FAILF("Opened file should have no errors\n");
+  if (!contains(diagnostics[1], "\"severity\":1") || !contains(diagnostics[1], "{\"line\":2,\"character\":11}")) {
+    FAILF("Missing operand not reported: %.*s\n", (int)diagnostics[1].len, diagnostics[1].data);
+  }
+  if (!contains(diagnostics[2], "\"diagnostics\":[]")) FAILF("Fixed file should have no errors\n");
+  if (!contains(diagnostics[3], "\"diagnostics\":[]")) FAILF("Edited file should have no errors\n");
+
+  auto hover = lspResponse(text, 2);
+  if (!contains(hover, "x : i32")) FAILF("Bad hover: %.*s\n", (int)hover.len, hover.data);
+  auto limitHover = lspResponse(text, 8);
+  if (!contains(limitHover, "LIMIT :: 10;") ||
+      !contains(limitHover, "{\"start\":{\"line\":2,\"character\":11},\"end\":{\"line\":2,\"character\":16}}")) {
+    FAILF("Bad hover of declaration in loaded file: %.*s\n", (int)limitHover.len, limitHover.data);
+  }
+
+  auto limit = lspResponse(text, 3);
+  if (!contains(limit, ".unittest-lsp-lib.c6\"") ||
+      !contains(limit, "{\"start\":{\"line\":0,\"character\":0},\"end\":{\"line\":0,\"character\":5}}")) {
+    FAILF("Bad definition in loaded file: %.*s\n", (int)limit.len, limit.data);
+  }
+  auto y = lspResponse(text, 4);
+  if (!contains(y, "{\"start\":{\"line\":2,\"character\":2},\"end\":{\"line\":2,\"character\":3}}")) {
+    FAILF("Bad definition of edited variable: %.*s\n", (int)y.len, y.data);
+  }
+
+  auto symbols = lspResponse(text, 5);
+  if (!contains(symbols, "\"name\":\"main\",\"kind\":12")) {
+    FAILF("Bad symbols: %.*s\n", (int)symbols.len, symbols.data);
+  }
+  if (!contains(lspResponse(text, 6), "-32601")) FAILF("Unknown method not rejected\n");
+  if (!contains(lspResponse(text, 7), "\"result\":null")) FAILF("Bad shutdown response\n");
+  free(text);
+}
@@ -6,12 +6,13 @@ struct TestSetupData {
   GlobalData globalData;
 };
 
-TestSetupData* setupTestData(Str content) {
+TestSetupData* setupTestData(Str content, size_t size = 10 * 1024) {
   auto result = static_cast<TestSetupData *>(malloc(sizeof(TestSetupData)));
   *result = {};
   result->threadData.globalData = &result->globalData;
-  size_t size = 10 * 1024;
   initAllocator(&result->threadData.allocator, (char *)malloc(size), size);
+  initAllocator(result->threadData.scratch + 0, (char *)malloc(size), size);
+  initAllocator(result->threadData.scratch + 1, (char *)malloc(size), size);
 
   auto fileEntry = FileEntry{
     .absolutePath = STR("/main.c6"),
@@ -20,7 +21,7 @@ TestSetupData* setupTestData(Str content) {
     .index = 0,
   };
 
-  append(&result->globalData.files, fileEntry, &result->threadData.allocator);
+  addFileEntry(&result->globalData.files, fileEntry);
 
   result->lexer.fileIndex = 0;
   result->lexer.source = content;
@@ -479,3 +480,159 @@ TEST(ParseBlockAndStatements) (T *t) {
   CHECK_NODE(5, ASTWhileLoop_);
 #undef CHECK_NODE
 }
+
+TEST(ParsingKeepsTemporariesOutOfPermanentMemory) (T *t) {
+  auto setup = setupTestData(STR("struct { a, b, c : int; d : int; }"));
+
+  ParsingError error = {};
+  AST *ast = parseAnonymousStruct(&setup->threadData, &setup->lexer, 0, &error);
+  if (!ast) FAILF("Failed to parse struct\n");
+
+  for (int i = 0; i < 2; ++i) {
+    auto scratch = setup->threadData.scratch + i;
+    if (usage(scratch) != 0) FAILF("Scratch %d was not rewound: %zu bytes\n", i, usage(scratch));
+  }
+  auto structAST = AST_ASSERT_CAST(ASTStruct, ast);
+  if (structAST->members.len != 4) FAILF("Expected 4 members, got %u\n", structAST->members.len);
+}
+
+Str nestedParens(uint32_t depth) {
+  auto prefix = STR("x := ");
+  Str result = {(char *)malloc(prefix.len + 2 * depth + 2), prefix.len + 2 * depth + 1};
+  memcpy(result.data, prefix.data, prefix.len);
+  memset(result.data + prefix.len, '(', depth);
+  result.data[prefix.len + depth] = '1';
+  memset(result.data + prefix.len + depth + 1, ')', depth);
+  result.data[result.len] = '\0';
+  return result;
+}
+
+TEST(ParsingFailsOnTooDeepNesting) (T *t) {
+  auto source = nestedParens(1000);
+  auto setup = setupTestData(source, 4 * 1024 * 1024);
+  ParsingError error = {};
+  AST *ast = parseFile(&setup->threadData, &setup->lexer, 0, &error);
+  if (!ast) FAILF("Failed to parse 1000 nested parens: at %u %.*s\n",
+    error.offset, (int)error.message.len, error.message.data);
+
+  source = nestedParens(100000);
+  setup = setupTestData(source, 4 * 1024 * 1024);
+  error = {};
+  ast = parseFile(&setup->threadData, &setup->lexer, 0, &error);
+  if (ast) FAILF("Expected 100000 nested parens to fail\n");
+  if (!StrEqual(error.message, STR("Nesting is too deep")))
+    FAILF("Unexpected error: %.*s\n", (int)error.message.len, error.message.data);
+  if (error.offset <= 5 || error.offset >= 5 + 100000 || source.data[error.offset] != '(')
+    FAILF("Unexpected error offset: %u\n", error.offset);
+}
+
+struct NodeSpans {
+  Array<AST> nodes; // only type, fileIndex and offsets are meaningful
+  Allocator *allocator;
+};
+
+ASTWalkResult collectNodeSpan(ASTWalker *walker, AST *node) {
+  auto spans = static_cast<NodeSpans *>(walker->userData);
+  append(&spans->nodes, *node, spans->allocator);
+  return AST_WALK_CONTINUE;
+}
+
+bool sameNodeSpans(ThreadData *td, AST *a, AST *b) {
+  NodeSpans spansA = {{}, &td->allocator}, spansB = {{}, &td->allocator};
+  ASTWalker walker = {};
+  walker.pre = collectNodeSpan;
+  walker.userData = &spansA;
+  walkAST(&walker, a, td->scratch);
+  walker.userData = &spansB;
+  walkAST(&walker, b, td->scratch);
+  if (spansA.nodes.len != spansB.nodes.len) return false;
+  for (uint32_t i = 0; i < spansA.nodes.len; ++i) {
+    auto x = spansA.nodes.data + i, y = spansB.nodes.data + i;
+    if (x->type != y->type || x->fileIndex != y->fileIndex ||
+        x->offset0 != y->offset0 || x->offset1 != y->offset1) {
+      return false;
+    }
+  }
+  return true;
+}
+
+struct ReparseResult {
+  bool failed;
+  bool matchesFullParse;
+  uint32_t decls;
+  uint32_t reusedDecls;
+};
+
+// Reparses edited source and compares the result with parsing it from scratch
+ReparseResult reparseWithEdits(const char *oldText, const SourceEdit *edits, uint32_t count) {
+  auto setup = setupTestData(CStringToStr(oldText), 1024 * 1024);
+  auto td = &setup->threadData;
+  ParsingError error = {};
+  auto oldFile = AST_ASSERT_CAST(ASTFile, parseFile(td, &setup->lexer, 0, &error));
+  auto oldDecls = copyArray(oldFile->topLevelDecls, &td->allocator);
+
+  Lexer lexer = {};
+  lexer.source = applySourceEdits(setup->lexer.source, edits, count, &td->allocator);
+  auto file = reparseFile(td, &lexer, oldFile, setup->lexer.source, edits, count, &error);
+
+  Lexer fullLexer = {};
+  fullLexer.source = lexer.source;
+  ParsingError fullError = {};
+  auto fullFile = parseFile(td, &fullLexer, 0, &fullError);
+
+  ReparseResult result = {};
+  result.failed = !file;
+  if (!file) {
+    result.matchesFullParse = !fullFile && error.offset == fullError.offset;
+    return result;
+  }
+  result.matchesFullParse = fullFile && sameNodeSpans(td, file, fullFile);
+  result.decls = file->topLevelDecls.len;
+  for (uint32_t i = 0; i < file->topLevelDecls.len; ++i) {
+    for (uint32_t j = 0; j < oldDecls.len; ++j) {
+      if (file->topLevelDecls.data[i] == oldDecls.data[j]) result.reusedDecls++;
+    }
+  }
+  return result;
+}
+
+TEST(ReparseReusesDeclarationsOutsideOfEdits) (T *t) {
+  const char *text = "a :: 1\nb :: func() { x := 1; }\nc :: 3\nd :: 4\n"
+                     "s :: struct { x, y : *u8; }\nf :: func(p, q : *u8) { }\n";
+  auto at = [&](const char *needle) { return (uint32_t)(strstr(text, needle) - text); };
+  struct {
+    const char *name;
+    Array<SourceEdit> edits;
+    bool failed;
+    uint32_t decls, reusedDecls;
+  } cases[] = {
+    {"edit inside function", {}, false, 6, 5},
+    {"insert declaration", {}, false, 7, 5},
+    {"delete first declaration", {}, false, 5, 5},
+    {"two edits", {}, false, 6, 4},
+    {"join two declarations", {}, true, 0, 0},
+    {"open string literal", {}, true, 0, 0},
+  };
+  SourceEdit editInside[] = {{at("1; }"), at("1; }") + 1, STR("22")}};
+  SourceEdit insertDecl[] = {{at("d ::"), at("d ::"), STR("e :: 5\n")}};
+  SourceEdit deleteFirst[] = {{0, at("b ::"), STR("")}};
+  SourceEdit twoEdits[] = {{at("x :="), at("x :=") + 1, STR("y")}, {at("3"), at("3") + 1, STR("33")}};
+  SourceEdit joinDecls[] = {{at("d ::") - 1, at("d ::"), STR("")}};
+  SourceEdit openString[] = {{at("c ::"), at("c ::"), STR("\"")}};
+  cases[0].edits = {editInside, 1, 1};
+  cases[1].edits = {insertDecl, 1, 1};
+  cases[2].edits = {deleteFirst, 1, 1};
+  cases[3].edits = {twoEdits, 2, 2};
+  cases[4].edits = {joinDecls, 1, 1};
+  cases[5].edits = {openString, 1, 1};
+
+  for (auto &c : cases) {
+    auto result = reparseWithEdits(text, c.edits.data, c.edits.len);
+    if (!result.matchesFullParse) FAILF("%s: result differs from full parse\n", c.name);
+    if (result.failed != c.failed) FAILF("%s: expected failed=%d\n", c.name, c.failed);
+    if (result.decls != c.decls || result.reusedDecls != c.reusedDecls) {
+      FAILF("%s: expected %u declarations with %u reused, got %u with %u reused\n", c.name,
+            c.decls, c.reusedDecls, result.decls, result.reusedDecls);
+    }
+  }
+}
@@ -0,0 +1,133 @@
+#include "../all.h"
+
+#include <unistd.h>
+
+void writeQueryTestFile(const char *path, const char *content) {
+  auto f = fopen(path, "w");
+  fputs(content, f);
+  fclose(f);
+}
+
+TEST(QueryEngineRecomputesOnlyWhatChanged) (T *t) {
+  writeQueryTestFile(".unittest-query-lib.c6", "LIMIT :: 10;\n");
+  Allocator reservoir = {};
+  initVirtualAllocator(&reservoir, NULL, 1024ull * 1024ull * 1024ull, ALLOCATOR_FLAG_SHARED);
+  GlobalData globalData = {};
+  initGlobalData(&globalData);
+  ThreadData threadData = {};
+  initThreadData(&threadData, &globalData, &reservoir);
+  auto td = &threadData;
+  QueryEngine engine = {};
+  initQueryEngine(&engine, NULL, &reservoir);
+
+  auto main = queryFileId(&engine, STR(".unittest-query-main.c6"));
+  auto lib = queryFileId(&engine, STR(".unittest-query-lib.c6"));
+  setQueryFileContent(&engine, main, STR("#load \".unittest-query-lib.c6\"\nmain :: func() {\n  x := LIMIT;\n}\n"));
+
+  auto limit = queryResolve(&td, &engine, NULL, main, STR("LIMIT"));
+  if (limit.file != lib || limit.decl != 0) FAILF("LIMIT resolved to %u:%u\n", limit.file, limit.decl);
+  if (queryResolve(&td, &engine, NULL, main, STR("main")).file != main) FAILF("main not resolved\n");
+  if (queryResolve(&td, &engine, NULL, main, STR("x")).file != FILE_INDEX_NONE) {
+    FAILF("Local variable resolved at top level\n");
+  }
+  uint64_t computations[QUERY_KIND_COUNT];
+  memcpy(computations, engine.computations, sizeof(computations));
+  if (computations[QUERY_PARSED_FILE] != 2 || computations[QUERY_RESOLVE] != 3) {
+    FAILF("Unexpected computations: %lu parses, %lu resolutions\n", computations[QUERY_PARSED_FILE],
+          computations[QUERY_RESOLVE]);
+  }
+
+  // Nothing changed
+  queryResolve(&td, &engine, NULL, main, STR("LIMIT"));
+  if (memcmp(computations, engine.computations, sizeof(computations)) != 0) FAILF("Memo not reused\n");
+
+  // Body edit reparses the file, declarations stay the same
+  setQueryFileContent(&engine, main, STR("#load \".unittest-query-lib.c6\"\nmain :: func() {\n  x := LIMIT + 1;\n}\n"));
+  limit = queryResolve(&td, &engine, NULL, main, STR("LIMIT"));
+  if (limit.file != lib) FAILF("LIMIT not resolved after edit\n");
+  if (engine.computations[QUERY_PARSED_FILE] != computations[QUERY_PARSED_FILE] + 1) FAILF("Edit not parsed\n");
+  if (engine.computations[QUERY_RESOLVE] != computations[QUERY_RESOLVE]) FAILF("Resolution not cut off\n");
+  auto parsed = queryParsedFile(&td, &engine, NULL, main);
+  if (!parsed->ast || !contains(parsed->content, "LIMIT + 1")) FAILF("Edited file not parsed\n");
+
+  // Loaded file changes on disk
+  writeQueryTestFile(".unittest-query-lib.c6", "OTHER :: 1;\n");
+  if (refreshQueryFiles(&engine) != 1) FAILF("Change on disk not noticed\n");
+  if (queryResolve(&td, &engine, NULL, main, STR("LIMIT")).file != FILE_INDEX_NONE) FAILF("Stale resolution\n");
+  if (queryResolve(&td, &engine, NULL, main, STR("OTHER")).file != lib) FAILF("OTHER not resolved\n");
+
+  deinitQueryEngine(&engine);
+  deinitGlobalData(&globalData);
+  deinitVirtualAllocator(&reservoir);
+  unlink(".unittest-query-lib.c6");
+}
+
+struct QueryJobsTest {
+  QueryEngine *engine;
+  uint32_t main;
+  QueryResolution resolutions[2];
+  ParallelFor root;
+};
+
+void queryJobsTestFetch(ThreadData *td, void *arg, uint32_t index) {
+  auto test = static_cast<QueryJobsTest *>(arg);
+  test->resolutions[index] = queryResolve(&td, test->engine, NULL, test->main, STR("LIMIT"));
+}
+
+// Both jobs fetch the same key, the one which comes second waits for the
+// first while it prefetches declarations of loaded files in parallel
+void queryJobsTestRoot(ThreadData *td, void *arg, uint32_t) {
+  parallelFor(td, 2, queryJobsTestFetch, arg);
+}
+
+TEST(QueryEngineComputesQueriesOnceInsideOfJobs) (T *t) {
+  writeQueryTestFile(".unittest-query-lib.c6", "OTHER :: 1;\n");
+  writeQueryTestFile(".unittest-query-lib2.c6", "LIMIT :: 10;\n");
+  Allocator reservoir = {};
+  initVirtualAllocator(&reservoir, NULL, 1024ull * 1024ull * 1024ull, ALLOCATOR_FLAG_SHARED);
+  Compiler compiler;
+  CompilerOptions options = {};
+  options.threads = 1;
+  initCompiler(&compiler, options);
+  QueryEngine engine = {};
+  initQueryEngine(&engine, &compiler, &reservoir);
+
+  QueryJobsTest test = {};
+  test.engine = &engine;
+  test.main = queryFileId(&engine, STR(".unittest-query-main.c6"));
+  auto lib2 = queryFileId(&engine, STR(".unittest-query-lib2.c6"));
+  setQueryFileContent(&engine, test.main,
+                      STR("#load \".unittest-query-lib.c6\"\n#load \".unittest-query-lib2.c6\"\n"
+                          "main :: func() {\n  x := LIMIT;\n}\n"));
+  test.root.body = queryJobsTestRoot;
+  test.root.arg = &test;
+  test.root.unfinished = 1;
+
+  auto root = allocOrReuseCompilerJob(&compiler);
+  root->type = COMPILER_JOB_TYPE_PARALLEL_FOR;
+  root->parallelFor = &test.root;
+  compiler.rootJob = root;
+  postCompilerJob(&compiler, root);
+  auto status = waitForCompilerToFinish(&compiler);
+
+  uint64_t computations[QUERY_KIND_COUNT];
+  memcpy(computations, engine.computations, sizeof(computations));
+  deinitQueryEngine(&engine);
+  deinitCompiler(&compiler);
+  deinitVirtualAllocator(&reservoir);
+  unlink(".unittest-query-lib.c6");
+  unlink(".unittest-query-lib2.c6");
+
+  if (status != 0) FAILF("Unexpected exit status: %d\n", status);
+  for (uint32_t i = 0; i < 2; ++i) {
+    auto resolution = test.resolutions[i];
+    if (resolution.file != lib2 || resolution.decl != 0) {
+      FAILF("Job %u resolved LIMIT to %u:%u\n", i, resolution.file, resolution.decl);
+    }
+  }
+  if (computations[QUERY_RESOLVE] != 1 || computations[QUERY_DECLS_OF] != 3 ||
+      computations[QUERY_PARSED_FILE] != 3) {
+    FAILF("Unexpected computations: %lu resolutions, %lu declarations, %lu parses\n",
+          computations[QUERY_RESOLVE], computations[QUERY_DECLS_OF], computations[QUERY_PARSED_FILE]);
+  }
+}
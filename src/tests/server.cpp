@@ -0,0 +1,93 @@
+#include "../all.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+void *testCompileServerProc(void *arg) {
+  CompilerOptions options = {};
+  options.threads = 1;
+  runCompileServer(options, (const char *)arg);
+  return NULL;
+}
+
+// Server is listening once its socket accepts connections
+bool waitForCompileServer(const char *socketPath) {
+  for (int i = 0; i < 1000; ++i) {
+    int fd = connectToCompileServer(socketPath);
+    if (fd >= 0) {
+      close(fd);
+      return true;
+    }
+    usleep(1000);
+  }
+  return false;
+}
+
+TEST(CompileServerStreamsDiagnosticsAndStatus) (T *t) {
+  const char *socketPath = ".unittest.sock";
+  unlink(socketPath);
+  pthread_t server;
+  pthread_create(&server, NULL, testCompileServerProc, (void *)socketPath);
+  if (!waitForCompileServer(socketPath)) FAILF("Server didn't start\n");
+
+  auto fd = open(".unittest.c6", O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  auto broken = STR("main :: func() { x := ; }\n");
+  write(fd, broken.data, broken.len);
+  close(fd);
+
+  char *text = NULL;
+  size_t textLen = 0;
+  auto out = open_memstream(&text, &textLen);
+  auto brokenStatus = runCompileClient(socketPath, ".unittest.c6", 0, out);
+  fclose(out);
+  auto reported = text && strstr(text, ".unittest.c6:1:") && strstr(text, "error");
+  free(text);
+
+  auto fixed = STR("main :: func() { x := 1; }\n");
+  fd = open(".unittest.c6", O_TRUNC | O_WRONLY);
+  write(fd, fixed.data, fixed.len);
+  close(fd);
+  auto fixedStatus = runCompileClient(socketPath, ".unittest.c6", 0, stderr);
+
+  auto stopStatus = stopCompileServer(socketPath);
+  pthread_join(server, NULL);
+  unlink(".unittest.c6");
+
+  if (brokenStatus != 1) FAILF("Unexpected status of broken file: %d\n", brokenStatus);
+  if (!reported) FAILF("Diagnostics were not sent to the client\n");
+  if (fixedStatus != 0) FAILF("Unexpected status of fixed file: %d\n", fixedStatus);
+  if (stopStatus != 0) FAILF("Server didn't accept shutdown\n");
+  if (access(socketPath, F_OK) == 0) FAILF("Socket was not removed\n");
+}
+
+TEST(CompileServerDropsClientsWhichSendNothing) (T *t) {
+  const char *socketPath = ".unittest.sock";
+  unlink(socketPath);
+  pthread_t server;
+  pthread_create(&server, NULL, testCompileServerProc, (void *)socketPath);
+  if (!waitForCompileServer(socketPath)) FAILF("Server didn't start\n");
+
+  auto fd = open(".unittest.c6", O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  auto content = STR("main :: func() { x := 1; }\n");
+  write(fd, content.data, content.len);
+  close(fd);
+
+  // Connects and stays silent, requests of others are served after timeout
+  auto silent = connectToCompileServer(socketPath);
+  auto start = now();
+  auto status = runCompileClient(socketPath, ".unittest.c6", 0, stderr);
+  auto elapsedMs = (now() - start) * 1000.0;
+  char byte = 0;
+  auto dropped = silent >= 0 && recv(silent, &byte, 1, 0) == 0;
+  if (silent >= 0) close(silent);
+
+  auto stopStatus = stopCompileServer(socketPath);
+  pthread_join(server, NULL);
+  unlink(".unittest.c6");
+
+  if (silent < 0) FAILF("Failed to connect\n");
+  if (status != 0) FAILF("Unexpected status: %d\n", status);
+  if (elapsedMs < SERVER_RECEIVE_TIMEOUT_MS / 2) FAILF("Request was served before silent client\n");
+  if (!dropped) FAILF("Silent client was not disconnected\n");
+  if (stopStatus != 0) FAILF("Server didn't accept shutdown\n");
+}
@@ -0,0 +1,67 @@
+#include "../all.h"
+
+#include <unistd.h>
+
+TEST(TraceRecordsJobsOfEveryWorker) (T *t) {
+  const char *entry = ".unittest-trace.c6";
+  auto f = fopen(entry, "w");
+  fputs("#load \".unittest-trace-lib.c6\"\nmain :: func() { x := LIMIT; }\n", f);
+  fclose(f);
+  f = fopen(".unittest-trace-lib.c6", "w");
+  fputs("LIMIT :: 10;\n", f);
+  fclose(f);
+
+  startTracing(false);
+  CompilerOptions options = {};
+  options.threads = 2;
+  options.entryPoint = entry;
+  Compiler compiler;
+  initCompiler(&compiler, options);
+  auto status = waitForCompilerToFinish(&compiler);
+  deinitCompiler(&compiler);
+  unlink(entry);
+  unlink(".unittest-trace-lib.c6");
+  if (status != 0) FAILF("Unexpected exit status: %d\n", status);
+
+  // Oldest events of a full buffer are overwritten. Main thread may have
+  // recorded waits for the job queue lock during compilation too.
+  for (uint32_t i = 0; i < TRACE_BUFFER_CAPACITY + 10; ++i) {
+    TRACE_SCOPE("filler");
+  }
+  stopTracing();
+  { TRACE_SCOPE("after stop"); }
+  auto written = writeTrace(".unittest-trace.json");
+
+  Allocator a = {};
+  initVirtualAllocator(&a, NULL, 1024ull * 1024ull * 1024ull, 0);
+  auto file = readFile(&a, ".unittest-trace.json");
+  unlink(".unittest-trace.json");
+  if (!written || !file.ok) FAILF("Trace not written\n");
+  auto trace = parseJson(file.content, &a);
+  if (!trace) FAILF("Trace is not valid JSON\n");
+  if (jsonNumber(jsonGet(jsonGet(trace, "otherData"), "droppedEvents"), -1) < 10) {
+    FAILF("Overwritten events not counted\n");
+  }
+
+  bool parsedLib = false, hasWorker = false, hasFiller = false;
+  auto events = jsonGet(trace, "traceEvents");
+  for (uint32_t i = 0; events && i < events->items.len; ++i) {
+    auto event = events->items.data[i];
+    auto name = jsonString(jsonGet(event, "name"));
+    auto detail = jsonString(jsonGet(jsonGet(event, "args"), "detail"));
+    if (StrEqual(name, STR("parse")) && StrEqual(jsonString(jsonGet(event, "ph")), STR("X")) &&
+        StrEqual(detail, STR(".unittest-trace-lib.c6"))) {
+      parsedLib = true;
+    }
+    if (StrEqual(name, STR("thread_name")) &&
+        StrEqual(jsonString(jsonGet(jsonGet(event, "args"), "name")), STR("worker 0"))) {
+      hasWorker = true;
+    }
+    if (StrEqual(name, STR("filler"))) hasFiller = true;
+    if (StrEqual(name, STR("after stop"))) FAILF("Event recorded after tracing stopped\n");
+  }
+  deinitVirtualAllocator(&a);
+  if (!parsedLib) FAILF("Missing parse of the loaded file\n");
+  if (!hasWorker) FAILF("Missing worker thread name\n");
+  if (!hasFiller) FAILF("Missing latest events\n");
+}
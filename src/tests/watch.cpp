@@ -0,0 +1,123 @@
+#include "../all.h"
+
+#include <unistd.h>
+
+TEST(FileWatcherRereadsOnlyChangedFiles) (T *t) {
+  writeTestFile(".unittest-a.c6", STR("#load \".unittest-b.c6\"\nmain :: func() { }\n"));
+  writeTestFile(".unittest-b.c6", STR("b :: 1;\n"));
+
+  CompilerOptions options = {};
+  options.threads = 1;
+  options.entryPoint = ".unittest-a.c6";
+  Compiler compiler;
+  auto files = &compiler.globalData.files;
+  initCompiler(&compiler, options);
+  waitForCompilerToFinish(&compiler);
+  FileWatcher watcher;
+  if (!initFileWatcher(&watcher, &compiler)) {
+    deinitCompiler(&compiler);
+    FAILF("inotify is not available\n");
+  }
+
+  // Edit made before the watch exists is noticed by comparing with disk
+  writeTestFile(".unittest-b.c6", STR("b :: 22;\n"));
+  auto missedEdit = watchLoadedFiles(&watcher);
+  startCompilation(&compiler, ".unittest-a.c6");
+  auto firstStatus = waitForCompilerToFinish(&compiler);
+  auto settled = watchLoadedFiles(&watcher);
+  auto quiet = !waitForFileChanges(&watcher, 0);
+  auto firstAST = fileSlotAt(files, 0)->ast;
+
+  writeTestFile(".unittest-b.c6", STR("b :: 1;\nc :: 2;\n"));
+  auto noticed = waitForFileChanges(&watcher, 1000);
+  auto onlyEditedInvalidated = fileSlotAt(files, 0)->watched && !fileSlotAt(files, 2)->watched;
+
+  startCompilation(&compiler, ".unittest-a.c6");
+  auto editedStatus = waitForCompilerToFinish(&compiler);
+  auto count = filesCount(files);
+  auto reused = fileSlotAt(files, 0)->ast == firstAST;
+  auto settledAgain = watchLoadedFiles(&watcher);
+  auto newWatched = count == 4 && fileSlotAt(files, 3)->watched;
+
+  deinitFileWatcher(&watcher);
+  deinitCompiler(&compiler);
+  unlink(".unittest-a.c6");
+  unlink(".unittest-b.c6");
+
+  if (missedEdit) FAILF("Edit before watch was added went unnoticed\n");
+  if (firstStatus != 0 || editedStatus != 0) {
+    FAILF("Unexpected exit statuses: %d %d\n", firstStatus, editedStatus);
+  }
+  if (!settled || !settledAgain) FAILF("Unchanged files were reported as changed\n");
+  if (!quiet) FAILF("Change reported without edits\n");
+  if (!noticed) FAILF("Edit was not noticed\n");
+  if (!onlyEditedInvalidated) FAILF("Expected only edited file to be checked again\n");
+  if (count != 4) FAILF("Expected only edited file to be loaded again, have %u files\n", count);
+  if (!reused) FAILF("Unchanged file was parsed again\n");
+  if (!newWatched) FAILF("Reloaded file is not watched\n");
+}
+
+TEST(FileWatcherFollowsFilesReplacedByRename) (T *t) {
+  writeTestFile(".unittest-a.c6", STR("main :: func() { }\n"));
+
+  CompilerOptions options = {};
+  options.threads = 1;
+  options.entryPoint = ".unittest-a.c6";
+  Compiler compiler;
+  initCompiler(&compiler, options);
+  waitForCompilerToFinish(&compiler);
+  FileWatcher watcher;
+  if (!initFileWatcher(&watcher, &compiler)) {
+    deinitCompiler(&compiler);
+    FAILF("inotify is not available\n");
+  }
+  watchLoadedFiles(&watcher);
+
+  // Editors save into a new file which replaces the old one
+  writeTestFile(".unittest-a.c6.tmp", STR("main :: func() { x := 1; }\n"));
+  rename(".unittest-a.c6.tmp", ".unittest-a.c6");
+  auto noticed = waitForFileChanges(&watcher, 1000);
+  startCompilation(&compiler, ".unittest-a.c6");
+  auto status = waitForCompilerToFinish(&compiler);
+  // Old version must not look changed forever
+  auto settled = watchLoadedFiles(&watcher);
+  waitForFileChanges(&watcher, 0);
+  auto settledAgain = watchLoadedFiles(&watcher);
+
+  deinitFileWatcher(&watcher);
+  deinitCompiler(&compiler);
+  unlink(".unittest-a.c6");
+
+  if (!noticed) FAILF("Replacement was not noticed\n");
+  if (status != 0) FAILF("Unexpected exit status: %d\n", status);
+  if (!settled || !settledAgain) FAILF("Replaced file keeps being reported as changed\n");
+}
+
+TEST(FileWatcherSettlesOnFilesWhichFailedToParse) (T *t) {
+  writeTestFile(".unittest-a.c6", STR("main :: func() { x := ; }\n"));
+
+  CompilerOptions options = {};
+  options.threads = 1;
+  options.entryPoint = ".unittest-a.c6";
+  Compiler compiler;
+  initCompiler(&compiler, options);
+  auto status = waitForCompilerToFinish(&compiler);
+  FileWatcher watcher;
+  if (!initFileWatcher(&watcher, &compiler)) {
+    deinitCompiler(&compiler);
+    FAILF("inotify is not available\n");
+  }
+  // Content of the failed file is released, disk is compared with its size
+  auto settled = watchLoadedFiles(&watcher);
+
+  writeTestFile(".unittest-a.c6", STR("main :: func() { x := 1; }\n"));
+  auto noticed = waitForFileChanges(&watcher, 1000);
+
+  deinitFileWatcher(&watcher);
+  deinitCompiler(&compiler);
+  unlink(".unittest-a.c6");
+
+  if (status != 1) FAILF("Unexpected exit status: %d\n", status);
+  if (!settled) FAILF("File which failed to parse was reported as changed\n");
+  if (!noticed) FAILF("Edit of the file which failed to parse was not noticed\n");
+}
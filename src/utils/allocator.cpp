@@ -1,23 +1,248 @@
 #include "allocator.h"
+#include "numa.h"
 
 #include <string.h>
 #include <assert.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+const size_t VIRTUAL_ALLOCATOR_COMMIT_SIZE = 2 * 1024 * 1024;
+
+const size_t SHARED_ALLOCATOR_SMALL_SIZE = 256;
+const size_t SHARED_ALLOCATOR_CHUNK_SIZE = 16 * 1024;
+
+// Chunk of shared allocator owned by current thread. Only one is cached,
+// threads using several shared allocators just refill more often.
+struct SharedAllocatorChunk {
+  Allocator *owner;
+  uint64_t generation;
+  char *current;
+  char *end;
+};
+static thread_local SharedAllocatorChunk sharedAllocatorChunk;
+// Allocator can be reinitialized at the same address, so generations are
+// unique across all allocators
+static uint64_t allocatorGenerations;
+
+uint64_t nextAllocatorGeneration() {
+  return __atomic_add_fetch(&allocatorGenerations, 1, __ATOMIC_RELAXED);
+}
 
 void initAllocator(Allocator *a, char *start, int64_t size) {
   //memset(start, 0, size);
+  *a = {};
   a->start = start;
   a->current = start;
   a->end = start + size;
 }
 
+void initVirtualAllocator(Allocator *a, void *address, size_t size, uint32_t flags) {
+  //NOTE: addr and length should be multiple of 4096 (page size on linux)
+  if (size % 4096 || (uint64_t)address % 4096) {
+    fprintf(stderr, "%s:%d Memory size or address is not multiple of 4096\n",
+      __FILE__, __LINE__);
+    abort();
+  }
+
+  auto mmapFlags = MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE;
+  if (address) mmapFlags |= MAP_FIXED_NOREPLACE;
+  auto memory = mmap(address, size, PROT_NONE, mmapFlags, -1, 0);
+  if (memory == MAP_FAILED) {
+    fprintf(stderr, "%s:%d Failed to reserve memory because: %s\n",
+      __FILE__, __LINE__,
+      strerror(errno));
+    abort();
+  }
+
+  initAllocator(a, (char *)memory, size);
+  a->committed = a->start;
+  a->flags = flags;
+  a->generation = nextAllocatorGeneration();
+}
+
+void deinitVirtualAllocator(Allocator *a) {
+  munmap(a->start, a->end - a->start);
+  *a = {};
+}
+
+void lockAllocatorFlag(bool *flag) {
+  while (__atomic_exchange_n(flag, true, __ATOMIC_ACQUIRE)) {
+  }
+}
+
+void unlockAllocatorFlag(bool *flag) {
+  __atomic_store_n(flag, false, __ATOMIC_RELEASE);
+}
+
+void commitAllocatorMemory(Allocator *a, char *upTo) {
+  lockAllocatorFlag(&a->commitLocked);
+
+  // Another thread could have committed it while we were waiting
+  auto committed = __atomic_load_n(&a->committed, __ATOMIC_RELAXED);
+  if (upTo > committed) {
+    auto newCommitted = (char *)alignAddressUpwards((uint64_t)upTo, VIRTUAL_ALLOCATOR_COMMIT_SIZE);
+    if (newCommitted > a->end) newCommitted = a->end;
+
+    auto size = newCommitted - committed;
+    if (mprotect(committed, size, PROT_READ|PROT_WRITE)) {
+      fprintf(stderr, "%s:%d Failed to commit memory because: %s\n",
+        __FILE__, __LINE__,
+        strerror(errno));
+      abort();
+    }
+    // Best effort, kernel may have THP disabled
+    if (a->flags & ALLOCATOR_FLAG_HUGE_PAGES) madvise(committed, size, MADV_HUGEPAGE);
+
+    __atomic_store_n(&a->committed, newCommitted, __ATOMIC_RELEASE);
+  }
+
+  unlockAllocatorFlag(&a->commitLocked);
+}
+
+void initGrowableAllocator(Allocator *a, Allocator *reservoir,
+                           size_t initialBlockSize, uint32_t flags) {
+  *a = {};
+  a->reservoir = reservoir;
+  a->flags = flags;
+  a->nextBlockSize = initialBlockSize;
+}
+
+void useBlock(Allocator *a, AllocatorBlock *block) {
+  a->block = block;
+  a->start = (char *)(block + 1);
+  a->current = a->start;
+  a->end = block->end;
+}
+
+bool blockFits(AllocatorBlock *block, size_t size, size_t alignment) {
+  auto data = alignAddressUpwards((uint64_t)(block + 1), alignment);
+  return data + size <= (uint64_t)block->end;
+}
+
+// First fit is fine: released blocks come from geometric series, so there
+// are few distinct sizes
+AllocatorBlock *takeFreeBlock(Allocator *reservoir, size_t size, size_t alignment) {
+  if (!__atomic_load_n(&reservoir->freeBlocks, __ATOMIC_RELAXED)) return NULL;
+
+  AllocatorBlock *result = NULL;
+  lockAllocatorFlag(&reservoir->freeBlocksLocked);
+  for (auto link = &reservoir->freeBlocks; *link; link = &(*link)->next) {
+    if (blockFits(*link, size, alignment)) {
+      result = *link;
+      *link = result->next;
+      break;
+    }
+  }
+  unlockAllocatorFlag(&reservoir->freeBlocksLocked);
+  return result;
+}
+
+// Moves to the next block which can fit `size` bytes with given alignment,
+// reusing blocks left after rewinding when they are big enough
+void growAllocator(Allocator *a, size_t size, size_t alignment) {
+  if (!a->reservoir) {
+    fprintf(stderr, "%s:%d Allocator is out of memory\n", __FILE__, __LINE__);
+    abort();
+  }
+
+  auto next = a->block ? a->block->next : NULL;
+  if (next && blockFits(next, size, alignment)) {
+    useBlock(a, next);
+    return;
+  }
+
+  auto pageBlocks = a->flags & (ALLOCATOR_FLAG_NUMA_LOCAL|ALLOCATOR_FLAG_RELEASABLE);
+  auto block = pageBlocks ? takeFreeBlock(a->reservoir, size, alignment) : NULL;
+
+  if (!block) {
+    auto blockSize = a->nextBlockSize;
+    while (blockSize < sizeof(AllocatorBlock) + size + alignment) blockSize *= 2;
+    a->nextBlockSize = blockSize * 2;
+
+    char *memory = NULL;
+    if (pageBlocks) {
+      // Block sizes are multiple of page size, so no page is shared with
+      // blocks of other threads or regions
+      blockSize = alignAddressUpwards(blockSize, 4096);
+      memory = (char *)alloc(blockSize, 4096, 1, a->reservoir);
+    } else {
+      memory = (char *)alloc(blockSize, alignof(AllocatorBlock), 1, a->reservoir);
+    }
+    block = (AllocatorBlock *)memory;
+    block->end = memory + blockSize;
+  }
+  if (a->flags & ALLOCATOR_FLAG_NUMA_LOCAL) {
+    preferNumaNode(block, block->end - (char *)block, currentNumaNode());
+  }
+
+  // Blocks left after rewinding which were too small stay chained after the
+  // new one: they are reused once it is full, and released with the rest
+  block->prev = a->block;
+  block->next = next;
+  if (next) next->prev = block;
+  if (a->block) a->block->next = block;
+  useBlock(a, block);
+}
+
+void *bumpShared(Allocator *a, size_t bytes, size_t alignment) {
+  auto current = __atomic_load_n(&a->current, __ATOMIC_RELAXED);
+  char *result = NULL;
+  do {
+    result = (char *) alignAddressUpwards((intptr_t)current, alignment);
+    if (result + bytes > a->end) {
+      fprintf(stderr, "%s:%d Allocator is out of memory\n", __FILE__, __LINE__);
+      abort();
+    }
+  } while (!__atomic_compare_exchange_n(&a->current, &current, result + bytes,
+                                        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  if (a->committed && result + bytes > __atomic_load_n(&a->committed, __ATOMIC_ACQUIRE)) {
+    commitAllocatorMemory(a, result + bytes);
+  }
+  __atomic_add_fetch(&a->allocations, 1, __ATOMIC_RELAXED);
+  return result;
+}
+
+void *allocShared(size_t bytes, size_t alignment, Allocator *a) {
+  if (bytes > SHARED_ALLOCATOR_SMALL_SIZE) return bumpShared(a, bytes, alignment);
+
+  auto chunk = &sharedAllocatorChunk;
+  auto generation = __atomic_load_n(&a->generation, __ATOMIC_RELAXED);
+  if (chunk->owner != a || chunk->generation != generation) {
+    *chunk = {};
+    chunk->owner = a;
+    chunk->generation = generation;
+  }
+
+  auto result = (char *) alignAddressUpwards((intptr_t)chunk->current, alignment);
+  if (!chunk->current || result + bytes > chunk->end) {
+    // Rest of the old chunk is wasted, at most SHARED_ALLOCATOR_SMALL_SIZE
+    chunk->current = (char *)bumpShared(a, SHARED_ALLOCATOR_CHUNK_SIZE, 64);
+    chunk->end = chunk->current + SHARED_ALLOCATOR_CHUNK_SIZE;
+    result = (char *) alignAddressUpwards((intptr_t)chunk->current, alignment);
+  }
+  chunk->current = result + bytes;
+  return result;
+}
+
 void *alloc(size_t size, size_t alignment, int n, Allocator *allocator) {
   if (n == 0) return NULL;
 
-  allocator->current = (char *) alignAddressUpwards((intptr_t)allocator->current, alignment);
-  auto result = allocator->current;
+  auto bytes = size * n;
+  if (allocator->flags & ALLOCATOR_FLAG_SHARED) return allocShared(bytes, alignment, allocator);
+
+  auto result = (char *) alignAddressUpwards((intptr_t)allocator->current, alignment);
+  if (!allocator->current || result + bytes > allocator->end) {
+    growAllocator(allocator, bytes, alignment);
+    result = (char *) alignAddressUpwards((intptr_t)allocator->current, alignment);
+  }
 
-  allocator->current += size * n;
-  if (allocator->current >= allocator->end) abort();
+  if (allocator->committed && result + bytes > allocator->committed) {
+    commitAllocatorMemory(allocator, result + bytes);
+  }
+
+  allocator->current = result + bytes;
   allocator->allocations++;
 
   return result;
@@ -31,11 +256,73 @@ void *realloc(void *oldData, size_t size, size_t alignment, size_t oldLength, si
 }
 
 size_t usage(Allocator *a) {
-  return (a->current - a->start);
+  size_t result = a->current - a->start;
+  for (auto block = a->block ? a->block->prev : NULL; block; block = block->prev) {
+    result += block->end - (char *)(block + 1);
+  }
+  return result;
 }
 
 void reset(Allocator *a) {
-  a->current = a->start;
+  if (a->committed) {
+    // Pages stay accessible, their memory is given back. Content read from
+    // them afterwards is unspecified: zeroes, or snapshot the arena was
+    // restored from (see restoreCompilerSnapshot)
+    madvise(a->start, a->committed - a->start, MADV_DONTNEED);
+  }
+  a->generation = nextAllocatorGeneration();
+  a->freeBlocks = NULL;
+  if (!a->block) {
+    a->current = a->start;
+    return;
+  }
+
+  auto first = a->block;
+  while (first->prev) first = first->prev;
+  useBlock(a, first);
+}
+
+void releaseAllocator(Allocator *a) {
+  if (!a->block) return;
+  assert(a->flags & ALLOCATOR_FLAG_RELEASABLE);
+
+  auto first = a->block;
+  while (first->prev) first = first->prev;
+  auto last = first;
+  while (last->next) last = last->next;
+
+  // Memory of pages after the header page is given back, content of a reused
+  // block is unspecified
+  for (auto block = first; block; block = block->next) {
+    auto pages = (char *)block + 4096;
+    if (pages < block->end) madvise(pages, block->end - pages, MADV_DONTNEED);
+  }
+
+  auto reservoir = a->reservoir;
+  lockAllocatorFlag(&reservoir->freeBlocksLocked);
+  last->next = reservoir->freeBlocks;
+  reservoir->freeBlocks = first;
+  unlockAllocatorFlag(&reservoir->freeBlocksLocked);
+
+  auto flags = a->flags;
+  auto nextBlockSize = a->nextBlockSize;
+  initGrowableAllocator(a, reservoir, nextBlockSize, flags);
+}
+
+AllocatorPosition allocatorPosition(Allocator *a) {
+  return AllocatorPosition{a->block, a->current};
+}
+
+void rewindAllocator(Allocator *a, AllocatorPosition position) {
+  if (position.block != a->block) {
+    if (position.block) {
+      useBlock(a, position.block);
+    } else {
+      // Position was taken before first block was allocated
+      reset(a);
+    }
+  }
+  if (position.current) a->current = position.current;
 }
 
 
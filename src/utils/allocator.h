@@ -3,22 +3,91 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+// Header of a block owned by growable allocator, data follows it
+struct AllocatorBlock {
+  AllocatorBlock *prev;
+  AllocatorBlock *next; // kept after rewinding so it can be reused
+  char *end;
+};
+
+enum AllocatorFlag {
+  // Ask for transparent huge pages, fewer TLB misses for big AST-heavy arenas
+  ALLOCATOR_FLAG_HUGE_PAGES = 1 << 0,
+  // Safe to allocate from concurrently: bump pointer is advanced atomically,
+  // small objects are carved from per-thread chunks
+  ALLOCATOR_FLAG_SHARED = 1 << 1,
+  // Growable allocator takes whole pages from reservoir and places them on
+  // NUMA node of the thread which grows it
+  ALLOCATOR_FLAG_NUMA_LOCAL = 1 << 2,
+  // Growable allocator takes whole pages from reservoir, so they can be
+  // given back with releaseAllocator
+  ALLOCATOR_FLAG_RELEASABLE = 1 << 3,
+};
+
 struct Allocator {
   char *start;
   char *current;
   char *end;
   size_t allocations;
+
+  // Virtual allocators reserve [start, end) and make pages accessible in
+  // chunks as current moves past committed
+  char *committed;
+  uint32_t flags;
+  bool commitLocked;
+  uint64_t generation; // changed by reset, invalidates per-thread chunks
+  // Blocks released by growable allocators, reused before taking new memory
+  AllocatorBlock *freeBlocks;
+  bool freeBlocksLocked;
+
+  // Growable allocators chain blocks taken from reservoir instead of
+  // aborting when block is full, block sizes grow geometrically
+  Allocator *reservoir; // should be shared if used by several threads
+  AllocatorBlock *block;
+  size_t nextBlockSize;
+};
+
+// Position to rewind to, stays valid across block boundaries
+struct AllocatorPosition {
+  AllocatorBlock *block;
+  char *current;
 };
 
 void initAllocator(Allocator *a, char *start, int64_t size);
+// Reserves size bytes of address space (at fixed address if it is not NULL)
+void initVirtualAllocator(Allocator *a, void *address, size_t size, uint32_t flags);
+void deinitVirtualAllocator(Allocator *a);
+void initGrowableAllocator(Allocator *a, Allocator *reservoir,
+                           size_t initialBlockSize, uint32_t flags = 0);
 
 void *alloc(size_t size, size_t alignment, int n, Allocator *allocator);
 void *realloc(void *oldData, size_t size, size_t alignment, size_t oldLength,
               size_t newCap, Allocator *allocator);
+// Returns all blocks of releasable allocator to its reservoir and gives their
+// pages back to the OS, allocator is empty afterwards
+void releaseAllocator(Allocator *a);
 size_t usage(Allocator *a);
+// Virtual allocators also give committed pages back to the OS.
+// Shared allocators should not be used by other threads during reset.
 void reset(Allocator *a);
+AllocatorPosition allocatorPosition(Allocator *a);
+void rewindAllocator(Allocator *a, AllocatorPosition position);
 uint64_t alignAddressUpwards(uint64_t ptr, uint64_t alignment);
 
+// Rewinds allocator to the position it had when checkpoint was created, once
+// checkpoint goes out of scope
+struct AllocatorCheckpoint {
+  Allocator *allocator;
+  AllocatorPosition position;
+
+  AllocatorCheckpoint(Allocator *a)
+      : allocator(a), position(allocatorPosition(a)) {}
+  ~AllocatorCheckpoint() { rewindAllocator(allocator, position); }
+
+  AllocatorCheckpoint(const AllocatorCheckpoint &) = delete;
+  AllocatorCheckpoint &operator=(const AllocatorCheckpoint &) = delete;
+};
+
 #define ALLOC(TYPE, ALLOCATOR)                                                 \
   ((TYPE *)alloc(sizeof(TYPE), alignof(TYPE), 1, (ALLOCATOR)))
 
@@ -50,3 +50,16 @@ void append(Array<T> *arr, T item, Allocator *a) {
   arr->data[arr->len] = item;
   arr->len++;
 }
+
+// Copy with exact capacity, used to move arrays built in scratch memory
+// into permanent one
+template<typename T>
+Array<T> copyArray(Array<T> arr, Allocator *a) {
+  Array<T> result = {};
+  if (arr.len) {
+    result.data = (T *)realloc(arr.data, sizeof(T), alignof(T), arr.len, arr.len, a);
+    result.len = arr.len;
+    result.cap = arr.len;
+  }
+  return result;
+}
@@ -0,0 +1,96 @@
+#include "fiber.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+
+#if !defined(__x86_64__)
+#error "Fibers are implemented only for x86-64"
+#endif
+
+// Stack layout of suspended context (growing down):
+//   return address, rbp, rbx, r12, r13, r14, r15, mxcsr + x87 control word
+asm(R"(
+  .text
+  .globl switchFiberContext
+  .type switchFiberContext, @function
+switchFiberContext:
+  pushq %rbp
+  pushq %rbx
+  pushq %r12
+  pushq %r13
+  pushq %r14
+  pushq %r15
+  subq $8, %rsp
+  stmxcsr (%rsp)
+  fnstcw 4(%rsp)
+  movq %rsp, (%rdi)
+  movq (%rsi), %rsp
+  ldmxcsr (%rsp)
+  fldcw 4(%rsp)
+  addq $8, %rsp
+  popq %r15
+  popq %r14
+  popq %r13
+  popq %r12
+  popq %rbx
+  popq %rbp
+  ret
+  .size switchFiberContext, .-switchFiberContext
+
+  .globl fiberTrampoline
+  .type fiberTrampoline, @function
+fiberTrampoline:
+  movq %r12, %rdi
+  callq *%r13
+  ud2
+  .size fiberTrampoline, .-fiberTrampoline
+)");
+
+extern "C" void fiberTrampoline();
+
+FiberStack allocFiberStack(size_t size) {
+  const size_t pageSize = 4096;
+  FiberStack result = {};
+  result.size = ((size + pageSize - 1) / pageSize + 1) * pageSize;
+  result.memory = (char *) mmap(NULL, result.size, PROT_READ|PROT_WRITE,
+      MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK|MAP_NORESERVE, -1, 0);
+  if (result.memory == MAP_FAILED) {
+    fprintf(stderr, "%s:%d Failed to mmap fiber stack because: %s\n",
+      __FILE__, __LINE__, strerror(errno));
+    abort();
+  }
+  // Guard page turns stack overflow into segfault instead of memory corruption
+  if (mprotect(result.memory, pageSize, PROT_NONE) != 0) {
+    fprintf(stderr, "%s:%d Failed to mprotect fiber stack guard because: %s\n",
+      __FILE__, __LINE__, strerror(errno));
+    abort();
+  }
+  return result;
+}
+
+void freeFiberStack(FiberStack *stack) {
+  if (stack->memory) munmap(stack->memory, stack->size);
+  *stack = {};
+}
+
+void initFiberContext(FiberContext *context, FiberStack *stack, FiberEntry entry, void *arg) {
+  auto top = (uint64_t *)(((uintptr_t)(stack->memory + stack->size)) & ~(uintptr_t)15);
+
+  // After "ret" into trampoline rsp is 16 bytes aligned, as required before call
+  top[-1] = (uint64_t) fiberTrampoline;
+  top[-2] = 0;                  // rbp
+  top[-3] = 0;                  // rbx
+  top[-4] = (uint64_t) arg;     // r12
+  top[-5] = (uint64_t) entry;   // r13
+  top[-6] = 0;                  // r14
+  top[-7] = 0;                  // r15
+  uint32_t controlWords[2] = {0x1F80, 0x037F}; // default mxcsr and x87 cw
+  memcpy(top - 8, controlWords, sizeof(controlWords));
+
+  context->stackPointer = top - 8;
+}
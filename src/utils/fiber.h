@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+
+// Minimal user-space context switching (x86-64 SysV only).
+// Switch saves callee-saved registers on the current stack, so it costs
+// a few nanoseconds instead of a syscall like swapcontext does.
+struct FiberContext {
+  void *stackPointer;
+};
+
+typedef void (*FiberEntry)(void *arg);
+
+struct FiberStack {
+  char *memory; // includes guard page
+  size_t size;
+};
+
+FiberStack allocFiberStack(size_t size);
+void freeFiberStack(FiberStack *stack);
+
+// First switch to context calls entry(arg), entry should never return
+void initFiberContext(FiberContext *context, FiberStack *stack, FiberEntry entry, void *arg);
+
+extern "C" void switchFiberContext(FiberContext *from, FiberContext *to);
@@ -23,3 +23,15 @@ FileReadResult readFile(Allocator *a, const char *filename) {
 
   return result;
 }
+
+Str pathRelativeTo(const char *directory, Str absolutePath) {
+  auto directoryLen = strlen(directory);
+  Str result = absolutePath;
+  if (absolutePath.len > directoryLen + 1 &&
+      memcmp(absolutePath.data, directory, directoryLen) == 0 &&
+      absolutePath.data[directoryLen] == '/') {
+    result.data += directoryLen + 1;
+    result.len -= directoryLen + 1;
+  }
+  return result;
+}
@@ -9,3 +9,6 @@ struct FileReadResult {
 };
 
 FileReadResult readFile(Allocator *a, const char *filename);
+
+// Part of absolute path after directory, whole path if it is outside of it
+Str pathRelativeTo(const char *directory, Str absolutePath);
@@ -0,0 +1,88 @@
+#include "hash.h"
+
+#include <string.h>
+
+const uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ull;
+const uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4Full;
+const uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ull;
+const uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ull;
+const uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ull;
+
+uint64_t rotateLeft(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+uint64_t read64(const uint8_t *p) {
+  uint64_t result;
+  memcpy(&result, p, sizeof(result));
+  return result;
+}
+
+uint32_t read32(const uint8_t *p) {
+  uint32_t result;
+  memcpy(&result, p, sizeof(result));
+  return result;
+}
+
+uint64_t xxhRound(uint64_t acc, uint64_t input) {
+  acc += input * XXH_PRIME64_2;
+  acc = rotateLeft(acc, 31);
+  return acc * XXH_PRIME64_1;
+}
+
+uint64_t xxhMergeRound(uint64_t acc, uint64_t value) {
+  acc ^= xxhRound(0, value);
+  return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+uint64_t hashMemory(const void *data, size_t len, uint64_t seed) {
+  auto p = (const uint8_t *)data;
+  auto end = p + len;
+  uint64_t h;
+
+  if (len >= 32) {
+    // Four independent lanes keep several multiplications in flight
+    uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    uint64_t v2 = seed + XXH_PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - XXH_PRIME64_1;
+    auto limit = end - 32;
+    do {
+      v1 = xxhRound(v1, read64(p));
+      v2 = xxhRound(v2, read64(p + 8));
+      v3 = xxhRound(v3, read64(p + 16));
+      v4 = xxhRound(v4, read64(p + 24));
+      p += 32;
+    } while (p <= limit);
+
+    h = rotateLeft(v1, 1) + rotateLeft(v2, 7) + rotateLeft(v3, 12) + rotateLeft(v4, 18);
+    h = xxhMergeRound(h, v1);
+    h = xxhMergeRound(h, v2);
+    h = xxhMergeRound(h, v3);
+    h = xxhMergeRound(h, v4);
+  } else {
+    h = seed + XXH_PRIME64_5;
+  }
+  h += len;
+
+  for (; p + 8 <= end; p += 8) {
+    h ^= xxhRound(0, read64(p));
+    h = rotateLeft(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+  }
+  if (p + 4 <= end) {
+    h ^= (uint64_t)read32(p) * XXH_PRIME64_1;
+    h = rotateLeft(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+    p += 4;
+  }
+  for (; p < end; ++p) {
+    h ^= (*p) * XXH_PRIME64_5;
+    h = rotateLeft(h, 11) * XXH_PRIME64_1;
+  }
+
+  h ^= h >> 33;
+  h *= XXH_PRIME64_2;
+  h ^= h >> 29;
+  h *= XXH_PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// XXH64, fast non-cryptographic hash of memory, stable across runs and
+// machines of same endianness, so it can name files on disk
+uint64_t hashMemory(const void *data, size_t len, uint64_t seed);
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "array.h"
+
+// Binary max-heap on top of Array, LESS(a, b) should return true when a has
+// lower priority than b
+
+template<typename T, typename LESS>
+void heapPush(Array<T> *heap, T item, LESS less, Allocator *a) {
+  append(heap, item, a);
+
+  uint32_t i = heap->len - 1;
+  while (i > 0) {
+    uint32_t parent = (i - 1) / 2;
+    if (!less(heap->data[parent], heap->data[i])) break;
+    T tmp = heap->data[parent];
+    heap->data[parent] = heap->data[i];
+    heap->data[i] = tmp;
+    i = parent;
+  }
+}
+
+template<typename T, typename LESS>
+T heapPop(Array<T> *heap, LESS less) {
+  assert(heap->len > 0);
+
+  T result = heap->data[0];
+  heap->len--;
+  if (heap->len == 0) return result;
+
+  heap->data[0] = heap->data[heap->len];
+  uint32_t i = 0;
+  for (;;) {
+    uint32_t left = 2 * i + 1;
+    uint32_t right = left + 1;
+    uint32_t largest = i;
+    if (left < heap->len && less(heap->data[largest], heap->data[left])) largest = left;
+    if (right < heap->len && less(heap->data[largest], heap->data[right])) largest = right;
+    if (largest == i) break;
+    T tmp = heap->data[largest];
+    heap->data[largest] = heap->data[i];
+    heap->data[i] = tmp;
+    i = largest;
+  }
+  return result;
+}
@@ -0,0 +1,146 @@
+#include "iouring.h"
+
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+bool initIOUring(IOUring *ring, unsigned entries) {
+  *ring = {};
+  ring->fd = -1;
+
+  io_uring_params params = {};
+  int fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0) return false;
+
+  ring->fd = fd;
+  ring->features = params.features;
+
+  ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cqRingSize > ring->sqRingSize) ring->sqRingSize = ring->cqRingSize;
+    ring->cqRingSize = ring->sqRingSize;
+  }
+
+  ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ|PROT_WRITE,
+      MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring->sqRing == MAP_FAILED) {
+    close(fd);
+    *ring = {};
+    ring->fd = -1;
+    return false;
+  }
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cqRing = ring->sqRing;
+  } else {
+    ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (ring->cqRing == MAP_FAILED) {
+      munmap(ring->sqRing, ring->sqRingSize);
+      close(fd);
+      *ring = {};
+      ring->fd = -1;
+      return false;
+    }
+  }
+
+  ring->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+  ring->sqes = (io_uring_sqe *) mmap(NULL, ring->sqesSize,
+      PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    if (ring->cqRing != ring->sqRing) munmap(ring->cqRing, ring->cqRingSize);
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(fd);
+    *ring = {};
+    ring->fd = -1;
+    return false;
+  }
+
+  auto sq = (char *) ring->sqRing;
+  ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+  ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+  ring->sqEntries = params.sq_entries;
+  ring->sqeTail = *ring->sqTail;
+
+  auto cq = (char *) ring->cqRing;
+  ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+  ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+  ring->cqEntries = params.cq_entries;
+
+  return true;
+}
+
+void deinitIOUring(IOUring *ring) {
+  if (ring->fd < 0) return;
+  munmap(ring->sqes, ring->sqesSize);
+  if (ring->cqRing != ring->sqRing) munmap(ring->cqRing, ring->cqRingSize);
+  munmap(ring->sqRing, ring->sqRingSize);
+  close(ring->fd);
+  *ring = {};
+  ring->fd = -1;
+}
+
+bool supportsOpcode(IOUring *ring, int opcode) {
+  char buffer[sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op)] = {};
+  auto probe = (io_uring_probe *) buffer;
+
+  int result = (int) syscall(__NR_io_uring_register, ring->fd,
+      IORING_REGISTER_PROBE, probe, 256);
+  if (result < 0) return false;
+  if (opcode > probe->last_op) return false;
+  return probe->ops[opcode].flags & IO_URING_OP_SUPPORTED;
+}
+
+unsigned freeSQEs(IOUring *ring) {
+  auto head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+  return ring->sqEntries - (ring->sqeTail - head);
+}
+
+io_uring_sqe *getSQE(IOUring *ring) {
+  if (freeSQEs(ring) == 0) return NULL;
+
+  auto sqe = &ring->sqes[ring->sqeTail & *ring->sqMask];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sqeTail++;
+  return sqe;
+}
+
+int submitAndWait(IOUring *ring, unsigned waitNr) {
+  auto tail = *ring->sqTail;
+  unsigned toSubmit = ring->sqeTail - tail;
+  for (; tail != ring->sqeTail; ++tail) {
+    ring->sqArray[tail & *ring->sqMask] = tail & *ring->sqMask;
+  }
+  __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+
+  unsigned flags = waitNr ? IORING_ENTER_GETEVENTS : 0;
+  for (;;) {
+    int result = (int) syscall(__NR_io_uring_enter, ring->fd, toSubmit, waitNr,
+        flags, NULL, 0);
+    if (result < 0 && errno == EINTR) {
+      //NOTE: sqes were not consumed if the call was interrupted before submit
+      toSubmit = ring->sqeTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+      continue;
+    }
+    return result;
+  }
+}
+
+io_uring_cqe *peekCQE(IOUring *ring) {
+  auto head = *ring->cqHead;
+  auto tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+  if (head == tail) return NULL;
+  return &ring->cqes[head & *ring->cqMask];
+}
+
+void seenCQE(IOUring *ring) {
+  __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
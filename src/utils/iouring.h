@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <linux/io_uring.h>
+
+// Minimal io_uring wrapper on top of raw syscalls (no liburing dependency).
+// Not thread safe: a ring is owned by a single thread.
+struct IOUring {
+  int fd;
+  unsigned features;
+
+  unsigned *sqHead;
+  unsigned *sqTail;
+  unsigned *sqMask;
+  unsigned *sqArray;
+  unsigned sqEntries;
+  unsigned sqeTail; // sqes prepared locally but not published yet
+  io_uring_sqe *sqes;
+
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned *cqMask;
+  unsigned cqEntries;
+  io_uring_cqe *cqes;
+
+  void *sqRing;
+  size_t sqRingSize;
+  void *cqRing;
+  size_t cqRingSize;
+  size_t sqesSize;
+};
+
+bool initIOUring(IOUring *ring, unsigned entries);
+void deinitIOUring(IOUring *ring);
+bool supportsOpcode(IOUring *ring, int opcode);
+
+// Returns zeroed sqe or NULL when submission queue is full
+io_uring_sqe *getSQE(IOUring *ring);
+unsigned freeSQEs(IOUring *ring);
+int submitAndWait(IOUring *ring, unsigned waitNr);
+
+io_uring_cqe *peekCQE(IOUring *ring);
+void seenCQE(IOUring *ring);
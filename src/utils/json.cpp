@@ -0,0 +1,276 @@
+#include "json.h"
+
+#include <stdlib.h>
+
+// Nesting deeper than this is rejected instead of overflowing the stack
+const int JSON_MAX_DEPTH = 128;
+
+struct JsonParser {
+  const char *it;
+  const char *end;
+  Allocator *a;
+};
+
+JsonValue *parseJsonValue(JsonParser *p, int depth);
+
+void skipJsonWhitespace(JsonParser *p) {
+  while (p->it < p->end && (*p->it == ' ' || *p->it == '\t' || *p->it == '\n' || *p->it == '\r')) {
+    p->it++;
+  }
+}
+
+bool matchJsonLiteral(JsonParser *p, const char *literal) {
+  auto len = strlen(literal);
+  if ((size_t)(p->end - p->it) < len || memcmp(p->it, literal, len) != 0) return false;
+  p->it += len;
+  return true;
+}
+
+int hexDigitValue(char c) {
+  if ('0' <= c && c <= '9') return c - '0';
+  if ('a' <= c && c <= 'f') return c - 'a' + 10;
+  if ('A' <= c && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+bool parseJsonHex4(JsonParser *p, uint32_t *result) {
+  if (p->end - p->it < 4) return false;
+  *result = 0;
+  for (int i = 0; i < 4; ++i) {
+    auto digit = hexDigitValue(p->it[i]);
+    if (digit < 0) return false;
+    *result = *result * 16 + digit;
+  }
+  p->it += 4;
+  return true;
+}
+
+char *appendUTF8(char *to, uint32_t codepoint) {
+  if (codepoint < 0x80) {
+    *to++ = codepoint;
+  } else if (codepoint < 0x800) {
+    *to++ = 0xC0 | (codepoint >> 6);
+    *to++ = 0x80 | (codepoint & 0x3F);
+  } else if (codepoint < 0x10000) {
+    *to++ = 0xE0 | (codepoint >> 12);
+    *to++ = 0x80 | ((codepoint >> 6) & 0x3F);
+    *to++ = 0x80 | (codepoint & 0x3F);
+  } else {
+    *to++ = 0xF0 | (codepoint >> 18);
+    *to++ = 0x80 | ((codepoint >> 12) & 0x3F);
+    *to++ = 0x80 | ((codepoint >> 6) & 0x3F);
+    *to++ = 0x80 | (codepoint & 0x3F);
+  }
+  return to;
+}
+
+// Unescaped string is never longer than the escaped one
+bool parseJsonString(JsonParser *p, Str *result) {
+  if (p->it == p->end || *p->it != '"') return false;
+  p->it++;
+  auto start = p->it;
+  while (p->it < p->end && *p->it != '"') {
+    if (*p->it == '\\') p->it++;
+    p->it++;
+  }
+  if (p->it >= p->end) return false;
+  auto escapedEnd = p->it;
+  p->it++;
+
+  auto to = ALLOC_ARRAY(char, escapedEnd - start + 1, p->a);
+  result->data = to;
+  for (auto from = start; from < escapedEnd;) {
+    if (*from != '\\') {
+      *to++ = *from++;
+      continue;
+    }
+    from++;
+    switch (*from++) {
+    case '"': *to++ = '"'; break;
+    case '\\': *to++ = '\\'; break;
+    case '/': *to++ = '/'; break;
+    case 'b': *to++ = '\b'; break;
+    case 'f': *to++ = '\f'; break;
+    case 'n': *to++ = '\n'; break;
+    case 'r': *to++ = '\r'; break;
+    case 't': *to++ = '\t'; break;
+    case 'u': {
+      JsonParser hex = {from, escapedEnd, p->a};
+      uint32_t codepoint = 0;
+      if (!parseJsonHex4(&hex, &codepoint)) return false;
+      // Surrogate pair encodes code point above the basic plane
+      uint32_t low = 0;
+      if (0xD800 <= codepoint && codepoint < 0xDC00 && escapedEnd - hex.it >= 6 &&
+          hex.it[0] == '\\' && hex.it[1] == 'u') {
+        hex.it += 2;
+        if (!parseJsonHex4(&hex, &low) || low < 0xDC00 || low >= 0xE000) return false;
+        codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+      }
+      to = appendUTF8(to, codepoint);
+      from = hex.it;
+    } break;
+    default: return false;
+    }
+  }
+  result->len = to - result->data;
+  return true;
+}
+
+bool parseJsonNumber(JsonParser *p, double *result) {
+  // strtod accepts more than JSON does (hex, inf), check the shape first
+  auto it = p->it;
+  if (it < p->end && *it == '-') it++;
+  if (it == p->end || !('0' <= *it && *it <= '9')) return false;
+  while (it < p->end && (('0' <= *it && *it <= '9') || *it == '.' || *it == 'e' ||
+                         *it == 'E' || *it == '+' || *it == '-')) {
+    it++;
+  }
+  char buffer[64];
+  if (it - p->it >= (ptrdiff_t)sizeof(buffer)) return false;
+  memcpy(buffer, p->it, it - p->it);
+  buffer[it - p->it] = '\0';
+  char *parsedEnd = NULL;
+  *result = strtod(buffer, &parsedEnd);
+  if (parsedEnd != buffer + (it - p->it)) return false;
+  p->it = it;
+  return true;
+}
+
+JsonValue *parseJsonValue(JsonParser *p, int depth) {
+  if (depth > JSON_MAX_DEPTH) return NULL;
+  skipJsonWhitespace(p);
+  if (p->it == p->end) return NULL;
+
+  auto value = ALLOC(JsonValue, p->a);
+  *value = {};
+  switch (*p->it) {
+  case 'n':
+    if (!matchJsonLiteral(p, "null")) return NULL;
+    value->type = JSON_NULL;
+    break;
+  case 't':
+  case 'f':
+    value->type = JSON_BOOL;
+    value->boolean = *p->it == 't';
+    if (!matchJsonLiteral(p, value->boolean ? "true" : "false")) return NULL;
+    break;
+  case '"':
+    value->type = JSON_STRING;
+    if (!parseJsonString(p, &value->string)) return NULL;
+    break;
+  case '[':
+  case '{': {
+    bool isObject = *p->it == '{';
+    char closing = isObject ? '}' : ']';
+    value->type = isObject ? JSON_OBJECT : JSON_ARRAY;
+    p->it++;
+    skipJsonWhitespace(p);
+    if (p->it < p->end && *p->it == closing) {
+      p->it++;
+      break;
+    }
+    for (;;) {
+      if (isObject) {
+        Str key = {};
+        skipJsonWhitespace(p);
+        if (!parseJsonString(p, &key)) return NULL;
+        skipJsonWhitespace(p);
+        if (p->it == p->end || *p->it != ':') return NULL;
+        p->it++;
+        append(&value->keys, key, p->a);
+      }
+      auto item = parseJsonValue(p, depth + 1);
+      if (!item) return NULL;
+      append(&value->items, item, p->a);
+
+      skipJsonWhitespace(p);
+      if (p->it == p->end) return NULL;
+      if (*p->it == ',') {
+        p->it++;
+      } else if (*p->it == closing) {
+        p->it++;
+        break;
+      } else {
+        return NULL;
+      }
+    }
+  } break;
+  default:
+    value->type = JSON_NUMBER;
+    if (!parseJsonNumber(p, &value->number)) return NULL;
+  }
+  return value;
+}
+
+JsonValue *parseJson(Str text, Allocator *a) {
+  JsonParser p = {text.data, text.data + text.len, a};
+  auto value = parseJsonValue(&p, 0);
+  skipJsonWhitespace(&p);
+  return p.it == p.end ? value : NULL;
+}
+
+JsonValue *jsonGet(JsonValue *object, const char *key) {
+  if (!object || object->type != JSON_OBJECT) return NULL;
+  auto keyStr = CStringToStr(key);
+  for (uint32_t i = 0; i < object->keys.len; ++i) {
+    if (StrEqual(object->keys.data[i], keyStr)) return object->items.data[i];
+  }
+  return NULL;
+}
+
+Str jsonString(JsonValue *value) {
+  if (!value || value->type != JSON_STRING) return {};
+  return value->string;
+}
+
+double jsonNumber(JsonValue *value, double defaultValue) {
+  if (!value || value->type != JSON_NUMBER) return defaultValue;
+  return value->number;
+}
+
+void writeJsonString(FILE *out, Str s) {
+  fputc('"', out);
+  for (size_t i = 0; i < s.len; ++i) {
+    auto c = (unsigned char)s.data[i];
+    switch (c) {
+    case '"': fputs("\\\"", out); break;
+    case '\\': fputs("\\\\", out); break;
+    case '\n': fputs("\\n", out); break;
+    case '\r': fputs("\\r", out); break;
+    case '\t': fputs("\\t", out); break;
+    default:
+      if (c < 0x20) {
+        fprintf(out, "\\u%04x", c);
+      } else {
+        fputc(c, out);
+      }
+    }
+  }
+  fputc('"', out);
+}
+
+void writeJson(FILE *out, JsonValue *value) {
+  if (!value) {
+    fputs("null", out);
+    return;
+  }
+  switch (value->type) {
+  case JSON_NULL: fputs("null", out); break;
+  case JSON_BOOL: fputs(value->boolean ? "true" : "false", out); break;
+  case JSON_NUMBER: fprintf(out, "%.17g", value->number); break;
+  case JSON_STRING: writeJsonString(out, value->string); break;
+  case JSON_ARRAY:
+  case JSON_OBJECT:
+    fputc(value->type == JSON_OBJECT ? '{' : '[', out);
+    for (uint32_t i = 0; i < value->items.len; ++i) {
+      if (i) fputc(',', out);
+      if (value->type == JSON_OBJECT) {
+        writeJsonString(out, value->keys.data[i]);
+        fputc(':', out);
+      }
+      writeJson(out, value->items.data[i]);
+    }
+    fputc(value->type == JSON_OBJECT ? '}' : ']', out);
+    break;
+  }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "allocator.h"
+#include "array.h"
+#include "string.h"
+
+enum JsonType {
+  JSON_NULL,
+  JSON_BOOL,
+  JSON_NUMBER,
+  JSON_STRING,
+  JSON_ARRAY,
+  JSON_OBJECT,
+};
+
+struct JsonValue {
+  JsonType type;
+  bool boolean;
+  double number;
+  Str string; // unescaped
+  Array<JsonValue *> items; // elements of array, values of object
+  Array<Str> keys; // keys of object, same order as items
+};
+
+// Returns NULL if text is not a single valid JSON value. Everything,
+// strings included, is allocated in `a`.
+JsonValue *parseJson(Str text, Allocator *a);
+
+// Member of object, NULL if value is not an object or has no such member
+JsonValue *jsonGet(JsonValue *object, const char *key);
+// Defaults are returned when value is missing or of another type
+Str jsonString(JsonValue *value);
+double jsonNumber(JsonValue *value, double defaultValue);
+
+// -1 if c is not a hex digit
+int hexDigitValue(char c);
+
+void writeJsonString(FILE *out, Str s);
+void writeJson(FILE *out, JsonValue *value);
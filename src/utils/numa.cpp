@@ -0,0 +1,76 @@
+#include "numa.h"
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+const int NUMA_MPOL_PREFERRED = 1; // from linux/mempolicy.h
+
+int numaNodesCount() {
+  static int count = 0;
+  auto cached = __atomic_load_n(&count, __ATOMIC_RELAXED);
+  if (cached) return cached;
+
+  // File contains list of ranges, e.g. "0-1" or "0,2-3"; last one is enough
+  int result = 1;
+  auto f = fopen("/sys/devices/system/node/online", "r");
+  if (f) {
+    char buffer[256] = {};
+    auto len = fread(buffer, 1, sizeof(buffer) - 1, f);
+    fclose(f);
+    while (len && (buffer[len - 1] < '0' || buffer[len - 1] > '9')) len--;
+    auto i = len;
+    while (i && buffer[i - 1] >= '0' && buffer[i - 1] <= '9') i--;
+    if (i < len) result = atoi(buffer + i) + 1;
+  }
+
+  __atomic_store_n(&count, result, __ATOMIC_RELAXED);
+  return result;
+}
+
+int currentNumaNode() {
+  if (numaNodesCount() == 1) return 0;
+  unsigned cpu = 0, node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL)) return 0;
+  return node;
+}
+
+void preferNumaNode(void *memory, size_t size, int node) {
+  if (numaNodesCount() == 1 || node >= 64) return;
+  uint64_t nodeMask = 1ull << node;
+  // Best effort: placement is an optimization, failure is not an error
+  syscall(SYS_mbind, memory, size, NUMA_MPOL_PREFERRED, &nodeMask, 64, 0);
+}
+
+int availableCpusCount() {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set)) return (int)sysconf(_SC_NPROCESSORS_ONLN);
+  return CPU_COUNT(&set);
+}
+
+void getAllowedCpus(cpu_set_t *allowed) {
+  CPU_ZERO(allowed);
+  // Empty set makes pinning fail, threads just stay unpinned
+  if (sched_getaffinity(0, sizeof(*allowed), allowed)) CPU_ZERO(allowed);
+}
+
+bool pinThreadToCpu(const cpu_set_t *allowed, int index) {
+  auto count = CPU_COUNT(allowed);
+  if (!count) return false;
+  index %= count;
+
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (!CPU_ISSET(cpu, allowed)) continue;
+    if (index-- == 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      return sched_setaffinity(0, sizeof(set), &set) == 0;
+    }
+  }
+  return false;
+}
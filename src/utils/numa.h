@@ -0,0 +1,21 @@
+#pragma once
+
+#include <sched.h>
+#include <stddef.h>
+
+// Minimal NUMA helpers on top of raw syscalls (no libnuma dependency).
+// On single node machines all of them are cheap no-ops.
+
+int numaNodesCount();
+// Node of the CPU calling thread currently runs on
+int currentNumaNode();
+// Asks kernel to place pages of page aligned range on given node
+void preferNumaNode(void *memory, size_t size, int node);
+
+int availableCpusCount();
+// Affinity mask of the calling thread, which is the process one until some
+// thread is pinned (threads inherit the mask of their creator)
+void getAllowedCpus(cpu_set_t *allowed);
+// Pins calling thread to index-th CPU (modulo count) of allowed ones,
+// returns false if it is not possible
+bool pinThreadToCpu(const cpu_set_t *allowed, int index);
@@ -12,7 +12,7 @@ struct Str {
 
 #define STR(LITERAL) (Str {(char *)LITERAL, sizeof(LITERAL)-1})
 
-Str StrDup(Str s);
+Str StrDup(Str s, Allocator *a);
 Str SPrintf(Allocator *a, const char *fmt, ...);
 bool StrEqual(Str a, Str b);
 Str CStringToStr(const char *s);
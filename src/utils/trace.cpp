@@ -0,0 +1,130 @@
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clock.h"
+#include "json.h"
+
+struct TraceState {
+  double origin; // start of the trace
+  pthread_mutex_t mutex; // buffers
+  TraceBuffer *buffers;
+  uint32_t threads;
+};
+
+TraceFlags traceFlags = {};
+static TraceState traceState = {0, PTHREAD_MUTEX_INITIALIZER, NULL, 0};
+static thread_local TraceBuffer *traceBuffer;
+static thread_local char traceThreadName[32];
+
+void startTracing(bool parserProductions) {
+  pthread_mutex_lock(&traceState.mutex);
+  for (auto buffer = traceState.buffers; buffer; buffer = buffer->next) {
+    __atomic_store_n(&buffer->written, 0, __ATOMIC_RELAXED);
+  }
+  traceState.origin = now();
+  pthread_mutex_unlock(&traceState.mutex);
+  __atomic_store_n(&traceFlags.parserProductions, parserProductions, __ATOMIC_RELEASE);
+  __atomic_store_n(&traceFlags.enabled, true, __ATOMIC_RELEASE);
+}
+
+void stopTracing() {
+  __atomic_store_n(&traceFlags.enabled, false, __ATOMIC_RELEASE);
+  __atomic_store_n(&traceFlags.parserProductions, false, __ATOMIC_RELEASE);
+}
+
+void nameTraceThread(const char *name) {
+  snprintf(traceThreadName, sizeof(traceThreadName), "%s", name);
+  if (traceBuffer) memcpy(traceBuffer->threadName, traceThreadName, sizeof(traceThreadName));
+}
+
+// Buffers are kept after their thread exits, so the trace still has its events
+TraceBuffer *currentTraceBuffer() {
+  if (traceBuffer) return traceBuffer;
+
+  auto buffer = (TraceBuffer *)calloc(1, sizeof(TraceBuffer));
+  buffer->events = (TraceEvent *)malloc(TRACE_BUFFER_CAPACITY * sizeof(TraceEvent));
+  if (!buffer->events) {
+    fprintf(stderr, "%s:%d Failed to allocate trace buffer\n", __FILE__, __LINE__);
+    abort();
+  }
+  pthread_mutex_lock(&traceState.mutex);
+  buffer->thread = ++traceState.threads;
+  if (traceThreadName[0]) {
+    memcpy(buffer->threadName, traceThreadName, sizeof(traceThreadName));
+  } else {
+    snprintf(buffer->threadName, sizeof(buffer->threadName), "thread %u", buffer->thread);
+  }
+  buffer->next = traceState.buffers;
+  traceState.buffers = buffer;
+  pthread_mutex_unlock(&traceState.mutex);
+
+  traceBuffer = buffer;
+  return buffer;
+}
+
+void recordTraceEvent(const char *name, double start, double duration, Str detail) {
+  auto buffer = currentTraceBuffer();
+  // Only this thread writes, readers see events up to `written`
+  auto written = __atomic_load_n(&buffer->written, __ATOMIC_RELAXED);
+  auto event = buffer->events + written % TRACE_BUFFER_CAPACITY;
+  event->name = name;
+  event->start = start;
+  event->duration = duration;
+  // End of a long detail (path) tells more than its start
+  auto len = detail.len < sizeof(event->detail) - 1 ? detail.len : sizeof(event->detail) - 1;
+  if (len) memcpy(event->detail, detail.data + detail.len - len, len);
+  event->detail[len] = '\0';
+  __atomic_store_n(&buffer->written, written + 1, __ATOMIC_RELEASE);
+}
+
+void TraceScope::begin(const char *name) {
+  this->name = name;
+  start = now();
+}
+
+void TraceScope::end() {
+  recordTraceEvent(name, start, now() - start, detail);
+}
+
+bool writeTrace(const char *path) {
+  auto out = fopen(path, "w");
+  if (!out) return false;
+
+  pthread_mutex_lock(&traceState.mutex);
+  uint64_t dropped = 0;
+  fputs("{\"traceEvents\":[\n", out);
+  fputs("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"c6\"}}", out);
+  for (auto buffer = traceState.buffers; buffer; buffer = buffer->next) {
+    fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":",
+            buffer->thread);
+    writeJsonString(out, CStringToStr(buffer->threadName));
+    fprintf(out, "}},\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+                 "\"args\":{\"sort_index\":%u}}", buffer->thread, buffer->thread);
+
+    auto written = __atomic_load_n(&buffer->written, __ATOMIC_ACQUIRE);
+    auto first = written > TRACE_BUFFER_CAPACITY ? written - TRACE_BUFFER_CAPACITY : 0;
+    dropped += first;
+    for (auto i = first; i < written; ++i) {
+      auto event = buffer->events + i % TRACE_BUFFER_CAPACITY;
+      fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+              event->name, buffer->thread, (event->start - traceState.origin) * 1e6,
+              event->duration * 1e6);
+      if (event->detail[0]) {
+        fputs(",\"args\":{\"detail\":", out);
+        writeJsonString(out, CStringToStr(event->detail));
+        fputc('}', out);
+      }
+      fputc('}', out);
+    }
+  }
+  fprintf(out, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"droppedEvents\":%lu}}\n",
+          (unsigned long)dropped);
+  pthread_mutex_unlock(&traceState.mutex);
+
+  bool ok = !ferror(out);
+  return fclose(out) == 0 && ok;
+}
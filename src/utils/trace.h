@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "string.h"
+
+// Timeline of what every thread was doing, written in Chrome trace event
+// format (chrome://tracing, ui.perfetto.dev). Each thread records into its own
+// ring buffer, so recording takes no locks; when a buffer is full the oldest
+// events are overwritten. Disabled tracing costs one load per scope.
+//
+// Events of a thread have to nest, so a scope must not span waitForJobEvent:
+// job may resume on another thread.
+struct TraceEvent {
+  const char *name; // static string
+  double start; // see now()
+  double duration;
+  char detail[40]; // NUL terminated, end of longer ones is kept
+};
+
+struct TraceBuffer {
+  TraceEvent *events; // TRACE_BUFFER_CAPACITY
+  uint64_t written; // total, index of next event is written % capacity
+  uint32_t thread; // tid in the trace
+  char threadName[32];
+  TraceBuffer *next;
+};
+
+const uint32_t TRACE_BUFFER_CAPACITY = 1 << 16;
+
+// Clears events recorded so far. Parser productions are traced only if
+// `parserProductions`, there are many of them.
+void startTracing(bool parserProductions);
+void stopTracing();
+
+// Checked by every scope, so they are inline
+struct TraceFlags {
+  bool enabled;
+  bool parserProductions; // only while enabled
+};
+extern TraceFlags traceFlags;
+
+inline bool tracingEnabled() {
+  return __atomic_load_n(&traceFlags.enabled, __ATOMIC_RELAXED);
+}
+
+inline bool tracingParserProductions() {
+  return __atomic_load_n(&traceFlags.parserProductions, __ATOMIC_RELAXED);
+}
+
+// Name of the calling thread in the trace
+void nameTraceThread(const char *name);
+void recordTraceEvent(const char *name, double start, double duration, Str detail);
+
+// Should be called when traced threads are done (or stopped tracing)
+bool writeTrace(const char *path);
+
+struct TraceScope {
+  const char *name; // NULL if tracing was disabled at the start (or name was NULL)
+  Str detail;
+  double start;
+
+  TraceScope(const char *name, Str detail = {}) : name(NULL), detail(detail), start(0) {
+    if (name && tracingEnabled()) begin(name);
+  }
+  ~TraceScope() {
+    if (name) end();
+  }
+  void begin(const char *name);
+  void end();
+
+  TraceScope(const TraceScope &) = delete;
+  TraceScope &operator=(const TraceScope &) = delete;
+};
+
+#define TRACE_CONCAT_(A, B) A##B
+#define TRACE_CONCAT(A, B) TRACE_CONCAT_(A, B)
+// Records the rest of the enclosing block, TRACE_SCOPE("name"[, detail])
+#define TRACE_SCOPE(...) TraceScope TRACE_CONCAT(traceScope, __LINE__)(__VA_ARGS__)
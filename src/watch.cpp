@@ -0,0 +1,131 @@
+#include "watch.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+// Complete writes only, a file being written would be read half way.
+// Attribute changes cover touch and unlink of replaced files.
+const uint32_t FILE_WATCH_EVENTS = IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF;
+
+bool initFileWatcher(FileWatcher *watcher, Compiler *compiler) {
+  *watcher = {};
+  watcher->compiler = compiler;
+  watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  return watcher->fd >= 0;
+}
+
+void deinitFileWatcher(FileWatcher *watcher) {
+  close(watcher->fd);
+  auto files = &watcher->compiler->globalData.files;
+  for (uint32_t i = 0, n = filesCount(files); i < n; ++i) {
+    auto slot = publishedFileSlot(files, i);
+    if (slot) slot->watched = false;
+  }
+}
+
+bool watchLoadedFiles(FileWatcher *watcher) {
+  auto compiler = watcher->compiler;
+  auto files = &compiler->globalData.files;
+  auto count = filesCount(files);
+  auto compilation = compiler->globalData.loadedFiles.compilation;
+  bool unchanged = true;
+  for (uint32_t i = 0; i < count; ++i) {
+    auto slot = publishedFileSlot(files, i);
+    // Path of a file which is no longer used may belong to another file now
+    if (!slot || slot->watched || slot->compilation != compilation) continue;
+
+    // Watch of the same inode is shared, newer slot takes it over
+    int wd = inotify_add_watch(watcher->fd, slot->entry.absolutePath.data, FILE_WATCH_EVENTS);
+    if (wd < 0) {
+      unchanged = false;
+      continue;
+    }
+    while (watcher->fileOfWatch.len <= (uint32_t)wd) {
+      append(&watcher->fileOfWatch, FILE_INDEX_NONE, &compiler->mainAllocator);
+    }
+    watcher->fileOfWatch[wd] = i;
+
+    // Edits made after the file was read but before the watch was added
+    // produced no event
+    struct stat st = {};
+    if (stat(slot->entry.absolutePath.data, &st) != 0 ||
+        (uint64_t)st.st_size != slot->size ||
+        st.st_mtim.tv_sec != slot->mtimeSec || st.st_mtim.tv_nsec != slot->mtimeNsec) {
+      unchanged = false;
+      continue;
+    }
+    // Failed files are loaded again anyway, watch only tells about changes
+    slot->watched = slot->ast != NULL;
+  }
+  return unchanged;
+}
+
+bool waitForFileChanges(FileWatcher *watcher, int timeoutMs) {
+  auto files = &watcher->compiler->globalData.files;
+  pollfd pfd = {watcher->fd, POLLIN, 0};
+  int ready = poll(&pfd, 1, timeoutMs);
+  if (ready <= 0) return false;
+
+  bool changed = false;
+  alignas(inotify_event) char buffer[4096];
+  for (;;) {
+    auto n = read(watcher->fd, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    for (char *p = buffer; p < buffer + n;) {
+      auto event = (inotify_event *)p;
+      p += sizeof(inotify_event) + event->len;
+      changed = true;
+      if (event->mask & IN_Q_OVERFLOW) {
+        // Lost events, every file is checked on disk
+        for (uint32_t i = 0, count = filesCount(files); i < count; ++i) {
+          auto slot = publishedFileSlot(files, i);
+          if (slot) slot->watched = false;
+        }
+      } else if (event->wd >= 0 && (uint32_t)event->wd < watcher->fileOfWatch.len &&
+                 watcher->fileOfWatch[event->wd] != FILE_INDEX_NONE) {
+        fileSlotAt(files, watcher->fileOfWatch[event->wd])->watched = false;
+      }
+    }
+  }
+  return changed;
+}
+
+int runWatchMode(CompilerOptions options) {
+  // Pool shrinks back while waiting for edits
+  if (!options.idleWorkerTimeoutMs) options.idleWorkerTimeoutMs = 5000;
+  auto compiler = (Compiler *)malloc(sizeof(Compiler));
+  initCompiler(compiler, options);
+
+  FileWatcher watcher;
+  if (!initFileWatcher(&watcher, compiler)) {
+    fprintf(stderr, "error Failed to watch files: %s\n", strerror(errno));
+    waitForCompilerToFinish(compiler);
+    deinitCompiler(compiler);
+    free(compiler);
+    return 2;
+  }
+
+  auto start = now();
+  for (;;) {
+    auto status = waitForCompilerToFinish(compiler);
+    fprintf(stderr, "%s in %.1fms, waiting for changes\n",
+            status == 0 ? "Compiled" : "Failed", (now() - start) * 1000.0);
+
+    if (watchLoadedFiles(&watcher)) {
+      while (!waitForFileChanges(&watcher, -1)) {
+        if (errno != EINTR && errno != EAGAIN) {
+          fprintf(stderr, "error Failed to watch files: %s\n", strerror(errno));
+          deinitFileWatcher(&watcher);
+          deinitCompiler(compiler);
+          free(compiler);
+          return 2;
+        }
+      }
+    }
+    start = now();
+    startCompilation(compiler, options.entryPoint);
+  }
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "compiler.h"
+
+// Keeps inotify watches on every file loaded by compilations of a compiler.
+// Files without events since they were read are reused by the next
+// compilation without touching the disk, so after an edit only the changed
+// files are read and parsed again. Used between compilations only.
+struct FileWatcher {
+  Compiler *compiler;
+  int fd;
+  Array<uint32_t> fileOfWatch; // watch descriptor -> file index
+};
+
+bool initFileWatcher(FileWatcher *watcher, Compiler *compiler);
+void deinitFileWatcher(FileWatcher *watcher);
+// Watches files loaded by the last compilation. Returns false if one of them
+// changed before its watch was added, next compilation should start right away.
+bool watchLoadedFiles(FileWatcher *watcher);
+// Waits up to timeoutMs (-1 waits forever) for changes of watched files.
+// Returns true if some changed, they will be checked on disk again.
+bool waitForFileChanges(FileWatcher *watcher, int timeoutMs);
+
+// Compiles entry point of options again every time one of its files changes,
+// returns only if watching fails
+int runWatchMode(CompilerOptions options);